@@ -0,0 +1,33 @@
+// This is an example HepEVD server, that browses the states saved in one or
+// more archive files, i.e. from HepEVDServer::writeArchive or an ArchiveWriter
+// in a batch job. States are only read in from the files as they are viewed.
+
+#include "hep_evd.h"
+
+#include <string>
+#include <vector>
+
+int main(int argc, char *argv[]) {
+
+    if (argc < 2) {
+        std::cout << "Usage: " << argv[0] << " archive.hepevd [more.hepevd ...]" << std::endl;
+        return 1;
+    }
+
+    const std::vector<std::string> archives(argv + 1, argv + argc);
+
+    HepEVD::HepEVDServer server;
+
+    try {
+        server.openArchives(archives);
+    } catch (const std::exception &e) {
+        std::cout << "Failed to open archives: " << e.what() << std::endl;
+        return 1;
+    }
+
+    std::cout << "Opened " << server.getNumberOfEventStates() << " states from " << archives.size() << " archive(s)."
+              << std::endl;
+
+    server.startServer();
+    return 0;
+}
@@ -0,0 +1,305 @@
+//
+// Archive Tests
+//
+// Round trip states through the archive encoding (see include/archive.h),
+// both on their own and via an archive file, and check that truncated or
+// corrupt data is rejected rather than read past. Also check the particle
+// hits that the encoding relies on are only stored once.
+
+#include "hep_evd.h"
+#include "test_helpers.h"
+
+#include <cstdio>
+#include <fstream>
+#include <random>
+#include <unistd.h>
+
+using namespace HepEVD;
+
+// Build a state using every part of the encoding: optional hit columns,
+// particles with a hierarchy, each type of marker and an image.
+EventState makeState(const std::string &name, const unsigned int seed) {
+    std::mt19937 gen(seed);
+    std::uniform_real_distribution<double> dis(-500, 500);
+
+    Hits hits;
+    for (unsigned int i = 0; i < 1000; ++i) {
+        Hit hit({dis(gen), dis(gen), dis(gen)}, dis(gen));
+
+        if (i % 3 == 0) {
+            hit.setDim(TWO_D);
+            hit.setHitType(TWO_D_U);
+            hit.setWidth("x", 1.0);
+        }
+        if (i % 5 == 0)
+            hit.setLabel("Label " + std::to_string(i % 4));
+        if (i % 7 == 0)
+            hit.setColour("red");
+        if (i % 2 == 0)
+            hit.addProperties(
+                {{{"Score", PropertyType::NUMERIC}, dis(gen)}, {{"Track", PropertyType::CATEGORIC}, 1.0}});
+
+        hits.push_back(hit);
+    }
+
+    MCHits mcHits;
+    for (unsigned int i = 0; i < 100; ++i)
+        mcHits.push_back(MCHit({dis(gen), dis(gen), dis(gen)}, 13, dis(gen)));
+
+    Particles particles;
+    for (unsigned int i = 0; i < 5; ++i) {
+        Hits particleHits(hits.begin() + i * 10, hits.begin() + (i + 1) * 10);
+        particles.push_back(Particle(particleHits, name + "_particle_" + std::to_string(i), "Particle"));
+    }
+    // And one with hits the state doesn't have.
+    Hits ownHits;
+    for (unsigned int i = 0; i < 20; ++i)
+        ownHits.push_back(Hit({dis(gen), dis(gen), dis(gen)}, dis(gen)));
+    particles.push_back(Particle(ownHits, name + "_particle_own", "Particle"));
+
+    particles[1].setParentID(particles[0].getID());
+    particles[0].setChildIDs({particles[1].getID()});
+
+    Markers markers({Point({1, 2, 3}), Line({0, 0, 0}, {10, 10, 10}), Ring({5, 5, 5}, 1.0, 2.0)});
+
+    std::vector<float> pixels(64 * 32);
+    for (size_t i = 0; i < pixels.size(); ++i)
+        pixels[i] = static_cast<float>(i % 17);
+    Images images({MonochromeImage(pixels, 64, 32, "Image")});
+
+    return EventState(name, particles, hits, mcHits, markers, images, "\\nu_\\mu");
+}
+
+void checkStatesMatch(const EventState &a, const EventState &b) {
+    CHECK(a.m_name == b.m_name);
+    CHECK(a.m_mcTruth == b.m_mcTruth);
+
+    CHECK(a.m_hits.size() == b.m_hits.size());
+    for (size_t i = 0; i < std::min(a.m_hits.size(), b.m_hits.size()); ++i)
+        CHECK(hitsMatch(a.m_hits[i], b.m_hits[i]));
+
+    CHECK(a.m_mcHits.size() == b.m_mcHits.size());
+    CHECK(a.m_particleHits.size() == b.m_particleHits.size());
+    CHECK(a.m_particleHitRefs == b.m_particleHitRefs);
+    CHECK(a.m_markers.size() == b.m_markers.size());
+    CHECK(a.m_images.size() == b.m_images.size());
+
+    CHECK(a.m_particles.size() == b.m_particles.size());
+    for (size_t i = 0; i < std::min(a.m_particles.size(), b.m_particles.size()); ++i) {
+        CHECK(a.m_particles[i].getID() == b.m_particles[i].getID());
+        CHECK(a.m_particles[i].getParentID() == b.m_particles[i].getParentID());
+    }
+
+    // Everything else is covered by the encoding itself matching.
+    CHECK(encodeEventState(a) == encodeEventState(b));
+}
+
+void testStateRoundTrip() {
+    const EventState state = makeState("Round Trip", 1);
+    const std::string block = encodeEventState(state);
+
+    checkStatesMatch(state, decodeEventState(block.data(), block.size()));
+    CHECK(readArchiveString(block.data(), block.size(), ArchiveSectionType::NAME) == "Round Trip");
+
+    // An empty state should survive too.
+    const std::string emptyBlock = encodeEventState(EventState());
+    checkStatesMatch(EventState(), decodeEventState(emptyBlock.data(), emptyBlock.size()));
+}
+
+void testTruncatedState() {
+    const std::string block = encodeEventState(makeState("Truncated", 2));
+
+    for (size_t size = 0; size < block.size(); size += 7)
+        CHECK_THROWS(decodeEventState(block.data(), size));
+}
+
+void testCorruptState() {
+    const std::string block = encodeEventState(makeState("Corrupt", 3));
+
+    std::string badMagic = block;
+    badMagic[0] ^= 0xFF;
+    CHECK_THROWS(decodeEventState(badMagic.data(), badMagic.size()));
+
+    // Point the first section past the end of the block.
+    std::string badSection = block;
+    ArchiveSection section;
+    std::memcpy(&section, &badSection[sizeof(ArchiveStateHeader)], sizeof(section));
+    section.offset = block.size() + 8;
+    std::memcpy(&badSection[sizeof(ArchiveStateHeader)], &section, sizeof(section));
+    CHECK_THROWS(decodeEventState(badSection.data(), badSection.size()));
+
+    // Claim far more hits than there are.
+    const auto sections = readArchiveSections(block.data(), block.size());
+    for (size_t i = 0; i < sections.size(); ++i) {
+        std::string badCount = block;
+        const size_t tableOffset = sizeof(ArchiveStateHeader) + i * sizeof(ArchiveSection);
+        std::memcpy(&section, &badCount[tableOffset], sizeof(section));
+
+        if (section.count == 0)
+            continue;
+
+        section.count = UINT64_MAX / 2;
+        std::memcpy(&badCount[tableOffset], &section, sizeof(section));
+        CHECK_THROWS(decodeEventState(badCount.data(), badCount.size()));
+    }
+
+    // Randomly damaged blocks must either decode or throw, never read out of bounds.
+    std::mt19937 gen(4);
+    std::uniform_int_distribution<size_t> disPos(0, block.size() - 1);
+    for (unsigned int i = 0; i < 200; ++i) {
+        std::string damaged = block;
+        for (unsigned int j = 0; j < 4; ++j)
+            damaged[disPos(gen)] = static_cast<char>(gen());
+
+        try {
+            decodeEventState(damaged.data(), damaged.size());
+        } catch (const std::exception &) {
+        }
+    }
+}
+
+// Particle hits the state already has are referred to, not stored again.
+void testParticleHits() {
+    const EventState state = makeState("Particle Hits", 7);
+    CHECK(state.m_particleHits.size() == 20);
+    CHECK(state.m_particleHitRefs.size() == 70);
+
+    for (size_t i = 0; i < 5; ++i) {
+        const Hits hits = state.getParticleHits(state.m_particles[i]);
+        CHECK(hits.size() == 10);
+        for (size_t j = 0; j < hits.size(); ++j)
+            CHECK(hitsMatch(hits[j], state.m_hits[i * 10 + j]));
+    }
+
+    // Hits shared between particles are only stored once too.
+    const Hits shared = state.getParticleHits(state.m_particles[5]);
+    EventState sharing("Sharing", {Particle(shared, "a"), Particle(shared, "b")});
+    CHECK(sharing.m_particleHits.size() == shared.size());
+    CHECK(sharing.getParticleHits(sharing.m_particles[1]).size() == shared.size());
+
+    // Particles read straight from a state have no hits of their own, so
+    // can't be added again, but those given back by the server can be.
+    EventState copy("Copy");
+    CHECK_THROWS(copy.addParticles(state.m_particles));
+
+    Particles particles = state.m_particles;
+    for (auto &particle : particles)
+        particle.restoreHits(state.getParticleHits(particle));
+
+    Volumes volumes({BoxVolume(Position({0, 0, 0}), 1000, 1000, 1000)});
+    HepEVDServer server(volumes);
+    server.addEventState("Server", particles, state.m_hits.get());
+    server.swapEventState("Server");
+
+    const Particles serverParticles = server.getParticles();
+    CHECK(serverParticles.size() == particles.size());
+    for (size_t i = 0; i < serverParticles.size(); ++i)
+        CHECK(serverParticles[i].getHits().size() == particles[i].getHits().size());
+
+    copy.addParticles(serverParticles);
+    CHECK(copy.m_particleHitRefs.size() == 70);
+    CHECK(copy.m_particleHits.size() == 70);
+}
+
+std::string getTempPath(const std::string &name) {
+    const char *tmpDir = std::getenv("TMPDIR");
+    return std::string(tmpDir ? tmpDir : "/tmp") + "/hepevd_test_" + std::to_string(getpid()) + "_" + name;
+}
+
+void testArchiveFile() {
+    const std::string path = getTempPath("archive.hepevd");
+    const std::vector<EventState> states({makeState("First", 5), makeState("Second", 6), EventState("Empty")});
+
+    {
+        ArchiveWriter writer(path);
+        for (const auto &state : states)
+            writer.addState(state);
+        writer.close();
+        CHECK(writer.getNumStates() == states.size());
+    }
+
+    {
+        ArchiveFile archive(path);
+        CHECK(archive.getNumStates() == states.size());
+
+        for (size_t i = 0; i < states.size(); ++i) {
+            CHECK(archive.getStateName(i) == states[i].m_name);
+            CHECK(archive.getEntry(i).numHits == states[i].m_hits.size());
+            CHECK(archive.getStateInfo(i)["mcTruth"] == states[i].m_mcTruth);
+            checkStatesMatch(states[i], archive.readState(i));
+        }
+    }
+
+    // Cut the file off part way through the state table.
+    std::string contents;
+    {
+        std::ifstream file(path, std::ios::binary);
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(contents.data(), contents.size() - sizeof(ArchiveStateEntry));
+    }
+    CHECK_THROWS(ArchiveFile archive(path));
+
+    // Not an archive at all.
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file << std::string(sizeof(ArchiveHeader) * 2, 'x');
+    }
+    CHECK_THROWS(ArchiveFile archive(path));
+
+    // An archive that was never closed, such as from a job that was killed,
+    // still has the states that were written out, and its metadata.
+    {
+        ArchiveWriter writer(path);
+        writer.addState(states[0]);
+        writer.addState(states[1]);
+
+        ArchiveFile archive(path);
+        CHECK(archive.isRecovered());
+        CHECK(archive.getMetadata().contains("detectorGeometry"));
+        CHECK(archive.getNumStates() == 2);
+        for (size_t i = 0; i < archive.getNumStates(); ++i) {
+            CHECK(archive.getEntry(i).numHits == states[i].m_hits.size());
+            checkStatesMatch(states[i], archive.readState(i));
+        }
+
+        std::ifstream file(path, std::ios::binary);
+        contents.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+    }
+
+    // And with the last state only part written.
+    {
+        std::ofstream file(path, std::ios::binary | std::ios::trunc);
+        file.write(contents.data(), contents.size() - 100);
+    }
+    {
+        ArchiveFile archive(path);
+        CHECK(archive.isRecovered());
+        CHECK(archive.getNumStates() == 1);
+        checkStatesMatch(states[0], archive.readState(0));
+    }
+
+    // Archives that were closed weren't recovered.
+    {
+        ArchiveWriter writer(path);
+        writer.close();
+
+        ArchiveFile archive(path);
+        CHECK(!archive.isRecovered());
+        CHECK(archive.getNumStates() == 0);
+    }
+
+    std::remove(path.c_str());
+}
+
+int main(void) {
+    testStateRoundTrip();
+    testTruncatedState();
+    testCorruptState();
+    testParticleHits();
+    testArchiveFile();
+
+    return finishTests("test_archive");
+}
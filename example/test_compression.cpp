@@ -0,0 +1,159 @@
+//
+// Compression Tests
+//
+// Round trip buffers through the LZ codec and the filtered, chunked
+// CompressedBuffer (see include/compression.h), and check that damaged
+// compressed data is rejected rather than written past.
+
+#include "hep_evd.h"
+#include "test_helpers.h"
+
+#include <random>
+
+using namespace HepEVD;
+
+std::string makeRandom(const size_t size, std::mt19937 &gen) {
+    std::string data(size, '\0');
+    for (auto &c : data)
+        c = static_cast<char>(gen());
+    return data;
+}
+
+// Repeated words and runs of the same byte, with a little noise.
+std::string makeCompressible(const size_t size, std::mt19937 &gen) {
+    const std::vector<std::string> words({"hit", "particle", "marker", "HepEVD", std::string(300, 'z')});
+
+    std::string data;
+    while (data.size() < size) {
+        data += words[gen() % words.size()];
+        if (gen() % 8 == 0)
+            data.push_back(static_cast<char>(gen()));
+    }
+    data.resize(size);
+    return data;
+}
+
+bool lzRoundTrips(const std::string &data) {
+    const std::string compressed = lzCompress(data.data(), data.size());
+
+    std::string output(data.size(), '\0');
+    lzDecompress(compressed.data(), compressed.size(), &output[0], output.size());
+    return output == data;
+}
+
+void testLZRoundTrip() {
+    std::mt19937 gen(1);
+
+    for (const size_t size : {0, 1, 4, 9, 13, 64, 1000, 70000, 300000}) {
+        CHECK(lzRoundTrips(makeRandom(size, gen)));
+        CHECK(lzRoundTrips(makeCompressible(size, gen)));
+        CHECK(lzRoundTrips(std::string(size, 'a')));
+    }
+
+    // Matches further back than the largest offset can't be used.
+    const std::string block = makeRandom(1000, gen);
+    CHECK(lzRoundTrips(block + makeRandom(70000, gen) + block));
+
+    const std::string compressible = makeCompressible(100000, gen);
+    CHECK(lzCompress(compressible.data(), compressible.size()).size() < compressible.size() / 4);
+}
+
+void testLZCorrupt() {
+    std::mt19937 gen(2);
+    const std::string data = makeCompressible(20000, gen);
+    const std::string compressed = lzCompress(data.data(), data.size());
+    std::string output(data.size(), '\0');
+
+    // The wrong size of output.
+    CHECK_THROWS(lzDecompress(compressed.data(), compressed.size(), &output[0], output.size() - 1));
+    std::string larger(data.size() + 1, '\0');
+    CHECK_THROWS(lzDecompress(compressed.data(), compressed.size(), &larger[0], larger.size()));
+
+    // Truncated input.
+    for (size_t size = 0; size < compressed.size(); size += 13)
+        CHECK_THROWS(lzDecompress(compressed.data(), size, &output[0], output.size()));
+
+    // Damaged input must either decompress or throw, never write out of bounds.
+    std::uniform_int_distribution<size_t> disPos(0, compressed.size() - 1);
+    for (unsigned int i = 0; i < 500; ++i) {
+        std::string damaged = compressed;
+        damaged[disPos(gen)] = static_cast<char>(gen());
+
+        try {
+            lzDecompress(damaged.data(), damaged.size(), &output[0], output.size());
+        } catch (const std::exception &) {
+        }
+    }
+}
+
+void testCompressedBuffer() {
+    std::mt19937 gen(3);
+    std::uniform_real_distribution<double> dis(-500, 500);
+
+    // Sorted doubles and floats, as the hit positions would be, over more
+    // than one chunk, with some text between them.
+    const size_t nDoubles = CompressedBuffer::CHUNK_SIZE / 4;
+    const size_t nFloats = 1000;
+    std::vector<double> doubles(nDoubles);
+    std::vector<float> floats(nFloats);
+    for (auto &value : doubles)
+        value = dis(gen);
+    for (auto &value : floats)
+        value = dis(gen);
+    std::sort(doubles.begin(), doubles.end());
+
+    const std::string text = makeCompressible(1001, gen);
+    std::string data(reinterpret_cast<const char *>(doubles.data()), nDoubles * sizeof(double));
+    data += text;
+    const size_t floatOffset = data.size();
+    data.append(reinterpret_cast<const char *>(floats.data()), nFloats * sizeof(float));
+
+    const std::vector<NumericColumn> columns({{0, nDoubles, sizeof(double)}, {floatOffset, nFloats, sizeof(float)}});
+    const CompressedBuffer buffer(data, columns);
+
+    CHECK(buffer.getSize() == data.size());
+    CHECK(buffer.getCompressedSize() < data.size());
+    CHECK(buffer.decompress() == data);
+
+    // And the same without any filtering.
+    const CompressedBuffer unfiltered(data, {});
+    CHECK(unfiltered.decompress() == data);
+
+    CHECK(CompressedBuffer().decompress().empty());
+
+    // Columns have to fit in the buffer.
+    CHECK_THROWS(CompressedBuffer(data, {{data.size() - 4, 1, sizeof(double)}}));
+    CHECK_THROWS(CompressedBuffer(data, {{0, 1, 2}}));
+    CHECK_THROWS(CompressedBuffer(data, {{data.size() + 8, 0, sizeof(double)}}));
+}
+
+void testCompressedStateStore() {
+    CompressedStateStore store;
+
+    Hits hits;
+    for (unsigned int i = 0; i < 5000; ++i)
+        hits.push_back(Hit({i * 0.5, i * 0.25, 100.0 - i}, i));
+
+    const EventState state("Compressed", {}, hits, {}, {}, {}, "\\nu_e");
+    const size_t index = store.addState(state);
+
+    CHECK(store.getStateName(index) == "Compressed");
+    CHECK(store.getStateInfo(index)["mcTruth"] == "\\nu_e");
+    CHECK(store.getCompressedSize() < store.getSize());
+    CHECK(encodeEventState(store.readState(index)) == encodeEventState(state));
+
+    // Removed states free their memory, and their index is reused.
+    store.removeState(index);
+    CHECK(store.getSize() == 0);
+    CHECK_THROWS(store.readState(index));
+    CHECK(store.addState(state) == index);
+}
+
+int main(void) {
+    testLZRoundTrip();
+    testLZCorrupt();
+    testCompressedBuffer();
+    testCompressedStateStore();
+
+    return finishTests("test_compression");
+}
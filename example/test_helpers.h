@@ -0,0 +1,51 @@
+//
+// Test Helpers
+//
+// Just enough to write the test programs with, so they need nothing beyond
+// HepEVD itself. Each failing check is printed, and counted towards the
+// exit code of the test.
+
+#ifndef HEP_EVD_TEST_HELPERS_H
+#define HEP_EVD_TEST_HELPERS_H
+
+#include <exception>
+#include <iostream>
+
+inline int &testFailures() {
+    static int failures = 0;
+    return failures;
+}
+
+#define CHECK(condition)                                                                                               \
+    do {                                                                                                               \
+        if (!(condition)) {                                                                                            \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": Check failed: " #condition << std::endl;                    \
+            ++testFailures();                                                                                          \
+        }                                                                                                              \
+    } while (0)
+
+// Check that the given code throws, whatever the exception.
+#define CHECK_THROWS(code)                                                                                             \
+    do {                                                                                                               \
+        bool threw = false;                                                                                            \
+        try {                                                                                                          \
+            code;                                                                                                      \
+        } catch (const std::exception &) {                                                                             \
+            threw = true;                                                                                              \
+        }                                                                                                              \
+        if (!threw) {                                                                                                  \
+            std::cerr << __FILE__ << ":" << __LINE__ << ": Expected an exception from: " #code << std::endl;           \
+            ++testFailures();                                                                                          \
+        }                                                                                                              \
+    } while (0)
+
+inline int finishTests(const char *name) {
+    if (testFailures() == 0)
+        std::cout << name << ": All checks passed." << std::endl;
+    else
+        std::cerr << name << ": " << testFailures() << " check(s) failed!" << std::endl;
+
+    return testFailures() == 0 ? 0 : 1;
+}
+
+#endif // HEP_EVD_TEST_HELPERS_H
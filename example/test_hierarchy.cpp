@@ -0,0 +1,154 @@
+//
+// Particle Hierarchy Tests
+//
+// Check the depth-first ordering of the particle hierarchy (see
+// include/particle.h), and that broken parent / child links, including
+// cycles, still leave every particle in exactly one tree.
+
+#include "hep_evd.h"
+#include "test_helpers.h"
+
+#include <algorithm>
+
+using namespace HepEVD;
+
+// Make particles from (ID, parent ID, child IDs), with no hits.
+Particles makeParticles(const std::vector<std::tuple<std::string, std::string, std::vector<std::string>>> &links) {
+    Particles particles;
+
+    for (const auto &link : links) {
+        Particle particle({}, std::get<0>(link));
+        particle.setParentID(std::get<1>(link));
+        particle.setChildIDs(std::get<2>(link));
+        particles.push_back(particle);
+    }
+
+    return particles;
+}
+
+std::vector<unsigned int> getIndices(const ParticleHierarchy &hierarchy, const std::vector<std::string> &ids) {
+    std::vector<unsigned int> indices;
+    for (const auto &id : ids)
+        indices.push_back(hierarchy.getIndex(id));
+    return indices;
+}
+
+// Walking every root in turn should visit each particle once, parents before
+// their children, with the depths and subtree sizes matching the parents.
+void checkIsForest(const ParticleHierarchy &hierarchy) {
+    std::vector<unsigned int> order;
+    for (const auto root : hierarchy.getRoots()) {
+        CHECK(hierarchy.getParent(root) == ParticleHierarchy::NO_PARENT);
+
+        const auto subtree = hierarchy.getSubtree(root);
+        order.insert(order.end(), subtree.begin(), subtree.end());
+    }
+
+    CHECK(order.size() == hierarchy.size());
+
+    std::vector<int> position(hierarchy.size(), -1);
+    for (size_t i = 0; i < order.size(); ++i) {
+        CHECK(position.at(order[i]) == -1);
+        position.at(order[i]) = i;
+    }
+
+    for (unsigned int i = 0; i < hierarchy.size(); ++i) {
+        const int parent = hierarchy.getParent(i);
+        if (parent == ParticleHierarchy::NO_PARENT) {
+            CHECK(hierarchy.getDepth(i) == 0);
+            CHECK(hierarchy.getRoot(i) == i);
+            continue;
+        }
+
+        CHECK(position[parent] < position[i]);
+        CHECK(hierarchy.getDepth(i) == hierarchy.getDepth(parent) + 1);
+        CHECK(hierarchy.getRoot(i) == hierarchy.getRoot(parent));
+
+        unsigned int childSizes = 1;
+        for (const auto child : hierarchy.getChildren(i))
+            childSizes += hierarchy.getSubtreeSize(child);
+        CHECK(hierarchy.getSubtreeSize(i) == childSizes);
+    }
+}
+
+void testOrder() {
+    const Particles particles = makeParticles({{"a", "", {}},
+                                              {"b", "a", {}},
+                                              {"c", "a", {}},
+                                              {"d", "b", {}},
+                                              {"e", "", {"f"}},
+                                              {"f", "", {}},
+                                              {"g", "a", {}},
+                                              {"h", "unknown", {"g"}}});
+    const ParticleHierarchy hierarchy(particles);
+    checkIsForest(hierarchy);
+
+    // Children are visited in the order they were added.
+    CHECK(hierarchy.getRoots() == getIndices(hierarchy, {"a", "e", "h"}));
+    CHECK(hierarchy.getSubtree(0) == getIndices(hierarchy, {"a", "b", "d", "c", "g"}));
+    CHECK(hierarchy.getSubtree(1) == getIndices(hierarchy, {"b", "d"}));
+    CHECK(hierarchy.getChildren(0) == getIndices(hierarchy, {"b", "c", "g"}));
+
+    CHECK(hierarchy.getDepth(hierarchy.getIndex("d")) == 2);
+    CHECK(hierarchy.getSubtreeSize(hierarchy.getIndex("a")) == 5);
+
+    // A child list is only used if the particle has no parent of its own.
+    CHECK(hierarchy.getParent(hierarchy.getIndex("f")) == hierarchy.getIndex("e"));
+    CHECK(hierarchy.getParent(hierarchy.getIndex("g")) == hierarchy.getIndex("a"));
+
+    CHECK(hierarchy.getIndex("unknown") == -1);
+}
+
+void testCycles() {
+    // A three particle loop, a particle that is its own parent, and a pair
+    // that are each other's parent, hanging off of the loop.
+    const Particles particles = makeParticles({{"x", "z", {}},
+                                              {"y", "x", {}},
+                                              {"z", "y", {}},
+                                              {"self", "self", {"self"}},
+                                              {"p", "q", {}},
+                                              {"q", "p", {}},
+                                              {"leaf", "y", {}}});
+    const ParticleHierarchy hierarchy(particles);
+    checkIsForest(hierarchy);
+
+    // Each loop is broken in exactly one place.
+    CHECK(hierarchy.getRoots().size() == 3);
+    CHECK(hierarchy.getParent(hierarchy.getIndex("self")) == ParticleHierarchy::NO_PARENT);
+    CHECK(hierarchy.getRoot(hierarchy.getIndex("x")) == hierarchy.getRoot(hierarchy.getIndex("leaf")));
+    CHECK(hierarchy.getRoot(hierarchy.getIndex("p")) == hierarchy.getRoot(hierarchy.getIndex("q")));
+
+    // A long chain that loops back to its start.
+    std::vector<std::tuple<std::string, std::string, std::vector<std::string>>> chain;
+    for (unsigned int i = 0; i < 10000; ++i)
+        chain.push_back({std::to_string(i), std::to_string((i + 1) % 10000), {}});
+
+    const ParticleHierarchy chainHierarchy(makeParticles(chain));
+    checkIsForest(chainHierarchy);
+    CHECK(chainHierarchy.getRoots().size() == 1);
+    CHECK(chainHierarchy.getSubtreeSize(chainHierarchy.getRoots()[0]) == 10000);
+}
+
+void testStateHierarchy() {
+    EventState state("Hierarchy", makeParticles({{"a", "", {}}, {"b", "a", {}}}));
+
+    // Built once, then reused until the particles change.
+    const ParticleHierarchy &hierarchy = state.getHierarchy();
+    CHECK(&state.getHierarchy() == &hierarchy);
+    CHECK(hierarchy.size() == 2);
+
+    state.addParticles(makeParticles({{"c", "b", {}}}));
+    CHECK(state.getHierarchy().size() == 3);
+    CHECK(state.getHierarchy().getDepth(2) == 2);
+
+    state.clear();
+    CHECK(state.getHierarchy().size() == 0);
+}
+
+int main(void) {
+    testOrder();
+    testCycles();
+    testStateHierarchy();
+
+    return finishTests("test_hierarchy");
+}
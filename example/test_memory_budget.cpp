@@ -0,0 +1,187 @@
+//
+// Memory Budget Tests
+//
+// Check that states evicted to keep under a memory budget (see
+// HepEVDServer::setMemoryBudget) come back unchanged, and that the spill
+// file they go to doesn't keep growing as they are swapped in and out.
+
+#include "hep_evd.h"
+#include "test_helpers.h"
+
+#include <cstdio>
+#include <random>
+#include <unistd.h>
+
+using namespace HepEVD;
+
+constexpr unsigned int NUM_STATES = 20;
+constexpr unsigned int HITS_PER_STATE = 2000;
+
+Hits makeHits(std::mt19937 &gen, const unsigned int numHits = HITS_PER_STATE) {
+    std::uniform_real_distribution<double> dis(-500, 500);
+
+    Hits hits;
+    for (unsigned int i = 0; i < numHits; ++i)
+        hits.push_back(Hit({dis(gen), dis(gen), dis(gen)}, dis(gen)));
+    return hits;
+}
+
+// Swap to a state, and check it matches what it was made with.
+void checkState(HepEVDServer &server, const int id, const std::vector<std::string> &expected) {
+    server.swapEventState(id);
+    CHECK(encodeEventState(*server.viewState()) == expected.at(id));
+}
+
+void testSpilledStates() {
+    std::mt19937 gen(1);
+
+    Volumes volumes({BoxVolume(Position({0, 0, 0}), 1000, 1000, 1000)});
+    HepEVDServer server(volumes);
+
+    // Room for roughly four states at once.
+    const size_t stateSize = EventState("Size", {}, makeHits(gen)).getMemoryUsage();
+    server.setMemoryBudget(4 * stateSize);
+
+    std::vector<std::string> expected({encodeEventState(*server.getState())});
+    size_t totalSize = expected[0].size();
+
+    for (unsigned int i = 1; i <= NUM_STATES; ++i) {
+        const std::string name = "State " + std::to_string(i);
+        const Particles particles({Particle(makeHits(gen), "particle_" + std::to_string(i))});
+        const Hits hits = makeHits(gen);
+
+        server.addEventState(name, particles, hits);
+        expected.push_back(encodeEventState(EventState(name, particles, hits)));
+        totalSize += expected.back().size();
+    }
+
+    CHECK(server.getNumberOfEventStates() == NUM_STATES + 1);
+    CHECK(server.getNumResidentStates() < NUM_STATES / 2);
+    CHECK(server.getSpillFileSize() > 0);
+
+    // Every state should come back as it went out, however often it is swapped.
+    for (unsigned int i = 0; i <= NUM_STATES; ++i)
+        checkState(server, i, expected);
+
+    size_t maxSpillSize = 0;
+    std::uniform_int_distribution<int> disState(0, NUM_STATES);
+    for (unsigned int i = 0; i < 500; ++i) {
+        checkState(server, disState(gen), expected);
+        CHECK(server.getNumResidentStates() < NUM_STATES / 2);
+        maxSpillSize = std::max(maxSpillSize, server.getSpillFileSize());
+    }
+
+    // The space of states that are read back is reused, so the file never
+    // needs to be larger than every state at once.
+    CHECK(maxSpillSize > 0);
+    CHECK(maxSpillSize <= totalSize);
+
+    // Without a budget, everything is read back in as it is used, leaving
+    // the spill file empty.
+    server.setMemoryBudget(0);
+    for (unsigned int i = 0; i <= NUM_STATES; ++i)
+        checkState(server, i, expected);
+    CHECK(server.getNumResidentStates() == NUM_STATES + 1);
+    CHECK(server.getSpillFileSize() == 0);
+
+    // And the same again, with the states compressed instead.
+    server.setStateCompression(true);
+    CHECK(server.getNumResidentStates() <= 2);
+    for (unsigned int i = 0; i < 100; ++i)
+        checkState(server, disState(gen), expected);
+}
+
+// States from an archive are dropped rather than spilled when evicted, but
+// only until they are changed.
+void testArchiveStates() {
+    std::mt19937 gen(3);
+
+    const char *tmpDir = std::getenv("TMPDIR");
+    const std::string path =
+        std::string(tmpDir ? tmpDir : "/tmp") + "/hepevd_test_" + std::to_string(getpid()) + "_budget.hepevd";
+
+    Volumes volumes({BoxVolume(Position({0, 0, 0}), 1000, 1000, 1000)});
+    std::vector<std::string> expected;
+    {
+        ArchiveWriter writer(path);
+        for (unsigned int i = 0; i < 10; ++i) {
+            const EventState state("Archived " + std::to_string(i), {}, makeHits(gen));
+            writer.addState(state);
+            expected.push_back(encodeEventState(state));
+        }
+    }
+
+    HepEVDServer server(volumes);
+    server.openArchives({path});
+    server.setMemoryBudget(3 * EventState("Size", {}, makeHits(gen)).getMemoryUsage());
+
+    // Only viewing states never needs the spill file.
+    for (unsigned int i = 0; i < 10; ++i) {
+        server.swapEventState(i);
+        CHECK(encodeEventState(*server.viewState()) == expected.at(i));
+    }
+    CHECK(server.getSpillFileSize() == 0);
+    CHECK(server.getNumResidentStates() < 10);
+
+    // But a changed state has to be kept.
+    server.swapEventState(2);
+    server.addHits(makeHits(gen, 10));
+    expected[2] = encodeEventState(*server.viewState());
+
+    for (unsigned int i = 0; i < 10; ++i)
+        checkState(server, i, expected);
+    CHECK(server.getSpillFileSize() > 0);
+
+    std::remove(path.c_str());
+}
+
+void testSpillFile() {
+    std::mt19937 gen(2);
+    SpillFile spillFile;
+
+    std::vector<EventState> states;
+    for (unsigned int i = 0; i < 8; ++i)
+        states.push_back(EventState("Spilled " + std::to_string(i), {}, makeHits(gen, (i + 1) * 250), {}, {}, {},
+                                    "Truth " + std::to_string(i)));
+
+    // Spill and read back states of different sizes, in a random order, a
+    // few at a time, as the server would.
+    std::vector<std::pair<size_t, size_t>> spilled;
+    size_t maxSize = 0;
+
+    for (unsigned int i = 0; i < 1000; ++i) {
+        if (spilled.size() < 4 && (spilled.empty() || gen() % 2 == 0)) {
+            const size_t state = gen() % states.size();
+            spilled.push_back({state, spillFile.addState(states[state])});
+        } else {
+            const size_t pick = gen() % spilled.size();
+            const auto entry = spilled[pick];
+            spilled.erase(spilled.begin() + pick);
+
+            CHECK(spillFile.getStateName(entry.second) == states[entry.first].m_name);
+            CHECK(spillFile.getStateMCTruth(entry.second) == states[entry.first].m_mcTruth);
+            CHECK(encodeEventState(spillFile.readState(entry.second)) == encodeEventState(states[entry.first]));
+            spillFile.removeState(entry.second);
+        }
+
+        maxSize = std::max(maxSize, spillFile.getSize());
+    }
+
+    // Only four states are spilled at once, so the file and the number of
+    // indices used should stay around that size.
+    const size_t stateSize = encodeEventState(states.back()).size();
+    CHECK(maxSize <= 6 * stateSize);
+    CHECK(spillFile.getNumStates() <= 4);
+
+    for (const auto &entry : spilled)
+        spillFile.removeState(entry.second);
+    CHECK(spillFile.getSize() == 0);
+}
+
+int main(void) {
+    testSpilledStates();
+    testArchiveStates();
+    testSpillFile();
+
+    return finishTests("test_memory_budget");
+}
@@ -1,8 +1,18 @@
+import os
+import pickle
 import random
+import struct
+import tempfile
+
 import numpy as np
 
 import HepEVD
 
+try:
+    import pyarrow as pa
+except ImportError:
+    pa = None
+
 
 def main() -> None:
     # Now, lets enable verbose output.
@@ -276,5 +286,150 @@ def main() -> None:
     return
 
 
+# The rest are checks that data going in and out of HepEVD comes back the same.
+# They only need a geometry to be set, as main() leaves it.
+def make_hits(num_hits: int) -> np.ndarray:
+    # (x, y, z, energy, dimension, view), with a mix of 2D and 3D hits.
+    hits = np.zeros((num_hits, 6))
+    hits[:, :4] = np.random.uniform(-500, 500, (num_hits, 4))
+    hits[: num_hits // 2, 4] = int(HepEVD.HitDimension.TWO_D)
+    hits[: num_hits // 2, 5] = int(HepEVD.HitType.TWO_D_W)
+    return hits
+
+
+def test_hits_round_trip() -> None:
+    HepEVD.reset_server()
+
+    # Hits should come back exactly as they went in, in the same layout.
+    hits = make_hits(1000)
+    HepEVD.add_hits(hits)
+
+    output, properties = HepEVD.get_hits()
+    assert output.shape == hits.shape
+    np.testing.assert_array_equal(output, hits)
+    assert len(properties) == 0
+
+    # Properties added to only some hits should be NaN for the rest.
+    more_hits = make_hits(500)
+    handles = HepEVD.add_hits(more_hits, return_handles=True)
+    assert len(handles) == len(more_hits)
+
+    scores = np.arange(len(more_hits), dtype=np.float64)
+    HepEVD.add_hit_properties_bulk(handles, {"score": scores})
+
+    output, properties = HepEVD.get_hits()
+    np.testing.assert_array_equal(output, np.concatenate((hits, more_hits)))
+    assert np.all(np.isnan(properties["score"][: len(hits)]))
+    np.testing.assert_array_equal(properties["score"][len(hits) :], scores)
+
+    # Named columns, with any extra column becoming a property.
+    HepEVD.reset_server()
+    columns = {name: hits[:, i] for i, name in enumerate(["x", "y", "z", "energy"])}
+    columns["charge"] = hits[:, 0] * 2
+    HepEVD.add_hits(columns)
+
+    output, properties = HepEVD.get_hits()
+    np.testing.assert_array_equal(output[:, :4], hits[:, :4])
+    np.testing.assert_array_equal(properties["charge"], hits[:, 0] * 2)
+
+    HepEVD.reset_server()
+
+
+def test_arrow_hits() -> None:
+    if pa is None:
+        print("pyarrow is not installed, skipping the Arrow tests.")
+        return
+
+    HepEVD.reset_server()
+
+    hits = make_hits(2000)
+    columns = {
+        "x": hits[:, 0],
+        "y": hits[:, 1],
+        "z": hits[:, 2],
+        "energy": hits[:, 3],
+        "dim": hits[:, 4].astype(np.int32),
+        "view": hits[:, 5].astype(np.int32),
+        "score": np.linspace(0, 1, len(hits)),
+    }
+
+    # Both a single record batch, and a table of several, read as a stream.
+    batch = pa.RecordBatch.from_pydict(columns)
+    HepEVD.add_hits(batch)
+
+    table = pa.Table.from_batches([batch.slice(0, 500), batch.slice(500)])
+    HepEVD.add_hits(table)
+
+    output, properties = HepEVD.get_hits()
+    np.testing.assert_array_equal(output, np.concatenate((hits, hits)))
+    np.testing.assert_array_equal(properties["score"], np.concatenate((columns["score"], columns["score"])))
+
+    HepEVD.reset_server()
+
+
+def read_archive(path: str) -> list:
+    # The archive header, followed by the state table (see include/archive.h).
+    with open(path, "rb") as archive:
+        data = archive.read()
+
+    magic, _, _, num_states, table_offset = struct.unpack_from("=8sIIQQ", data, 0)
+    assert magic == b"HEPEVDAR"
+
+    states = []
+    for i in range(num_states):
+        offset, size = struct.unpack_from("=QQ", data, table_offset + i * 64)
+        states.append(HepEVD.EventState.from_bytes(data[offset : offset + size]))
+    return states
+
+
+def test_merge_states() -> None:
+    # Build two states, as worker processes would, and send them through pickle.
+    states = []
+    for name in ["Worker A", "Worker B"]:
+        HepEVD.reset_server()
+        HepEVD.add_hits(make_hits(1000))
+        HepEVD.add_particles([make_hits(100)[:, :4] for _ in range(3)], parents=[-1, 0, 0])
+        states.append(HepEVD.get_state(name))
+
+    pickled = [pickle.loads(pickle.dumps(state)) for state in states]
+    assert [state.name for state in pickled] == ["Worker A", "Worker B"]
+    assert [state.to_bytes() for state in pickled] == [state.to_bytes() for state in states]
+
+    # Merged states go before the one being built, which keeps its name.
+    HepEVD.reset_server()
+    HepEVD.get_state("Building")
+    HepEVD.merge_states(pickled)
+
+    assert HepEVD.get_state().name == "Building"
+    assert len(HepEVD.get_hits()[0]) == 0
+
+    with tempfile.TemporaryDirectory() as directory:
+        path = os.path.join(directory, "merged.hepevd")
+        HepEVD.write_archive(path)
+        merged = read_archive(path)
+
+    assert [state.name for state in merged] == ["Worker A", "Worker B", "Building"]
+    assert [state.to_bytes() for state in merged[:2]] == [state.to_bytes() for state in states]
+
+    # Anything that isn't a state is rejected.
+    try:
+        HepEVD.merge_states([b"not a state"])
+        raise AssertionError("merge_states should reject anything but states")
+    except RuntimeError:
+        pass
+
+    try:
+        HepEVD.EventState.from_bytes(b"not a state")
+        raise AssertionError("EventState.from_bytes should reject invalid data")
+    except RuntimeError:
+        pass
+
+    HepEVD.reset_server()
+
+
 if __name__ == "__main__":
     main()
+
+    test_hits_round_trip()
+    test_arrow_hits()
+    test_merge_states()
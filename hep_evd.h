@@ -14,6 +14,8 @@
 #define HEP_EVD_VERSION_PATCH 2
 
 // Include everything...
+#include "include/archive.h"
+#include "include/arrow.h"
 #include "include/config.h"
 #include "include/geometry.h"
 #include "include/hits.h"
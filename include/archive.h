@@ -0,0 +1,1527 @@
+//
+// Binary Archive
+//
+// A versioned, binary format for saving many event states to one file, as an
+// alternative to the per-state JSON files. Every state is stored as its own
+// block of columnar sections, so a reader can jump straight to a state (or a
+// single part of one) without parsing the rest of the file, and the columns
+// can be used in place from a memory mapped file.
+//
+// File layout:
+//   ArchiveHeader      Fixed size, at the start of the file.
+//   Metadata           The detector geometry and GUI config, as JSON.
+//   State blocks       One per state, each an ArchiveStateHeader, a table of
+//                      ArchiveSections and then the sections themselves.
+//   State table        One ArchiveStateEntry per state, only written once
+//                      the archive is closed.
+//
+// Readers only rely on the offsets in the header, so older archives with the
+// metadata after the state blocks are read the same way.
+//
+// Everything is written in the byte order of the host that wrote it, which is
+// recorded in the header, and an archive from a host with the other byte order
+// is rejected rather than swapped. Every block, section and column starts on
+// an 8 byte boundary, relative to the start of the file.
+
+#ifndef HEP_EVD_ARCHIVE_H
+#define HEP_EVD_ARCHIVE_H
+
+#include "compression.h"
+#include "config.h"
+#include "geometry.h"
+#include "hits.h"
+#include "image.h"
+#include "marker.h"
+#include "particle.h"
+#include "state.h"
+#include "utils.h"
+
+#include "extern/json.hpp"
+using json = nlohmann::json;
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+namespace HepEVD {
+
+// Bumped whenever the layout changes in a way older readers can't cope with.
+// Unknown section types are skipped, so new sections don't need a bump.
+// Version 2 added the particle hit references, without which particles
+// refer to the particle hit section directly.
+inline constexpr uint32_t ARCHIVE_VERSION = 2;
+inline constexpr char ARCHIVE_MAGIC[8] = {'H', 'E', 'P', 'E', 'V', 'D', 'A', 'R'};
+inline constexpr uint32_t ARCHIVE_STATE_MAGIC = 0x54415453; // "STAT"
+inline constexpr uint32_t ARCHIVE_BYTE_ORDER = 0x01020304;
+inline constexpr size_t ARCHIVE_ALIGNMENT = 8;
+
+enum class ArchiveSectionType : uint32_t {
+    NAME = 1,
+    MC_TRUTH,
+    HITS,
+    PARTICLE_HITS,
+    MC_HITS,
+    PARTICLES,
+    MARKERS,
+    IMAGES,
+    PARTICLE_HIT_REFS
+};
+
+struct ArchiveHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    uint64_t numStates;
+    uint64_t stateTableOffset;
+    uint64_t metadataOffset;
+    uint64_t metadataSize;
+    uint64_t reserved[2];
+};
+static_assert(sizeof(ArchiveHeader) == 64, "ArchiveHeader must be 64 bytes");
+
+// The state table entries hold the counts too, so a reader can list the
+// states without touching any of the state blocks.
+struct ArchiveStateEntry {
+    uint64_t offset;
+    uint64_t size;
+    uint64_t numHits;
+    uint64_t numMCHits;
+    uint64_t numParticles;
+    uint64_t numMarkers;
+    uint64_t numImages;
+    uint64_t reserved;
+};
+static_assert(sizeof(ArchiveStateEntry) == 64, "ArchiveStateEntry must be 64 bytes");
+
+struct ArchiveStateHeader {
+    uint32_t magic;
+    uint32_t numSections;
+    uint64_t size;
+};
+
+// Section offsets are relative to the start of their state block.
+struct ArchiveSection {
+    uint32_t type;
+    uint32_t reserved;
+    uint64_t offset;
+    uint64_t size;
+    uint64_t count;
+};
+
+// Optional hit columns, only written if any hit needs them.
+enum ArchiveHitColumns : uint64_t { HIT_WIDTHS = 1, HIT_LABELS = 2, HIT_COLOURS = 4, HIT_PROPERTIES = 8 };
+
+// Growable buffer that archive data is written into.
+class ArchiveBuffer {
+  public:
+    size_t size() const { return m_data.size(); }
+    const std::string &getData() const { return m_data; }
+    std::string release() { return std::move(m_data); }
+
+    void align() { m_data.resize((m_data.size() + ARCHIVE_ALIGNMENT - 1) / ARCHIVE_ALIGNMENT * ARCHIVE_ALIGNMENT); }
+
+    void putBytes(const void *data, const size_t size) {
+        if (size > 0)
+            m_data.append(static_cast<const char *>(data), size);
+    }
+    template <typename T> void put(const T &value) { this->putBytes(&value, sizeof(T)); }
+    template <typename T> void putAt(const size_t offset, const T &value) {
+        std::memcpy(&m_data[offset], &value, sizeof(T));
+    }
+
+    // Columns always start aligned, so they can be read in place.
+    // Numeric columns are noted, so they can be filtered before compressing.
+    template <typename T> void putColumn(const std::vector<T> &column) {
+        this->align();
+
+        if (std::is_arithmetic<T>::value && (sizeof(T) == 4 || sizeof(T) == 8) && !column.empty())
+            m_numericColumns.push_back({m_data.size(), column.size(), sizeof(T)});
+
+        this->putBytes(column.data(), column.size() * sizeof(T));
+    }
+
+    // A column of strings is stored as (n + 1) offsets, then the characters.
+    template <typename Container, typename Getter> void putStrings(const Container &items, Getter getString) {
+        std::vector<uint64_t> offsets;
+        offsets.reserve(items.size() + 1);
+        offsets.push_back(0);
+
+        std::string chars;
+        for (const auto &item : items) {
+            chars += getString(item);
+            offsets.push_back(chars.size());
+        }
+
+        this->putColumn(offsets);
+        this->putBytes(chars.data(), chars.size());
+    }
+
+    const std::vector<NumericColumn> &getNumericColumns() const { return m_numericColumns; }
+
+  private:
+    std::string m_data;
+    std::vector<NumericColumn> m_numericColumns;
+};
+
+// A column of values, read in place from archive data.
+// Values are copied out one at a time, so the data needn't be aligned.
+template <typename T> class ArchiveColumn {
+  public:
+    ArchiveColumn() {}
+    ArchiveColumn(const char *data, const size_t size) : m_data(data), m_size(size) {}
+
+    T operator[](const size_t i) const {
+        T value;
+        std::memcpy(&value, m_data + i * sizeof(T), sizeof(T));
+        return value;
+    }
+    size_t size() const { return m_size; }
+    const char *data() const { return m_data; }
+
+  private:
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+};
+
+class ArchiveStrings {
+  public:
+    ArchiveStrings() {}
+    ArchiveStrings(const ArchiveColumn<uint64_t> &offsets, const char *chars, const size_t numChars)
+        : m_offsets(offsets), m_chars(chars), m_numChars(numChars) {}
+
+    std::string_view operator[](const size_t i) const {
+        const uint64_t begin = m_offsets[i];
+        const uint64_t end = m_offsets[i + 1];
+
+        if (begin > end || end > m_numChars)
+            throw std::runtime_error("HepEVD: Archive has an invalid string column!");
+
+        return std::string_view(m_chars + begin, end - begin);
+    }
+    size_t size() const { return m_offsets.size() == 0 ? 0 : m_offsets.size() - 1; }
+
+  private:
+    ArchiveColumn<uint64_t> m_offsets;
+    const char *m_chars = nullptr;
+    size_t m_numChars = 0;
+};
+
+// Bounds checked reading of archive data, mirroring ArchiveBuffer.
+class ArchiveCursor {
+  public:
+    ArchiveCursor(const char *data, const size_t size) : m_data(data), m_size(size) {}
+
+    size_t getPosition() const { return m_pos; }
+
+    void align() { this->skip((ARCHIVE_ALIGNMENT - m_pos % ARCHIVE_ALIGNMENT) % ARCHIVE_ALIGNMENT); }
+    void skip(const size_t size) {
+        this->require(size);
+        m_pos += size;
+    }
+
+    template <typename T> T get() {
+        this->require(sizeof(T));
+        T value;
+        std::memcpy(&value, m_data + m_pos, sizeof(T));
+        m_pos += sizeof(T);
+        return value;
+    }
+
+    template <typename T> ArchiveColumn<T> getColumn(const size_t size) {
+        this->align();
+
+        if (size > (m_size - m_pos) / sizeof(T))
+            this->fail();
+
+        ArchiveColumn<T> column(m_data + m_pos, size);
+        m_pos += size * sizeof(T);
+        return column;
+    }
+
+    ArchiveStrings getStrings(const size_t size) {
+        // Also stops the offset count below from overflowing.
+        if (size >= m_size)
+            this->fail();
+
+        const ArchiveColumn<uint64_t> offsets = this->getColumn<uint64_t>(size + 1);
+        const uint64_t numChars = offsets[size];
+
+        this->require(numChars);
+        ArchiveStrings strings(offsets, m_data + m_pos, numChars);
+        m_pos += numChars;
+        return strings;
+    }
+
+  private:
+    void require(const size_t size) const {
+        if (size > m_size - m_pos)
+            this->fail();
+    }
+    [[noreturn]] void fail() const { throw std::runtime_error("HepEVD: Archive data is truncated or corrupt!"); }
+
+    const char *m_data;
+    size_t m_size;
+    size_t m_pos = 0;
+};
+
+// Hits are stored column by column, with the optional columns flagged up front.
+template <typename HitClass> inline void writeArchiveHits(ArchiveBuffer &buffer, const std::vector<HitClass> &hits) {
+    const size_t nHits = hits.size();
+
+    uint64_t flags = 0;
+    for (const auto &hit : hits) {
+        const Position &width = hit.getWidth();
+        if (width.x != 1.0 || width.y != 1.0 || width.z != 1.0)
+            flags |= HIT_WIDTHS;
+        if (!hit.getLabel().empty())
+            flags |= HIT_LABELS;
+        if (!hit.getColour().empty())
+            flags |= HIT_COLOURS;
+        if (!hit.getProperties().empty())
+            flags |= HIT_PROPERTIES;
+    }
+    buffer.put(flags);
+
+    auto putDoubles = [&](auto getValue) {
+        std::vector<double> column(nHits);
+        for (size_t i = 0; i < nHits; ++i)
+            column[i] = getValue(hits[i]);
+        buffer.putColumn(column);
+    };
+    auto putBytes = [&](auto getValue) {
+        std::vector<uint8_t> column(nHits);
+        for (size_t i = 0; i < nHits; ++i)
+            column[i] = static_cast<uint8_t>(getValue(hits[i]));
+        buffer.putColumn(column);
+    };
+
+    putDoubles([](const Hit &hit) { return hit.getPosition().x; });
+    putDoubles([](const Hit &hit) { return hit.getPosition().y; });
+    putDoubles([](const Hit &hit) { return hit.getPosition().z; });
+    putDoubles([](const Hit &hit) { return hit.getEnergy(); });
+    putBytes([](const Hit &hit) { return hit.getDim(); });
+    putBytes([](const Hit &hit) { return hit.getHitType(); });
+    buffer.putStrings(hits, [](const Hit &hit) { return hit.getId(); });
+
+    if (flags & HIT_WIDTHS) {
+        putDoubles([](const Hit &hit) { return hit.getWidth().x; });
+        putDoubles([](const Hit &hit) { return hit.getWidth().y; });
+        putDoubles([](const Hit &hit) { return hit.getWidth().z; });
+    }
+
+    if (flags & HIT_LABELS)
+        buffer.putStrings(hits, [](const Hit &hit) { return hit.getLabel(); });
+
+    if (flags & HIT_COLOURS)
+        buffer.putStrings(hits, [](const Hit &hit) { return hit.getColour(); });
+
+    // Properties are stored as a table of the distinct (name, type) keys,
+    // then a CSR list of (key, value) pairs per hit.
+    if (flags & HIT_PROPERTIES) {
+        std::map<std::tuple<std::string, PropertyType>, uint32_t> keyIndices;
+        std::vector<std::tuple<std::string, PropertyType>> keys;
+        std::vector<uint64_t> offsets({0});
+        std::vector<uint32_t> hitKeys;
+        std::vector<double> hitValues;
+
+        offsets.reserve(nHits + 1);
+        for (const auto &hit : hits) {
+            for (const auto &property : hit.getProperties()) {
+                auto it = keyIndices.find(property.first);
+                if (it == keyIndices.end()) {
+                    it = keyIndices.insert({property.first, keys.size()}).first;
+                    keys.push_back(property.first);
+                }
+
+                hitKeys.push_back(it->second);
+                hitValues.push_back(property.second);
+            }
+            offsets.push_back(hitKeys.size());
+        }
+
+        std::vector<uint8_t> keyTypes;
+        for (const auto &key : keys)
+            keyTypes.push_back(static_cast<uint8_t>(std::get<1>(key)));
+
+        buffer.put<uint64_t>(keys.size());
+        buffer.putStrings(keys, [](const auto &key) { return std::get<0>(key); });
+        buffer.putColumn(keyTypes);
+        buffer.putColumn(offsets);
+        buffer.putColumn(hitKeys);
+        buffer.putColumn(hitValues);
+    }
+}
+
+// Enums are stored as single bytes, so are checked when read back, as some
+// are used as indices (i.e. the per view hit counts of a particle).
+template <typename EnumType> inline EnumType toArchiveEnum(const uint8_t value, const EnumType last) {
+    if (value > static_cast<uint8_t>(last))
+        throw std::runtime_error("HepEVD: Archive has an invalid enum value!");
+    return static_cast<EnumType>(value);
+}
+
+template <typename HitClass> inline std::vector<HitClass> readArchiveHits(ArchiveCursor &cursor, const size_t nHits) {
+    const uint64_t flags = cursor.get<uint64_t>();
+
+    const auto x = cursor.getColumn<double>(nHits);
+    const auto y = cursor.getColumn<double>(nHits);
+    const auto z = cursor.getColumn<double>(nHits);
+    const auto energy = cursor.getColumn<double>(nHits);
+    const auto dim = cursor.getColumn<uint8_t>(nHits);
+    const auto hitType = cursor.getColumn<uint8_t>(nHits);
+    const auto ids = cursor.getStrings(nHits);
+
+    ArchiveColumn<double> widthX, widthY, widthZ;
+    if (flags & HIT_WIDTHS) {
+        widthX = cursor.getColumn<double>(nHits);
+        widthY = cursor.getColumn<double>(nHits);
+        widthZ = cursor.getColumn<double>(nHits);
+    }
+
+    ArchiveStrings labels, colours;
+    if (flags & HIT_LABELS)
+        labels = cursor.getStrings(nHits);
+    if (flags & HIT_COLOURS)
+        colours = cursor.getStrings(nHits);
+
+    ArchiveStrings keyNames;
+    ArchiveColumn<uint8_t> keyTypes;
+    ArchiveColumn<uint64_t> propertyOffsets;
+    ArchiveColumn<uint32_t> hitKeys;
+    ArchiveColumn<double> hitValues;
+    if (flags & HIT_PROPERTIES) {
+        const uint64_t nKeys = cursor.get<uint64_t>();
+        keyNames = cursor.getStrings(nKeys);
+        keyTypes = cursor.getColumn<uint8_t>(nKeys);
+        propertyOffsets = cursor.getColumn<uint64_t>(nHits + 1);
+        hitKeys = cursor.getColumn<uint32_t>(propertyOffsets[nHits]);
+        hitValues = cursor.getColumn<double>(propertyOffsets[nHits]);
+    }
+
+    std::vector<HitClass> hits;
+    hits.reserve(nHits);
+
+    for (size_t i = 0; i < nHits; ++i) {
+        Position position({x[i], y[i], z[i]});
+        position.setDim(toArchiveEnum(dim[i], TWO_D));
+        position.setHitType(toArchiveEnum(hitType[i], TWO_D_W));
+
+        Hit hit(std::string(ids[i]), position, energy[i]);
+
+        if (flags & HIT_WIDTHS)
+            hit.setWidth(Position({widthX[i], widthY[i], widthZ[i]}));
+        if (flags & HIT_LABELS)
+            hit.setLabel(std::string(labels[i]));
+        if (flags & HIT_COLOURS)
+            hit.setColour(std::string(colours[i]));
+
+        if (flags & HIT_PROPERTIES) {
+            const uint64_t begin = propertyOffsets[i];
+            const uint64_t end = propertyOffsets[i + 1];
+
+            if (begin > end || end > hitKeys.size())
+                throw std::runtime_error("HepEVD: Archive has invalid hit properties!");
+
+            HitProperties properties;
+            for (uint64_t j = begin; j < end; ++j) {
+                const uint32_t key = hitKeys[j];
+                if (key >= keyTypes.size())
+                    throw std::runtime_error("HepEVD: Archive has invalid hit properties!");
+
+                const PropertyType type = toArchiveEnum(keyTypes[key], PropertyType::NUMERIC);
+                properties[{std::string(keyNames[key]), type}] = hitValues[j];
+            }
+            hit.addProperties(properties);
+        }
+
+        hits.emplace_back(std::move(hit));
+    }
+
+    return hits;
+}
+
+// Every marker type shares the same columns. The "extra" columns are the
+// end point for lines, and the inner and outer radius for rings.
+inline void writeArchiveMarkers(ArchiveBuffer &buffer, const Markers &markers) {
+    const size_t nMarkers = markers.size();
+
+    std::vector<uint8_t> markerType(nMarkers), dim(nMarkers), hitType(nMarkers), endDim(nMarkers),
+        endHitType(nMarkers);
+    std::vector<double> x(nMarkers), y(nMarkers), z(nMarkers);
+    std::vector<double> extraX(nMarkers, 0.0), extraY(nMarkers, 0.0), extraZ(nMarkers, 0.0);
+
+    for (size_t i = 0; i < nMarkers; ++i) {
+        std::visit(
+            [&](const auto &marker) {
+                const Position &position = marker.getPosition();
+                x[i] = position.x;
+                y[i] = position.y;
+                z[i] = position.z;
+                dim[i] = static_cast<uint8_t>(position.dim);
+                hitType[i] = static_cast<uint8_t>(position.hitType);
+            },
+            markers[i]);
+
+        if (const auto *line = std::get_if<Line>(&markers[i])) {
+            markerType[i] = LINE;
+            extraX[i] = line->getEnd().x;
+            extraY[i] = line->getEnd().y;
+            extraZ[i] = line->getEnd().z;
+            endDim[i] = static_cast<uint8_t>(line->getEnd().dim);
+            endHitType[i] = static_cast<uint8_t>(line->getEnd().hitType);
+        } else if (const auto *ring = std::get_if<Ring>(&markers[i])) {
+            markerType[i] = RING;
+            extraX[i] = ring->getInner();
+            extraY[i] = ring->getOuter();
+        } else {
+            markerType[i] = POINT;
+        }
+    }
+
+    buffer.putColumn(markerType);
+    buffer.putColumn(x);
+    buffer.putColumn(y);
+    buffer.putColumn(z);
+    buffer.putColumn(dim);
+    buffer.putColumn(hitType);
+    buffer.putColumn(extraX);
+    buffer.putColumn(extraY);
+    buffer.putColumn(extraZ);
+    buffer.putColumn(endDim);
+    buffer.putColumn(endHitType);
+
+    auto getColour = [](const AllMarkers &marker) {
+        return std::visit([](const auto &m) { return m.getColour(); }, marker);
+    };
+    auto getLabel = [](const AllMarkers &marker) {
+        return std::visit([](const auto &m) { return m.getLabel(); }, marker);
+    };
+    buffer.putStrings(markers, getColour);
+    buffer.putStrings(markers, getLabel);
+}
+
+inline Markers readArchiveMarkers(ArchiveCursor &cursor, const size_t nMarkers) {
+    const auto markerType = cursor.getColumn<uint8_t>(nMarkers);
+    const auto x = cursor.getColumn<double>(nMarkers);
+    const auto y = cursor.getColumn<double>(nMarkers);
+    const auto z = cursor.getColumn<double>(nMarkers);
+    const auto dim = cursor.getColumn<uint8_t>(nMarkers);
+    const auto hitType = cursor.getColumn<uint8_t>(nMarkers);
+    const auto extraX = cursor.getColumn<double>(nMarkers);
+    const auto extraY = cursor.getColumn<double>(nMarkers);
+    const auto extraZ = cursor.getColumn<double>(nMarkers);
+    const auto endDim = cursor.getColumn<uint8_t>(nMarkers);
+    const auto endHitType = cursor.getColumn<uint8_t>(nMarkers);
+    const auto colours = cursor.getStrings(nMarkers);
+    const auto labels = cursor.getStrings(nMarkers);
+
+    Markers markers;
+    markers.reserve(nMarkers);
+
+    for (size_t i = 0; i < nMarkers; ++i) {
+        const Point start({x[i], y[i], z[i]}, toArchiveEnum(dim[i], TWO_D), toArchiveEnum(hitType[i], TWO_D_W));
+
+        switch (markerType[i]) {
+        case POINT:
+            markers.push_back(start);
+            break;
+        case LINE: {
+            const Point end({extraX[i], extraY[i], extraZ[i]}, toArchiveEnum(endDim[i], TWO_D),
+                            toArchiveEnum(endHitType[i], TWO_D_W));
+            markers.push_back(Line(start, end));
+            break;
+        }
+        case RING: {
+            Ring ring({x[i], y[i], z[i]}, extraX[i], extraY[i]);
+            ring.setDim(toArchiveEnum(dim[i], TWO_D));
+            ring.setHitType(toArchiveEnum(hitType[i], TWO_D_W));
+            markers.push_back(ring);
+            break;
+        }
+        default:
+            throw std::runtime_error("HepEVD: Archive has an unknown marker type!");
+        }
+
+        std::visit(
+            [&](auto &marker) {
+                marker.setColour(std::string(colours[i]));
+                marker.setLabel(std::string(labels[i]));
+            },
+            markers.back());
+    }
+
+    return markers;
+}
+
+// Particles refer to their hits as a range of the particle hit references.
+// Children and vertices are stored as CSR lists, one range per particle.
+inline void writeArchiveParticles(ArchiveBuffer &buffer, const Particles &particles) {
+    const size_t nParticles = particles.size();
+
+    std::vector<uint8_t> primary(nParticles), interactionType(nParticles), renderType(nParticles);
+    std::vector<uint64_t> hitOffset(nParticles), hitCount(nParticles);
+    std::vector<uint64_t> childOffsets({0}), vertexOffsets({0});
+    std::vector<std::string> childIDs;
+    Markers vertices;
+
+    for (size_t i = 0; i < nParticles; ++i) {
+        const Particle &particle = particles[i];
+
+        primary[i] = particle.getPrimary();
+        interactionType[i] = static_cast<uint8_t>(particle.getInteractionType());
+        renderType[i] = static_cast<uint8_t>(particle.getRenderType());
+        hitOffset[i] = particle.getHitOffset();
+        hitCount[i] = particle.getNHits();
+
+        const auto &children = particle.getChildIDs();
+        childIDs.insert(childIDs.end(), children.begin(), children.end());
+        childOffsets.push_back(childIDs.size());
+
+        const Markers particleVertices = particle.getVertices();
+        vertices.insert(vertices.end(), particleVertices.begin(), particleVertices.end());
+        vertexOffsets.push_back(vertices.size());
+    }
+
+    buffer.putStrings(particles, [](const Particle &particle) { return particle.getID(); });
+    buffer.putStrings(particles, [](const Particle &particle) { return particle.getLabel(); });
+    buffer.putStrings(particles, [](const Particle &particle) { return particle.getParentID(); });
+    buffer.putColumn(primary);
+    buffer.putColumn(interactionType);
+    buffer.putColumn(renderType);
+    buffer.putColumn(hitOffset);
+    buffer.putColumn(hitCount);
+    buffer.putColumn(childOffsets);
+    buffer.putStrings(childIDs, [](const std::string &id) { return id; });
+    buffer.putColumn(vertexOffsets);
+    writeArchiveMarkers(buffer, vertices);
+}
+
+inline Particles readArchiveParticles(ArchiveCursor &cursor, const size_t nParticles, const Hits &hits,
+                                      const Hits &particleHits, const std::vector<int64_t> &hitRefs) {
+    const auto ids = cursor.getStrings(nParticles);
+    const auto labels = cursor.getStrings(nParticles);
+    const auto parentIDs = cursor.getStrings(nParticles);
+    const auto primary = cursor.getColumn<uint8_t>(nParticles);
+    const auto interactionType = cursor.getColumn<uint8_t>(nParticles);
+    const auto renderType = cursor.getColumn<uint8_t>(nParticles);
+    const auto hitOffset = cursor.getColumn<uint64_t>(nParticles);
+    const auto hitCount = cursor.getColumn<uint64_t>(nParticles);
+    const auto childOffsets = cursor.getColumn<uint64_t>(nParticles + 1);
+    const auto childIDs = cursor.getStrings(childOffsets[nParticles]);
+    const auto vertexOffsets = cursor.getColumn<uint64_t>(nParticles + 1);
+    const Markers vertices = readArchiveMarkers(cursor, vertexOffsets[nParticles]);
+
+    auto checkRange = [](const uint64_t begin, const uint64_t end, const size_t size) {
+        if (begin > end || end > size)
+            throw std::runtime_error("HepEVD: Archive has an invalid particle!");
+    };
+
+    // Checked as a count, since the offset plus count could overflow.
+    auto checkCount = [](const uint64_t begin, const uint64_t count, const size_t size) {
+        if (begin > size || count > size - begin)
+            throw std::runtime_error("HepEVD: Archive has an invalid particle!");
+    };
+
+    Particles particles;
+    particles.reserve(nParticles);
+
+    for (size_t i = 0; i < nParticles; ++i) {
+        checkCount(hitOffset[i], hitCount[i], hitRefs.size());
+        checkRange(childOffsets[i], childOffsets[i + 1], childIDs.size());
+        checkRange(vertexOffsets[i], vertexOffsets[i + 1], vertices.size());
+
+        Hits ownHits;
+        ownHits.reserve(hitCount[i]);
+        for (uint64_t j = hitOffset[i]; j < hitOffset[i] + hitCount[i]; ++j) {
+            const int64_t ref = hitRefs[j];
+            const bool isValid = ref >= 0 ? static_cast<uint64_t>(ref) < hits.size()
+                                          : static_cast<uint64_t>(-1 - ref) < particleHits.size();
+            if (!isValid)
+                throw std::runtime_error("HepEVD: Archive has an invalid particle hit!");
+            ownHits.push_back(resolveParticleHit(hits, particleHits, ref));
+        }
+
+        Particle particle(std::move(ownHits), std::string(ids[i]), std::string(labels[i]));
+
+        particle.setParentID(std::string(parentIDs[i]));
+        particle.setPrimary(primary[i] != 0);
+        particle.setInteractionType(toArchiveEnum(interactionType[i], OTHER));
+        particle.setRenderType(toArchiveEnum(renderType[i], SHOWER));
+
+        for (uint64_t j = childOffsets[i]; j < childOffsets[i + 1]; ++j)
+            particle.addChild(std::string(childIDs[j]));
+
+        if (vertexOffsets[i] != vertexOffsets[i + 1])
+            particle.setVertices(
+                Markers(vertices.begin() + vertexOffsets[i], vertices.begin() + vertexOffsets[i + 1]));
+
+        particles.push_back(std::move(particle));
+    }
+
+    return particles;
+}
+
+// Images are stored as the full resolution pixels only, as the pyramid is
+// cheap to rebuild when the image is read back.
+inline void writeArchiveImages(ArchiveBuffer &buffer, const Images &images) {
+    std::vector<int32_t> width, height, stride, channels;
+    std::vector<uint8_t> imageType;
+    std::vector<uint64_t> dataSize;
+
+    for (const auto &image : images) {
+        const bool isEmpty = image.getNumLevels() == 0;
+
+        width.push_back(image.getWidth());
+        height.push_back(image.getHeight());
+        stride.push_back(image.getStride());
+        channels.push_back(image.getChannels());
+        imageType.push_back(static_cast<uint8_t>(image.getImageType()));
+        dataSize.push_back(isEmpty ? 0 : image.getLevel(0).data.size());
+    }
+
+    buffer.putColumn(width);
+    buffer.putColumn(height);
+    buffer.putColumn(stride);
+    buffer.putColumn(channels);
+    buffer.putColumn(imageType);
+    buffer.putColumn(dataSize);
+    buffer.putStrings(images, [](const MonochromeImage &image) { return image.getLabel(); });
+
+    for (const auto &image : images) {
+        if (image.getNumLevels() > 0)
+            buffer.putColumn(image.getLevel(0).data);
+    }
+}
+
+inline Images readArchiveImages(ArchiveCursor &cursor, const size_t nImages) {
+    const auto width = cursor.getColumn<int32_t>(nImages);
+    const auto height = cursor.getColumn<int32_t>(nImages);
+    const auto stride = cursor.getColumn<int32_t>(nImages);
+    const auto channels = cursor.getColumn<int32_t>(nImages);
+    cursor.getColumn<uint8_t>(nImages); // Image type, only monochrome for now.
+    const auto dataSize = cursor.getColumn<uint64_t>(nImages);
+    const auto labels = cursor.getStrings(nImages);
+
+    Images images;
+    images.reserve(nImages);
+
+    for (size_t i = 0; i < nImages; ++i) {
+        const auto pixels = cursor.getColumn<float>(dataSize[i]);
+
+        if (dataSize[i] == 0) {
+            images.push_back(MonochromeImage());
+            continue;
+        }
+
+        std::vector<float> data(pixels.size());
+        std::memcpy(data.data(), pixels.data(), pixels.size() * sizeof(float));
+        images.push_back(
+            MonochromeImage(std::move(data), width[i], height[i], std::string(labels[i]), stride[i], channels[i]));
+    }
+
+    return images;
+}
+
+// Encode a whole state as a single archive state block.
+// This is self contained, so can also be used on its own, outside of an archive file.
+// The numeric columns in the block can optionally be returned, for compressing it.
+inline std::string encodeEventState(const EventState &state, std::vector<NumericColumn> *numericColumns = nullptr) {
+    using Section = ArchiveSectionType;
+    const std::vector<std::pair<Section, size_t>> sections = {
+        {Section::NAME, 1},
+        {Section::MC_TRUTH, 1},
+        {Section::HITS, state.m_hits.size()},
+        {Section::PARTICLE_HITS, state.m_particleHits.size()},
+        {Section::PARTICLE_HIT_REFS, state.m_particleHitRefs.size()},
+        {Section::MC_HITS, state.m_mcHits.size()},
+        {Section::PARTICLES, state.m_particles.size()},
+        {Section::MARKERS, state.m_markers.size()},
+        {Section::IMAGES, state.m_images.size()}};
+
+    ArchiveBuffer buffer;
+    buffer.put(ArchiveStateHeader());
+    const size_t tableOffset = buffer.size();
+    for (size_t i = 0; i < sections.size(); ++i)
+        buffer.put(ArchiveSection());
+
+    for (size_t i = 0; i < sections.size(); ++i) {
+        buffer.align();
+
+        ArchiveSection section = {};
+        section.type = static_cast<uint32_t>(sections[i].first);
+        section.offset = buffer.size();
+        section.count = sections[i].second;
+
+        switch (sections[i].first) {
+        case Section::NAME:
+            buffer.putStrings(std::vector<std::string>({state.m_name}), [](const std::string &s) { return s; });
+            break;
+        case Section::MC_TRUTH:
+            buffer.putStrings(std::vector<std::string>({state.m_mcTruth}), [](const std::string &s) { return s; });
+            break;
+        case Section::HITS:
+            writeArchiveHits(buffer, state.m_hits.get());
+            break;
+        case Section::PARTICLE_HITS:
+            writeArchiveHits(buffer, state.m_particleHits.get());
+            break;
+        case Section::PARTICLE_HIT_REFS:
+            buffer.putColumn(state.m_particleHitRefs);
+            break;
+        case Section::MC_HITS:
+            writeArchiveHits(buffer, state.m_mcHits.get());
+            break;
+        case Section::PARTICLES:
+            writeArchiveParticles(buffer, state.m_particles);
+            break;
+        case Section::MARKERS:
+            writeArchiveMarkers(buffer, state.m_markers);
+            break;
+        case Section::IMAGES:
+            writeArchiveImages(buffer, state.m_images);
+            break;
+        }
+
+        section.size = buffer.size() - section.offset;
+        buffer.putAt(tableOffset + i * sizeof(ArchiveSection), section);
+    }
+
+    buffer.align();
+
+    ArchiveStateHeader header = {};
+    header.magic = ARCHIVE_STATE_MAGIC;
+    header.numSections = sections.size();
+    header.size = buffer.size();
+    buffer.putAt(0, header);
+
+    if (numericColumns)
+        *numericColumns = buffer.getNumericColumns();
+
+    return buffer.release();
+}
+
+// Look up the sections of an encoded state block, by type.
+inline std::map<ArchiveSectionType, ArchiveSection> readArchiveSections(const char *data, const size_t size) {
+    ArchiveCursor cursor(data, size);
+    const ArchiveStateHeader header = cursor.get<ArchiveStateHeader>();
+
+    if (header.magic != ARCHIVE_STATE_MAGIC || header.size > size)
+        throw std::runtime_error("HepEVD: Archive state block is corrupt!");
+
+    std::map<ArchiveSectionType, ArchiveSection> sections;
+    for (uint32_t i = 0; i < header.numSections; ++i) {
+        const ArchiveSection section = cursor.get<ArchiveSection>();
+
+        if (section.offset > header.size || section.size > header.size - section.offset)
+            throw std::runtime_error("HepEVD: Archive state block is corrupt!");
+
+        sections[static_cast<ArchiveSectionType>(section.type)] = section;
+    }
+
+    return sections;
+}
+
+// Read a single string section, such as the name, without decoding the rest of the state.
+inline std::string readArchiveString(const char *data, const size_t size, const ArchiveSectionType type) {
+    const auto sections = readArchiveSections(data, size);
+    const auto it = sections.find(type);
+
+    if (it == sections.end() || it->second.count == 0)
+        return "";
+    if (it->second.count != 1)
+        throw std::runtime_error("HepEVD: Archive state block is corrupt!");
+
+    ArchiveCursor cursor(data + it->second.offset, it->second.size);
+    return std::string(cursor.getStrings(1)[0]);
+}
+
+// Decode a state block back into a state.
+// Unknown sections are ignored, and missing ones are left empty.
+inline EventState decodeEventState(const char *data, const size_t size) {
+    const auto sections = readArchiveSections(data, size);
+
+    auto getCursor = [&](const ArchiveSectionType type, size_t &count) {
+        const auto it = sections.find(type);
+        if (it == sections.end()) {
+            count = 0;
+            return ArchiveCursor(data, 0);
+        }
+
+        count = it->second.count;
+        return ArchiveCursor(data + it->second.offset, it->second.size);
+    };
+
+    EventState state;
+    size_t count = 0;
+
+    state.m_name = readArchiveString(data, size, ArchiveSectionType::NAME);
+    state.m_mcTruth = readArchiveString(data, size, ArchiveSectionType::MC_TRUTH);
+
+    ArchiveCursor hitCursor = getCursor(ArchiveSectionType::HITS, count);
+    state.m_hits = readArchiveHits<Hit>(hitCursor, count);
+
+    ArchiveCursor mcHitCursor = getCursor(ArchiveSectionType::MC_HITS, count);
+    state.m_mcHits = readArchiveHits<MCHit>(mcHitCursor, count);
+
+    ArchiveCursor markerCursor = getCursor(ArchiveSectionType::MARKERS, count);
+    state.m_markers = readArchiveMarkers(markerCursor, count);
+
+    ArchiveCursor imageCursor = getCursor(ArchiveSectionType::IMAGES, count);
+    state.m_images = readArchiveImages(imageCursor, count);
+
+    // Particles are rebuilt with their own hits, then added as normal,
+    // which restores the particle hits, summaries and hierarchy.
+    ArchiveCursor particleHitCursor = getCursor(ArchiveSectionType::PARTICLE_HITS, count);
+    const Hits particleHits = readArchiveHits<Hit>(particleHitCursor, count);
+
+    // Older archives have no references, with the particles using the particle hits directly.
+    std::vector<int64_t> hitRefs;
+    if (sections.count(ArchiveSectionType::PARTICLE_HIT_REFS) == 0) {
+        for (size_t i = 0; i < particleHits.size(); ++i)
+            hitRefs.push_back(-static_cast<int64_t>(i) - 1);
+    } else {
+        ArchiveCursor hitRefCursor = getCursor(ArchiveSectionType::PARTICLE_HIT_REFS, count);
+        const auto refs = hitRefCursor.getColumn<int64_t>(count);
+        for (size_t i = 0; i < refs.size(); ++i)
+            hitRefs.push_back(refs[i]);
+    }
+
+    ArchiveCursor particleCursor = getCursor(ArchiveSectionType::PARTICLES, count);
+    state.addParticles(readArchiveParticles(particleCursor, count, state.m_hits.get(), particleHits, hitRefs));
+
+    // The state is complete, so can share hits with any others already.
+    state.shareHits();
+    return state;
+}
+
+// The counts of everything in a state, for its state table entry.
+inline ArchiveStateEntry summariseEventState(const EventState &state) {
+    ArchiveStateEntry entry = {};
+    entry.numHits = state.m_hits.size();
+    entry.numMCHits = state.m_mcHits.size();
+    entry.numParticles = state.m_particles.size();
+    entry.numMarkers = state.m_markers.size();
+    entry.numImages = state.m_images.size();
+
+    return entry;
+}
+
+// Write states out to an archive file, one at a time as they are added,
+// so only one state is ever held in memory.
+// This works the same in a headless job as it does from the server, i.e.
+//
+//   ArchiveWriter writer("events.hepevd", geometry);
+//   for (...) writer.addState(state);
+//   writer.close();
+//
+// The state table is only written on close(), but each state is flushed out
+// as it is added, so the states of a job that never finished can still be
+// recovered by ArchiveFile.
+class ArchiveWriter {
+  public:
+    ArchiveWriter(const std::string &path, const DetectorGeometry &geometry = {}, const GUIConfig &config = {})
+        : m_path(path) {
+        m_file.open(path, std::ios::binary | std::ios::trunc);
+        if (!m_file)
+            throw std::runtime_error("Could not open " + path + " for writing");
+
+        json metadata;
+        metadata["detectorGeometry"] = json::parse(geometry.toJsonString());
+        metadata["config"] = config;
+        metadata["version"] = HEP_EVD_VERSION;
+        const std::string metadataString = metadata.dump();
+
+        // Until the archive is closed, there is no state table.
+        std::memcpy(m_header.magic, ARCHIVE_MAGIC, sizeof(m_header.magic));
+        m_header.version = ARCHIVE_VERSION;
+        m_header.byteOrder = ARCHIVE_BYTE_ORDER;
+        m_header.metadataOffset = sizeof(ArchiveHeader);
+        m_header.metadataSize = metadataString.size();
+
+        this->write(std::string_view(reinterpret_cast<const char *>(&m_header), sizeof(m_header)));
+        this->write(metadataString);
+        m_file.flush();
+    }
+    ~ArchiveWriter() {
+        try {
+            this->close();
+        } catch (...) {
+        }
+    }
+
+    ArchiveWriter(const ArchiveWriter &) = delete;
+    ArchiveWriter &operator=(const ArchiveWriter &) = delete;
+
+    void addState(const EventState &state) {
+        this->addEncodedState(encodeEventState(state), summariseEventState(state));
+    }
+
+    // Add a state that is already encoded, such as one from another archive.
+    // Only the counts of the given entry are used.
+    void addEncodedState(std::string_view block, ArchiveStateEntry entry) {
+        if (!m_file.is_open())
+            throw std::logic_error("HepEVD: Can't add a state to a closed archive!");
+
+        entry.offset = m_offset;
+        entry.size = block.size();
+
+        this->write(block);
+        m_file.flush();
+        m_entries.push_back(entry);
+    }
+
+    void close() {
+        if (!m_file.is_open())
+            return;
+
+        m_header.numStates = m_entries.size();
+        m_header.stateTableOffset = m_offset;
+        this->write(std::string(reinterpret_cast<const char *>(m_entries.data()),
+                                m_entries.size() * sizeof(ArchiveStateEntry)));
+
+        m_file.seekp(0);
+        m_file.write(reinterpret_cast<const char *>(&m_header), sizeof(m_header));
+        m_file.close();
+
+        if (!m_file)
+            throw std::runtime_error("Failed to write archive " + m_path);
+    }
+
+    size_t getNumStates() const { return m_entries.size(); }
+    size_t getBytesWritten() const { return m_offset; }
+
+  private:
+    // Everything is padded out, so the next block starts aligned.
+    void write(std::string_view data) {
+        const size_t padding = (ARCHIVE_ALIGNMENT - data.size() % ARCHIVE_ALIGNMENT) % ARCHIVE_ALIGNMENT;
+
+        m_file.write(data.data(), data.size());
+        m_file.write(std::string(padding, '\0').data(), padding);
+        m_offset += data.size() + padding;
+
+        if (!m_file)
+            throw std::runtime_error("Failed to write archive " + m_path);
+    }
+
+    std::string m_path;
+    std::ofstream m_file;
+    ArchiveHeader m_header = {};
+    std::vector<ArchiveStateEntry> m_entries;
+    uint64_t m_offset = 0;
+};
+
+// Somewhere states are kept encoded, rather than as full EventStates.
+class StateStore {
+  public:
+    virtual ~StateStore() {}
+
+    virtual size_t getNumStates() const = 0;
+
+    // A copy, as other threads can be adding states alongside.
+    virtual ArchiveStateEntry getEntry(const size_t i) const = 0;
+
+    // The encoded bytes of a state. Stores that don't hold these in memory
+    // read them into the given buffer, and return a view of that.
+    virtual std::string_view getStateBlock(const size_t i, std::string &buffer) const = 0;
+
+    // States in a persistent store, such as an archive file, can be dropped
+    // from memory and read back at any time. Otherwise, the store is only a
+    // temporary home for a state, until it is needed again.
+    virtual bool isPersistent() const = 0;
+
+    // Let the store know a temporary state has been read back, and is no
+    // longer needed, so any memory it uses can be freed.
+    virtual void removeState(const size_t) {}
+
+    // Read from the state itself, which is cheap from a mapped archive, but
+    // not for stores that have to read in or decompress the whole state, so
+    // those keep a copy to hand instead.
+    virtual std::string getStateName(const size_t i) const {
+        std::string buffer;
+        const std::string_view block = this->getStateBlock(i, buffer);
+        return readArchiveString(block.data(), block.size(), ArchiveSectionType::NAME);
+    }
+    virtual std::string getStateMCTruth(const size_t i) const {
+        std::string buffer;
+        const std::string_view block = this->getStateBlock(i, buffer);
+        return readArchiveString(block.data(), block.size(), ArchiveSectionType::MC_TRUTH);
+    }
+
+    EventState readState(const size_t i) const {
+        std::string buffer;
+        const std::string_view block = this->getStateBlock(i, buffer);
+        return decodeEventState(block.data(), block.size());
+    }
+
+    // The same summary as the JSON for an EventState, without decoding it.
+    json getStateInfo(const size_t i) const {
+        const ArchiveStateEntry entry = this->getEntry(i);
+
+        return {{"name", this->getStateName(i)},
+                {"particles", entry.numParticles},
+                {"hits", entry.numHits},
+                {"mcHits", entry.numMCHits},
+                {"markers", entry.numMarkers},
+                {"images", entry.numImages},
+                {"mcTruth", this->getStateMCTruth(i)}};
+    }
+};
+
+// A read-only archive file, mapped into memory rather than read in.
+// Only the header and state table are looked at when opening, with each
+// state only decoded when asked for, so even very large archives open
+// straight away, and only the pages of states that are used get loaded.
+class ArchiveFile : public StateStore {
+  public:
+    explicit ArchiveFile(const std::string &path) : m_path(path) {
+        const int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Could not open " + path + " for reading");
+
+        struct stat fileInfo;
+        if (fstat(fd, &fileInfo) != 0 || static_cast<size_t>(fileInfo.st_size) < sizeof(ArchiveHeader)) {
+            ::close(fd);
+            throw std::runtime_error("HepEVD: " + path + " is not a HepEVD archive!");
+        }
+
+        m_size = fileInfo.st_size;
+        void *data = mmap(nullptr, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        ::close(fd);
+
+        if (data == MAP_FAILED)
+            throw std::runtime_error("Could not map " + path + " into memory");
+        m_data = static_cast<const char *>(data);
+
+        try {
+            this->readIndex();
+        } catch (...) {
+            munmap(const_cast<char *>(m_data), m_size);
+            throw;
+        }
+    }
+    ~ArchiveFile() { munmap(const_cast<char *>(m_data), m_size); }
+
+    ArchiveFile(const ArchiveFile &) = delete;
+    ArchiveFile &operator=(const ArchiveFile &) = delete;
+
+    const std::string &getPath() const { return m_path; }
+    size_t getNumStates() const override { return m_entries.size(); }
+
+    // If the archive was never closed, and its states were found by recoverStates.
+    bool isRecovered() const { return m_recovered; }
+    ArchiveStateEntry getEntry(const size_t i) const override { return m_entries.at(i); }
+    bool isPersistent() const override { return true; }
+
+    // The detector geometry and GUI config the archive was written with.
+    const json &getMetadata() const { return m_metadata; }
+
+    // The raw, still encoded, bytes of a state, straight from the mapping.
+    std::string_view getStateBlock(const size_t i) const {
+        const ArchiveStateEntry &entry = m_entries.at(i);
+        return std::string_view(m_data + entry.offset, entry.size);
+    }
+    std::string_view getStateBlock(const size_t i, std::string &) const override { return this->getStateBlock(i); }
+
+  private:
+    void readIndex() {
+        ArchiveHeader header;
+        std::memcpy(&header, m_data, sizeof(header));
+
+        // Archives from before the metadata was written first have an empty
+        // header until they are closed.
+        const ArchiveHeader emptyHeader = {};
+        if (std::memcmp(&header, &emptyHeader, sizeof(header)) == 0) {
+            this->recoverStates(sizeof(ArchiveHeader));
+            return;
+        }
+
+        if (std::memcmp(header.magic, ARCHIVE_MAGIC, sizeof(header.magic)) != 0)
+            throw std::runtime_error("HepEVD: " + m_path + " is not a HepEVD archive!");
+        if (header.byteOrder != ARCHIVE_BYTE_ORDER)
+            throw std::runtime_error("HepEVD: " + m_path + " was written with a different byte order!");
+        if (header.version > ARCHIVE_VERSION)
+            throw std::runtime_error("HepEVD: " + m_path + " needs a newer version of HepEVD to read!");
+
+        auto checkRange = [&](const uint64_t offset, const uint64_t size) {
+            if (offset > m_size || size > m_size - offset)
+                throw std::runtime_error("HepEVD: " + m_path + " is truncated or corrupt!");
+        };
+
+        checkRange(header.metadataOffset, header.metadataSize);
+        m_metadata = json::parse(m_data + header.metadataOffset, m_data + header.metadataOffset + header.metadataSize);
+
+        // Not closed, so there is no state table to read.
+        if (header.stateTableOffset == 0) {
+            this->recoverStates(header.metadataOffset + header.metadataSize);
+            return;
+        }
+
+        if (header.numStates == 0)
+            return;
+        if (header.numStates > m_size / sizeof(ArchiveStateEntry))
+            throw std::runtime_error("HepEVD: " + m_path + " is truncated or corrupt!");
+        checkRange(header.stateTableOffset, header.numStates * sizeof(ArchiveStateEntry));
+
+        m_entries.resize(header.numStates);
+        std::memcpy(m_entries.data(), m_data + header.stateTableOffset, header.numStates * sizeof(ArchiveStateEntry));
+
+        for (const auto &entry : m_entries)
+            checkRange(entry.offset, entry.size);
+    }
+
+    // Rebuild the state table of an archive whose writer never reached
+    // close(), i.e. from a job that was killed, by walking the state blocks
+    // written so far. Anything after the last complete block is dropped.
+    void recoverStates(uint64_t offset) {
+        m_recovered = true;
+
+        while (true) {
+            offset += (ARCHIVE_ALIGNMENT - offset % ARCHIVE_ALIGNMENT) % ARCHIVE_ALIGNMENT;
+            if (offset >= m_size || m_size - offset < sizeof(ArchiveStateHeader))
+                break;
+
+            ArchiveStateHeader stateHeader;
+            std::memcpy(&stateHeader, m_data + offset, sizeof(stateHeader));
+            if (stateHeader.magic != ARCHIVE_STATE_MAGIC || stateHeader.size < sizeof(ArchiveStateHeader) ||
+                stateHeader.size > m_size - offset)
+                break;
+
+            std::map<ArchiveSectionType, ArchiveSection> sections;
+            try {
+                sections = readArchiveSections(m_data + offset, stateHeader.size);
+            } catch (const std::exception &) {
+                break;
+            }
+
+            auto getCount = [&](const ArchiveSectionType type) {
+                const auto it = sections.find(type);
+                return it == sections.end() ? 0 : it->second.count;
+            };
+
+            ArchiveStateEntry entry = {};
+            entry.offset = offset;
+            entry.size = stateHeader.size;
+            entry.numHits = getCount(ArchiveSectionType::HITS);
+            entry.numMCHits = getCount(ArchiveSectionType::MC_HITS);
+            entry.numParticles = getCount(ArchiveSectionType::PARTICLES);
+            entry.numMarkers = getCount(ArchiveSectionType::MARKERS);
+            entry.numImages = getCount(ArchiveSectionType::IMAGES);
+            m_entries.push_back(entry);
+
+            offset += stateHeader.size;
+        }
+
+        std::cout << "HepEVD: " << m_path << " was never closed, recovered " << m_entries.size() << " states from it."
+                  << std::endl;
+    }
+
+    std::string m_path;
+    const char *m_data = nullptr;
+    size_t m_size = 0;
+    std::vector<ArchiveStateEntry> m_entries;
+    json m_metadata;
+    bool m_recovered = false;
+};
+
+// A temporary file that states are spilled out to, to save memory.
+// The file is removed as soon as it is made, so it is always cleaned up,
+// however the process ends.
+//
+// States are removed again once they are read back, so the space and index
+// they used are reused by later states, and the file is shrunk whenever its
+// end is freed, so it only grows with the number of states spilled at once.
+class SpillFile : public StateStore {
+  public:
+    explicit SpillFile(const std::string &directory = "") {
+        const char *tmpDir = std::getenv("TMPDIR");
+        std::string path = !directory.empty() ? directory : (tmpDir ? tmpDir : "/tmp");
+        path += "/hepevd_spill_XXXXXX";
+
+        m_fd = mkstemp(&path[0]);
+        if (m_fd < 0)
+            throw std::runtime_error("Could not create a spill file in " + path);
+        unlink(path.c_str());
+    }
+    ~SpillFile() { ::close(m_fd); }
+
+    SpillFile(const SpillFile &) = delete;
+    SpillFile &operator=(const SpillFile &) = delete;
+
+    // Spill a state out, returning its index in the file.
+    size_t addState(const EventState &state) {
+        const std::string block = encodeEventState(state);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        const size_t offset = this->allocate(block.size());
+
+        size_t written = 0;
+        while (written < block.size()) {
+            const ssize_t result = pwrite(m_fd, block.data() + written, block.size() - written, offset + written);
+            if (result <= 0) {
+                this->release(offset, block.size());
+                throw std::runtime_error("HepEVD: Failed to write to the spill file!");
+            }
+            written += result;
+        }
+
+        ArchiveStateEntry entry = summariseEventState(state);
+        entry.offset = offset;
+        entry.size = block.size();
+
+        if (m_freeIndices.empty()) {
+            m_entries.push_back(entry);
+            m_names.push_back(state.m_name);
+            m_mcTruths.push_back(state.m_mcTruth);
+            return m_entries.size() - 1;
+        }
+
+        const size_t index = m_freeIndices.back();
+        m_freeIndices.pop_back();
+        m_entries[index] = entry;
+        m_names[index] = state.m_name;
+        m_mcTruths[index] = state.m_mcTruth;
+        return index;
+    }
+
+    size_t getNumStates() const override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_entries.size();
+    }
+    ArchiveStateEntry getEntry(const size_t i) const override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_entries.at(i);
+    }
+    bool isPersistent() const override { return false; }
+    std::string getStateName(const size_t i) const override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_names.at(i);
+    }
+    std::string getStateMCTruth(const size_t i) const override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_mcTruths.at(i);
+    }
+
+    std::string_view getStateBlock(const size_t i, std::string &buffer) const override {
+        const ArchiveStateEntry entry = this->getEntry(i);
+        buffer.resize(entry.size);
+
+        size_t read = 0;
+        while (read < entry.size) {
+            const ssize_t result = pread(m_fd, &buffer[read], entry.size - read, entry.offset + read);
+            if (result <= 0)
+                throw std::runtime_error("HepEVD: Failed to read from the spill file!");
+            read += result;
+        }
+
+        return buffer;
+    }
+
+    // Free the space and index of a state that has been read back.
+    void removeState(const size_t i) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        ArchiveStateEntry &entry = m_entries.at(i);
+
+        if (entry.size == 0)
+            return;
+
+        this->release(entry.offset, entry.size);
+        entry = ArchiveStateEntry();
+        m_names[i].clear();
+        m_names[i].shrink_to_fit();
+        m_mcTruths[i].clear();
+        m_mcTruths[i].shrink_to_fit();
+        m_freeIndices.push_back(i);
+    }
+
+    // Size of the file, including any gaps left by states read back since.
+    size_t getSize() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_size;
+    }
+
+  private:
+    // Find room for a block, reusing the first gap it fits in, or the end of
+    // the file otherwise. Expects the mutex to be held.
+    size_t allocate(const size_t size) {
+        for (auto gap = m_gaps.begin(); gap != m_gaps.end(); ++gap) {
+            if (gap->second < size)
+                continue;
+
+            const size_t offset = gap->first;
+            const size_t remaining = gap->second - size;
+            m_gaps.erase(gap);
+
+            if (remaining > 0)
+                m_gaps[offset + size] = remaining;
+            return offset;
+        }
+
+        const size_t offset = m_size;
+        m_size += size;
+        return offset;
+    }
+
+    // Return a block to the free space, merging it with any neighbouring
+    // gaps, and trimming the file if it was at the end.
+    // Expects the mutex to be held.
+    void release(size_t offset, size_t size) {
+        auto next = m_gaps.lower_bound(offset);
+
+        if (next != m_gaps.end() && offset + size == next->first) {
+            size += next->second;
+            next = m_gaps.erase(next);
+        }
+        if (next != m_gaps.begin()) {
+            const auto prev = std::prev(next);
+            if (prev->first + prev->second == offset) {
+                offset = prev->first;
+                size += prev->second;
+                m_gaps.erase(prev);
+            }
+        }
+
+        if (offset + size < m_size) {
+            m_gaps[offset] = size;
+            return;
+        }
+
+        // If the file can't be shrunk, the space past the end is just
+        // overwritten by the next state instead.
+        m_size = offset;
+        if (ftruncate(m_fd, m_size) != 0)
+            return;
+    }
+
+    mutable std::mutex m_mutex;
+    int m_fd = -1;
+    size_t m_size = 0;
+    std::vector<ArchiveStateEntry> m_entries;
+    std::vector<std::string> m_names;
+    std::vector<std::string> m_mcTruths;
+    std::vector<size_t> m_freeIndices;
+    std::map<size_t, size_t> m_gaps;
+};
+
+// Inactive states, kept compressed in memory rather than spilled to disk.
+// The numeric columns are delta + byte shuffle filtered first, which makes
+// the hit positions in particular compress far better, and the blocks are
+// compressed in chunks, so they can be decompressed in parallel.
+class CompressedStateStore : public StateStore {
+  public:
+    // Compress a state into the store, returning its index.
+    size_t addState(const EventState &state) {
+        std::vector<NumericColumn> columns;
+        std::string block = encodeEventState(state, &columns);
+
+        CompressedState compressed = {summariseEventState(state), state.m_name, state.m_mcTruth,
+                                      std::make_shared<const CompressedBuffer>(std::move(block), columns)};
+        compressed.entry.size = compressed.buffer->getSize();
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_compressedSize += compressed.buffer->getCompressedSize();
+        m_size += compressed.buffer->getSize();
+
+        if (m_freeIndices.empty()) {
+            m_states.push_back(std::move(compressed));
+            return m_states.size() - 1;
+        }
+
+        const size_t index = m_freeIndices.back();
+        m_freeIndices.pop_back();
+        m_states[index] = std::move(compressed);
+        return index;
+    }
+
+    size_t getNumStates() const override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_states.size();
+    }
+    ArchiveStateEntry getEntry(const size_t i) const override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_states.at(i).entry;
+    }
+    bool isPersistent() const override { return false; }
+    std::string getStateName(const size_t i) const override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_states.at(i).name;
+    }
+    std::string getStateMCTruth(const size_t i) const override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_states.at(i).mcTruth;
+    }
+
+    // Only the buffer is looked up under the lock, so states can be
+    // decompressed alongside each other, and alongside other states being
+    // added or removed.
+    std::string_view getStateBlock(const size_t i, std::string &buffer) const override {
+        std::shared_ptr<const CompressedBuffer> compressed;
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            compressed = m_states.at(i).buffer;
+        }
+
+        if (compressed == nullptr)
+            throw std::out_of_range("HepEVD: No compressed state " + std::to_string(i) + "!");
+
+        buffer = compressed->decompress();
+        return buffer;
+    }
+
+    // Free the compressed data, once any reads of it finish. The index is
+    // reused by a later state, rather than removed, so the others don't move.
+    void removeState(const size_t i) override {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        CompressedState &state = m_states.at(i);
+
+        if (state.buffer == nullptr)
+            return;
+
+        m_compressedSize -= state.buffer->getCompressedSize();
+        m_size -= state.buffer->getSize();
+        state = CompressedState();
+        m_freeIndices.push_back(i);
+    }
+
+    // Sizes of the states currently held, before and after compression.
+    size_t getSize() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_size;
+    }
+    size_t getCompressedSize() const {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        return m_compressedSize;
+    }
+
+  private:
+    struct CompressedState {
+        ArchiveStateEntry entry;
+        std::string name;
+        std::string mcTruth;
+        std::shared_ptr<const CompressedBuffer> buffer;
+    };
+
+    mutable std::mutex m_mutex;
+    std::vector<CompressedState> m_states;
+    std::vector<size_t> m_freeIndices;
+    size_t m_size = 0;
+    size_t m_compressedSize = 0;
+};
+
+}; // namespace HepEVD
+
+#endif // HEP_EVD_ARCHIVE_H
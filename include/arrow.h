@@ -0,0 +1,351 @@
+//
+// Arrow Ingest
+//
+// Read hits straight out of Arrow record batches and streams, via the Arrow
+// C data interface. That is just a few plain C structs, so no Arrow library
+// is needed, and anything that produces Arrow data (PyArrow, Polars, DuckDB
+// etc.) can hand its columns over to be read in place, rather than converted.
+
+#ifndef HEP_EVD_ARROW_H
+#define HEP_EVD_ARROW_H
+
+#include "hits.h"
+#include "utils.h"
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <map>
+#include <numeric>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+// The C data interface structs, as given in the Arrow specification.
+// These are guarded in the same way as Arrow's own copy, so either can be used.
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+    const char *format;
+    const char *name;
+    const char *metadata;
+    int64_t flags;
+    int64_t n_children;
+    struct ArrowSchema **children;
+    struct ArrowSchema *dictionary;
+    void (*release)(struct ArrowSchema *);
+    void *private_data;
+};
+
+struct ArrowArray {
+    int64_t length;
+    int64_t null_count;
+    int64_t offset;
+    int64_t n_buffers;
+    int64_t n_children;
+    const void **buffers;
+    struct ArrowArray **children;
+    struct ArrowArray *dictionary;
+    void (*release)(struct ArrowArray *);
+    void *private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+#ifndef ARROW_C_STREAM_INTERFACE
+#define ARROW_C_STREAM_INTERFACE
+
+struct ArrowArrayStream {
+    int (*get_schema)(struct ArrowArrayStream *, struct ArrowSchema *out);
+    int (*get_next)(struct ArrowArrayStream *, struct ArrowArray *out);
+    const char *(*get_last_error)(struct ArrowArrayStream *);
+    void (*release)(struct ArrowArrayStream *);
+    void *private_data;
+};
+
+#endif // ARROW_C_STREAM_INTERFACE
+
+namespace HepEVD {
+
+// Arrow stores float16 columns as raw half precision values.
+inline double halfToDouble(const uint16_t half) {
+    const double sign = (half & 0x8000) ? -1.0 : 1.0;
+    const int exponent = (half >> 10) & 0x1F;
+    const int mantissa = half & 0x3FF;
+
+    if (exponent == 0)
+        return sign * std::ldexp(mantissa, -24);
+    if (exponent == 0x1F)
+        return mantissa == 0 ? sign * std::numeric_limits<double>::infinity()
+                             : std::numeric_limits<double>::quiet_NaN();
+    return sign * std::ldexp(mantissa + 1024, exponent - 25);
+}
+
+// A single numeric column, read in place. Dictionary encoded columns (i.e.
+// categories) are read as the index of each value in the dictionary.
+class ArrowColumn {
+  public:
+    ArrowColumn(const ArrowSchema &schema, const ArrowArray &array, const int64_t parentOffset = 0)
+        : m_name(schema.name ? schema.name : ""), m_type(getType(schema)), m_offset(parentOffset + array.offset) {
+
+        if (m_type == 0)
+            throw std::invalid_argument("HepEVD: Arrow column " + m_name + " has an unsupported type, " +
+                                        std::string(schema.format ? schema.format : "") + "!");
+
+        if (array.n_buffers < 2 || array.buffers == nullptr || (array.length > 0 && array.buffers[1] == nullptr))
+            throw std::invalid_argument("HepEVD: Arrow column " + m_name + " is missing its data!");
+
+        m_validity = array.null_count == 0 ? nullptr : static_cast<const uint8_t *>(array.buffers[0]);
+        m_data = array.buffers[1];
+        m_categoric = schema.dictionary != nullptr;
+    }
+
+    // Only single value, numeric columns can be read.
+    static bool isSupported(const ArrowSchema &schema) { return getType(schema) != 0; }
+
+    const std::string &getName() const { return this->m_name; }
+    bool isCategoric() const { return this->m_categoric; }
+
+    bool isValid(const int64_t row) const {
+        const int64_t i = m_offset + row;
+        return m_validity == nullptr || (m_validity[i / 8] >> (i % 8)) & 1;
+    }
+
+    double get(const int64_t row) const {
+        const int64_t i = m_offset + row;
+
+        switch (m_type) {
+        case 'b':
+            return (static_cast<const uint8_t *>(m_data)[i / 8] >> (i % 8)) & 1;
+        case 'c':
+            return static_cast<const int8_t *>(m_data)[i];
+        case 'C':
+            return static_cast<const uint8_t *>(m_data)[i];
+        case 's':
+            return static_cast<const int16_t *>(m_data)[i];
+        case 'S':
+            return static_cast<const uint16_t *>(m_data)[i];
+        case 'i':
+            return static_cast<const int32_t *>(m_data)[i];
+        case 'I':
+            return static_cast<const uint32_t *>(m_data)[i];
+        case 'l':
+            return static_cast<const int64_t *>(m_data)[i];
+        case 'L':
+            return static_cast<const uint64_t *>(m_data)[i];
+        case 'e':
+            return halfToDouble(static_cast<const uint16_t *>(m_data)[i]);
+        case 'f':
+            return static_cast<const float *>(m_data)[i];
+        default:
+            return static_cast<const double *>(m_data)[i];
+        }
+    }
+
+  private:
+    // The type is the single character format string, or 0 if unsupported.
+    static char getType(const ArrowSchema &schema) {
+        if (schema.format == nullptr || std::strlen(schema.format) != 1)
+            return 0;
+
+        const char type = schema.format[0];
+        return std::strchr("bcCsSiIlLefg", type) != nullptr ? type : 0;
+    }
+
+    std::string m_name;
+    char m_type;
+    int64_t m_offset;
+    const uint8_t *m_validity = nullptr;
+    const void *m_data = nullptr;
+    bool m_categoric = false;
+};
+
+// Read hits from an Arrow record batch, that is a struct array with a child
+// array per column. The columns x, y, z and energy are needed, along with pdg
+// for MC hits, and dim and view are optional. Every other numeric column is
+// added as a property of each hit, with dictionary encoded columns as
+// categoric properties. Nulls are only allowed in the property columns,
+// where the property is left off that hit, as it is for NaN.
+template <typename HitClass>
+std::vector<HitClass> hitsFromArrow(const ArrowSchema &schema, const ArrowArray &array, const std::string &label = "") {
+
+    if (schema.format == nullptr || std::string(schema.format) != "+s" || array.release == nullptr)
+        throw std::invalid_argument("HepEVD: Arrow hits must be a record batch (a struct array)!");
+    if (schema.n_children != array.n_children)
+        throw std::invalid_argument("HepEVD: Arrow schema does not match the array!");
+
+    constexpr bool isMC = std::is_same_v<HitClass, MCHit>;
+    std::map<std::string, ArrowColumn> columns;
+    std::vector<ArrowColumn> properties;
+
+    for (int64_t i = 0; i < schema.n_children; ++i) {
+        const ArrowSchema &childSchema = *schema.children[i];
+        const std::string name = childSchema.name ? childSchema.name : "";
+        const bool isKnown = name == "x" || name == "y" || name == "z" || name == "energy" || name == "dim" ||
+                             name == "view" || (isMC && name == "pdg");
+
+        if (isKnown)
+            columns.emplace(name, ArrowColumn(childSchema, *array.children[i], array.offset));
+        else if (ArrowColumn::isSupported(childSchema))
+            properties.emplace_back(childSchema, *array.children[i], array.offset);
+    }
+
+    for (const std::string name : {"x", "y", "z", "energy"}) {
+        if (columns.count(name) == 0)
+            throw std::invalid_argument("HepEVD: Arrow hits are missing the " + name + " column!");
+    }
+    if (isMC && columns.count("pdg") == 0)
+        throw std::invalid_argument("HepEVD: Arrow MC hits are missing the pdg column!");
+
+    auto getColumn = [&](const std::string &name) { return columns.count(name) ? &columns.at(name) : nullptr; };
+    const ArrowColumn *x = getColumn("x"), *y = getColumn("y"), *z = getColumn("z"), *energy = getColumn("energy");
+    const ArrowColumn *pdg = getColumn("pdg"), *dim = getColumn("dim"), *view = getColumn("view");
+
+    auto get = [](const ArrowColumn *column, const int64_t row) {
+        if (!column->isValid(row))
+            throw std::invalid_argument("HepEVD: Arrow column " + column->getName() + " has a null at row " +
+                                        std::to_string(row) + "!");
+        return column->get(row);
+    };
+
+    std::vector<int64_t> rows(array.length);
+    std::iota(rows.begin(), rows.end(), 0);
+
+    auto chunks = parallel_process(rows, [&](auto begin, auto end) {
+        std::vector<HitClass> chunk;
+        chunk.reserve(std::distance(begin, end));
+
+        for (auto row = begin; row != end; ++row) {
+            const Position pos({get(x, *row), get(y, *row), get(z, *row)});
+
+            HitClass hit = [&]() {
+                if constexpr (isMC)
+                    return HitClass(pos, get(pdg, *row), get(energy, *row));
+                else
+                    return HitClass(pos, get(energy, *row));
+            }();
+
+            if (dim != nullptr)
+                hit.setDim(static_cast<HitDimension>(get(dim, *row)));
+            if (view != nullptr)
+                hit.setHitType(static_cast<HitType>(get(view, *row)));
+            if (!label.empty())
+                hit.setLabel(label);
+
+            for (const auto &property : properties) {
+                if (!property.isValid(*row) || std::isnan(property.get(*row)))
+                    continue;
+
+                hit.addProperty(
+                    {property.getName(), property.isCategoric() ? PropertyType::CATEGORIC : PropertyType::NUMERIC},
+                    property.get(*row));
+            }
+
+            chunk.push_back(std::move(hit));
+        }
+
+        return chunk;
+    });
+
+    std::vector<HitClass> hits;
+    hits.reserve(rows.size());
+    for (auto &chunk : chunks)
+        std::move(chunk.begin(), chunk.end(), std::back_inserter(hits));
+
+    return hits;
+}
+
+// Read a single numeric Arrow array, i.e. the offsets of each particle's hits.
+inline std::vector<double> valuesFromArrow(const ArrowSchema &schema, const ArrowArray &array) {
+    if (array.release == nullptr)
+        throw std::invalid_argument("HepEVD: Arrow array has already been released!");
+
+    const ArrowColumn column(schema, array);
+
+    std::vector<double> values(array.length);
+    for (int64_t i = 0; i < array.length; ++i) {
+        if (!column.isValid(i))
+            throw std::invalid_argument("HepEVD: Arrow array has a null at row " + std::to_string(i) + "!");
+        values[i] = column.get(i);
+    }
+
+    return values;
+}
+
+// Call the given function with every batch of an Arrow stream (i.e. a table
+// made up of many record batches), releasing each batch after. The stream
+// itself is left for its owner to release.
+template <typename Func> void forEachArrowBatch(ArrowArrayStream &stream, Func func) {
+    auto check = [&](const int result) {
+        if (result == 0)
+            return;
+
+        const char *error = stream.get_last_error ? stream.get_last_error(&stream) : nullptr;
+        throw std::runtime_error("HepEVD: Failed to read Arrow stream: " +
+                                 std::string(error ? error : std::strerror(result)));
+    };
+
+    if (stream.release == nullptr)
+        throw std::invalid_argument("HepEVD: Arrow stream has already been released!");
+
+    ArrowSchema schema;
+    check(stream.get_schema(&stream, &schema));
+
+    // Make sure everything is released, even if a batch can't be read.
+    struct Releaser {
+        ArrowSchema &schema;
+        ArrowArray batch;
+        ~Releaser() {
+            if (batch.release)
+                batch.release(&batch);
+            if (schema.release)
+                schema.release(&schema);
+        }
+    } releaser{schema, {}};
+
+    while (true) {
+        check(stream.get_next(&stream, &releaser.batch));
+
+        // The end of the stream is marked by a released batch.
+        if (releaser.batch.release == nullptr)
+            break;
+
+        func(schema, releaser.batch);
+        releaser.batch.release(&releaser.batch);
+    }
+}
+
+template <typename HitClass>
+std::vector<HitClass> hitsFromArrowStream(ArrowArrayStream &stream, const std::string &label = "") {
+    std::vector<HitClass> hits;
+
+    forEachArrowBatch(stream, [&](const ArrowSchema &schema, const ArrowArray &batch) {
+        std::vector<HitClass> batchHits = hitsFromArrow<HitClass>(schema, batch, label);
+        std::move(batchHits.begin(), batchHits.end(), std::back_inserter(hits));
+    });
+
+    return hits;
+}
+
+inline std::vector<double> valuesFromArrowStream(ArrowArrayStream &stream) {
+    std::vector<double> values;
+
+    forEachArrowBatch(stream, [&](const ArrowSchema &schema, const ArrowArray &batch) {
+        const std::vector<double> batchValues = valuesFromArrow(schema, batch);
+        values.insert(values.end(), batchValues.begin(), batchValues.end());
+    });
+
+    return values;
+}
+
+}; // namespace HepEVD
+
+#endif // HEP_EVD_ARROW_H
@@ -51,8 +51,19 @@ class HitMapManager {
     }
     void registerClearFunction(std::function<void()> clearFunction) { clearFunctions.push_back(clearFunction); }
 
+    // Some maps last for the whole event, rather than a single state,
+    // so are only cleared when the server is reset.
+    void reset() {
+        this->clear();
+        for (auto &resetFunction : resetFunctions) {
+            resetFunction();
+        }
+    }
+    void registerResetFunction(std::function<void()> resetFunction) { resetFunctions.push_back(resetFunction); }
+
   private:
     std::list<std::function<void()>> clearFunctions;
+    std::list<std::function<void()>> resetFunctions;
 };
 inline HitMapManager hepEvdHitMapManager;
 
@@ -61,6 +72,9 @@ inline HitMapManager hepEvdHitMapManager;
 static void registerClearFunction(std::function<void()> clearFunction) {
     hepEvdHitMapManager.registerClearFunction(clearFunction);
 }
+static void registerResetFunction(std::function<void()> resetFunction) {
+    hepEvdHitMapManager.registerResetFunction(resetFunction);
+}
 
 // Check if the server is initialised, and if not, print a message.
 // This means we can be certain that the server is set up before we
@@ -78,33 +92,95 @@ static bool isServerInitialised(const bool quiet = false) {
     return isInit;
 }
 
+// Once the server is running in the background, the states are read by its
+// threads whilst the helpers here change them, so every helper that changes
+// a state holds one of these. The update lock isn't recursive, so it is only
+// taken once per thread, i.e. when helpers call each other, or are called by
+// the Python bindings, which already hold it.
+class ServerUpdateLock {
+  public:
+    ServerUpdateLock() {
+        if (hepEVDServer == nullptr || !hepEVDServer->isRunning() || isHeld())
+            return;
+
+        m_lock = hepEVDServer->lockForUpdate();
+        isHeld() = true;
+    }
+    ~ServerUpdateLock() {
+        if (m_lock.owns_lock())
+            isHeld() = false;
+    }
+
+    ServerUpdateLock(const ServerUpdateLock &) = delete;
+    ServerUpdateLock &operator=(const ServerUpdateLock &) = delete;
+
+  private:
+    static bool &isHeld() {
+        thread_local bool held = false;
+        return held;
+    }
+
+    std::unique_lock<std::shared_mutex> m_lock;
+};
+
 static void startServer(const int startState = -1, const bool clearOnShow = true) {
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     if (startState != -1)
         hepEVDServer->swapEventState(startState);
-    else if (hepEVDServer->getState()->isEmpty())
+    else if (hepEVDServer->viewState()->isEmpty())
         hepEVDServer->previousEventState();
 
     hepEVDLog("There are " + std::to_string(hepEVDServer->getHits().size()) + " hits registered!");
     hepEVDLog("There are " + std::to_string(hepEVDServer->getMCHits().size()) + " MC hits registered!");
-    hepEVDLog("There are " + std::to_string(hepEVDServer->getParticles().size()) + " particles registered!");
+    hepEVDLog("There are " + std::to_string(hepEVDServer->viewState()->m_particles.size()) + " particles registered!");
     hepEVDLog("There are " + std::to_string(hepEVDServer->getMarkers().size()) + " markers registered!");
 
     hepEVDServer->startServer();
 
-    if (clearOnShow) {
+    // If it's running in the background, the states are still being viewed.
+    if (clearOnShow && !hepEVDServer->isRunning()) {
         hepEVDLog("Resetting the server...");
         hepEVDServer->resetServer();
+        hepEvdHitMapManager.reset();
     }
 }
 
+// Start the server in the background, and return straight away, so states
+// can keep being added, and are shown as they are. Nothing is cleared.
+static bool startServerInBackground(const int startState = -1) {
+    if (!isServerInitialised())
+        return false;
+
+    const ServerUpdateLock lock;
+
+    if (startState != -1)
+        hepEVDServer->swapEventState(startState);
+
+    if (!hepEVDServer->startServerInBackground())
+        return false;
+
+    hepEVDLog("HepEVD server is running in the background.");
+    return true;
+}
+
+static void stopServer() {
+    if (hepEVDServer == nullptr)
+        return;
+
+    hepEVDServer->stopServer();
+}
+
 static void saveState(const std::string stateName, const int minSize = -1, const bool clearOnShow = true) {
 
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     hepEVDLog("Saving state: " + stateName);
 
     // Set the name of the current state...
@@ -119,8 +195,9 @@ static void saveState(const std::string stateName, const int minSize = -1, const
     if (minSize != -1 && hepEVDServer->getNumberOfEventStates() >= minSize) {
         hepEVDServer->startServer();
 
-        if (clearOnShow) {
+        if (clearOnShow && !hepEVDServer->isRunning()) {
             hepEVDServer->resetServer();
+            hepEvdHitMapManager.reset();
             shouldIncState = false;
         }
     }
@@ -138,16 +215,62 @@ static void resetServer(const bool resetGeo = false) {
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     hepEVDLog("Resetting the server...");
 
     hepEVDServer->resetServer(resetGeo);
-    hepEvdHitMapManager.clear();
+    hepEvdHitMapManager.reset();
+}
+
+// Set how many decimal places positions and energies are written out with.
+// -1 keeps the full precision, and at most 15 decimal places can be used.
+static void setOutputPrecision(const int positionDecimals, const int energyDecimals = -1) {
+    if (!isServerInitialised())
+        return;
+
+    const ServerUpdateLock lock;
+
+    hepEVDServer->setOutputPrecision({positionDecimals, energyDecimals});
+}
+
+// Keep the states in memory under the given size, in megabytes, spilling
+// the least recently used ones out to disk. A budget of 0 removes the limit.
+static void setMemoryBudget(const size_t megabytes, const std::string spillDirectory = "") {
+    if (!isServerInitialised())
+        return;
+
+    const ServerUpdateLock lock;
+
+    hepEVDServer->setMemoryBudget(megabytes * 1024 * 1024, spillDirectory);
+}
+
+// Keep every state other than the current and newest compressed in memory.
+static void setStateCompression(const bool compress) {
+    if (!isServerInitialised())
+        return;
+
+    const ServerUpdateLock lock;
+
+    hepEVDServer->setStateCompression(compress);
+}
+
+// Save every state to a binary archive file, which works without ever
+// starting the server, i.e. from batch jobs.
+static void writeArchive(const std::string &path) {
+    if (!isServerInitialised())
+        return;
+
+    const size_t numStates = hepEVDServer->writeArchive(path);
+    hepEVDLog("Wrote " + std::to_string(numStates) + " states to " + path);
 }
 
 static void clearState(const bool fullReset = false) {
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     hepEVDLog("Clearing server state...");
 
     // If we are doing a full reset, we also clear the MC truth.
@@ -157,12 +280,14 @@ static void clearState(const bool fullReset = false) {
     hepEvdHitMapManager.clear();
 }
 
-static void addMarkers(const Markers &markers) {
+static void addMarkers(Markers markers) {
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     hepEVDLog("Adding " + std::to_string(markers.size()) + " markers to the event display...");
-    hepEVDServer->addMarkers(markers);
+    hepEVDServer->addMarkers(std::move(markers));
 }
 
 }; // namespace HepEVD
@@ -0,0 +1,299 @@
+//
+// Compression
+//
+// A small, fast LZ77 codec (following the LZ4 block format), along with the
+// delta + byte shuffle filter used on numeric columns before compressing.
+// This is used to keep inactive event states compressed in memory, so is
+// tuned for speed over ratio, and needs no external dependencies.
+
+#ifndef HEP_EVD_COMPRESSION_H
+#define HEP_EVD_COMPRESSION_H
+
+#include "utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <future>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace HepEVD {
+
+// Compress a buffer. Each sequence is a token (the literal length and the
+// match length, a nibble each), any longer lengths, the literals, then the
+// offset back to the match. The last few bytes are always literals.
+inline std::string lzCompress(const char *input, const size_t size) {
+    constexpr int HASH_BITS = 16;
+    constexpr size_t MIN_MATCH = 4;
+    constexpr size_t MAX_OFFSET = 65535;
+    constexpr size_t END_LITERALS = 5;
+
+    if (size > UINT32_MAX)
+        throw std::invalid_argument("HepEVD: Buffer too large to compress in one go!");
+
+    std::string output;
+    output.reserve(size / 2 + 16);
+
+    std::vector<uint32_t> table(1 << HASH_BITS, 0);
+    auto read32 = [&](const size_t pos) {
+        uint32_t value;
+        std::memcpy(&value, input + pos, sizeof(value));
+        return value;
+    };
+    auto hash = [](const uint32_t value) { return (value * 2654435761u) >> (32 - HASH_BITS); };
+    auto writeLength = [&](size_t length) {
+        for (; length >= 255; length -= 255)
+            output.push_back(static_cast<char>(255));
+        output.push_back(static_cast<char>(length));
+    };
+    auto writeLiterals = [&](const size_t begin, const size_t end, const size_t matchLength) {
+        const size_t literalLength = end - begin;
+        const size_t matchCode = matchLength == 0 ? 0 : matchLength - MIN_MATCH;
+
+        output.push_back(static_cast<char>((std::min<size_t>(literalLength, 15) << 4) |
+                                           std::min<size_t>(matchCode, 15)));
+        if (literalLength >= 15)
+            writeLength(literalLength - 15);
+        output.append(input + begin, literalLength);
+    };
+
+    size_t anchor = 0;
+    size_t pos = 0;
+    const size_t matchLimit = size > END_LITERALS + MIN_MATCH ? size - END_LITERALS - MIN_MATCH : 0;
+
+    while (pos < matchLimit) {
+        const uint32_t sequence = read32(pos);
+        const uint32_t slot = hash(sequence);
+        const size_t candidate = table[slot];
+        table[slot] = pos;
+
+        if (candidate >= pos || pos - candidate > MAX_OFFSET || read32(candidate) != sequence) {
+            // Skip through incompressible data faster the longer it goes on.
+            pos += 1 + ((pos - anchor) >> 6);
+            continue;
+        }
+
+        size_t matchLength = MIN_MATCH;
+        const size_t maxLength = size - END_LITERALS - pos;
+        while (matchLength < maxLength && input[candidate + matchLength] == input[pos + matchLength])
+            ++matchLength;
+
+        writeLiterals(anchor, pos, matchLength);
+
+        const size_t offset = pos - candidate;
+        output.push_back(static_cast<char>(offset & 0xFF));
+        output.push_back(static_cast<char>(offset >> 8));
+
+        if (matchLength - MIN_MATCH >= 15)
+            writeLength(matchLength - MIN_MATCH - 15);
+
+        pos += matchLength;
+        anchor = pos;
+    }
+
+    writeLiterals(anchor, size, 0);
+    return output;
+}
+
+// Decompress into a buffer of the known, uncompressed size.
+// Everything is bounds checked, so bad input throws rather than overruns.
+inline void lzDecompress(const char *input, const size_t size, char *output, const size_t outputSize) {
+    auto fail = []() { throw std::runtime_error("HepEVD: Compressed data is corrupt!"); };
+
+    size_t in = 0;
+    size_t out = 0;
+
+    auto readLength = [&]() {
+        size_t length = 0;
+        uint8_t byte = 255;
+        while (byte == 255) {
+            if (in >= size)
+                fail();
+            byte = static_cast<uint8_t>(input[in++]);
+            length += byte;
+        }
+        return length;
+    };
+
+    while (in < size) {
+        const uint8_t token = static_cast<uint8_t>(input[in++]);
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15)
+            literalLength += readLength();
+
+        if (literalLength > size - in || literalLength > outputSize - out)
+            fail();
+        std::memcpy(output + out, input + in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        // The last sequence has no match.
+        if (in == size)
+            break;
+
+        if (size - in < 2)
+            fail();
+        const size_t offset = static_cast<uint8_t>(input[in]) | (static_cast<uint8_t>(input[in + 1]) << 8);
+        in += 2;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15)
+            matchLength += readLength();
+        matchLength += 4;
+
+        if (offset == 0 || offset > out || matchLength > outputSize - out)
+            fail();
+
+        // Matches can overlap the bytes they produce, so may need copying one at a time.
+        const char *match = output + out - offset;
+        if (offset >= matchLength) {
+            std::memcpy(output + out, match, matchLength);
+        } else {
+            for (size_t i = 0; i < matchLength; ++i)
+                output[out + i] = match[i];
+        }
+        out += matchLength;
+    }
+
+    if (out != outputSize)
+        fail();
+}
+
+// Neighbouring values in a numeric column (i.e. the hit positions) are close
+// together, so storing the difference to the previous value, then grouping the
+// same byte of every value together, leaves long runs for the LZ stage.
+// Values are differenced as integers, so this is exactly reversible for floats.
+template <typename UIntType> inline void deltaShuffle(char *data, const size_t count) {
+    std::vector<char> shuffled(count * sizeof(UIntType));
+
+    UIntType previous = 0;
+    for (size_t i = 0; i < count; ++i) {
+        UIntType value;
+        std::memcpy(&value, data + i * sizeof(UIntType), sizeof(UIntType));
+
+        const UIntType delta = value - previous;
+        previous = value;
+
+        for (size_t byte = 0; byte < sizeof(UIntType); ++byte)
+            shuffled[byte * count + i] = static_cast<char>((delta >> (8 * byte)) & 0xFF);
+    }
+
+    std::memcpy(data, shuffled.data(), shuffled.size());
+}
+
+template <typename UIntType> inline void deltaUnshuffle(char *data, const size_t count) {
+    std::vector<char> shuffled(data, data + count * sizeof(UIntType));
+
+    UIntType previous = 0;
+    for (size_t i = 0; i < count; ++i) {
+        UIntType delta = 0;
+        for (size_t byte = 0; byte < sizeof(UIntType); ++byte)
+            delta |= static_cast<UIntType>(static_cast<uint8_t>(shuffled[byte * count + i])) << (8 * byte);
+
+        previous += delta;
+        std::memcpy(data + i * sizeof(UIntType), &previous, sizeof(UIntType));
+    }
+}
+
+// A numeric column within a buffer, that the delta + shuffle filter can be used on.
+struct NumericColumn {
+    size_t offset;
+    size_t count;
+    size_t valueSize;
+};
+
+// A buffer, filtered and then compressed in independent chunks, so it can be
+// compressed and decompressed in parallel.
+class CompressedBuffer {
+  public:
+    static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+    CompressedBuffer() {}
+    CompressedBuffer(std::string data, const std::vector<NumericColumn> &columns)
+        : m_size(data.size()), m_columns(columns) {
+
+        for (const auto &column : m_columns)
+            this->checkColumn(column);
+
+        runParallel(m_columns.size(), [&](const size_t i) { filterColumn(&data[0], m_columns[i], true); });
+
+        m_chunks.resize((m_size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+        runParallel(m_chunks.size(), [&](const size_t i) {
+            const size_t begin = i * CHUNK_SIZE;
+            m_chunks[i] = lzCompress(data.data() + begin, std::min(CHUNK_SIZE, m_size - begin));
+        });
+    }
+
+    std::string decompress() const {
+        std::string data(m_size, '\0');
+
+        runParallel(m_chunks.size(), [&](const size_t i) {
+            const size_t begin = i * CHUNK_SIZE;
+            lzDecompress(m_chunks[i].data(), m_chunks[i].size(), &data[begin], std::min(CHUNK_SIZE, m_size - begin));
+        });
+
+        runParallel(m_columns.size(), [&](const size_t i) { filterColumn(&data[0], m_columns[i], false); });
+
+        return data;
+    }
+
+    size_t getSize() const { return m_size; }
+    size_t getCompressedSize() const {
+        size_t size = 0;
+        for (const auto &chunk : m_chunks)
+            size += chunk.size();
+        return size;
+    }
+
+  private:
+    void checkColumn(const NumericColumn &column) const {
+        if ((column.valueSize != 4 && column.valueSize != 8) || column.offset > m_size ||
+            column.count > (m_size - column.offset) / column.valueSize)
+            throw std::invalid_argument("HepEVD: Invalid numeric column to compress!");
+    }
+
+    static void filterColumn(char *data, const NumericColumn &column, const bool forward) {
+        char *begin = data + column.offset;
+
+        if (column.valueSize == 8)
+            forward ? deltaShuffle<uint64_t>(begin, column.count) : deltaUnshuffle<uint64_t>(begin, column.count);
+        else
+            forward ? deltaShuffle<uint32_t>(begin, column.count) : deltaUnshuffle<uint32_t>(begin, column.count);
+    }
+
+    // Run each task on its own thread, up to the hardware concurrency.
+    template <typename Func> static void runParallel(const size_t numTasks, Func func) {
+        if (numTasks <= 1) {
+            for (size_t i = 0; i < numTasks; ++i)
+                func(i);
+            return;
+        }
+
+        std::atomic<size_t> nextTask(0);
+        auto worker = [&]() {
+            for (size_t i = nextTask++; i < numTasks; i = nextTask++)
+                func(i);
+        };
+
+        const size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), numTasks);
+        std::vector<std::future<void>> workers;
+        for (size_t i = 0; i < numThreads; ++i)
+            workers.push_back(std::async(std::launch::async, worker));
+
+        for (auto &result : workers)
+            result.get();
+    }
+
+    size_t m_size = 0;
+    std::vector<NumericColumn> m_columns;
+    std::vector<std::string> m_chunks;
+};
+
+}; // namespace HepEVD
+
+#endif // HEP_EVD_COMPRESSION_H
@@ -11,6 +11,8 @@
 
 #include "extern/json.hpp"
 using json = nlohmann::json;
+#include "extern/rapidjson/stringbuffer.h"
+#include "extern/rapidjson/writer.h"
 
 #include <map>
 #include <string>
@@ -20,7 +22,7 @@ using json = nlohmann::json;
 namespace HepEVD {
 
 enum VolumeType { BOX, SPHERE, CYLINDER, TRAPEZOID, RECTANGLE2D };
-NLOHMANN_JSON_SERIALIZE_ENUM(
+HEP_EVD_SERIALIZE_ENUM(
     VolumeType,
     {{BOX, "box"}, {SPHERE, "sphere"}, {CYLINDER, "cylinder"}, {TRAPEZOID, "trapezoid"}, {RECTANGLE2D, "rectangle2D"}})
 
@@ -43,6 +45,28 @@ class BoxVolume {
     void setOpacity(double newOpacity) { this->opacity = newOpacity; }
     void setColour(std::string newColour) { this->colour = newColour; }
 
+    // RapidJSON serialization, matching to_json below.
+    template <typename WriterType> void writeJson(WriterType &writer) const {
+        writer.StartObject();
+
+        writer.Key("volumeType");
+        writeEnumJson(writer, BOX);
+        writer.Key("position");
+        this->m_position.writeJson(writer);
+        writer.Key("xWidth");
+        writer.Double(this->m_xWidth);
+        writer.Key("yWidth");
+        writer.Double(this->m_yWidth);
+        writer.Key("zWidth");
+        writer.Double(this->m_zWidth);
+        writer.Key("opacity");
+        writer.Double(this->opacity);
+        writer.Key("colour");
+        writer.String(this->colour.c_str(), static_cast<rapidjson::SizeType>(this->colour.length()));
+
+        writer.EndObject();
+    }
+
     // Use custom to/from_json to allow including the volume type.
     friend void to_json(json &j, const BoxVolume &box) {
         j["volumeType"] = BOX;
@@ -86,6 +110,22 @@ class CylinderVolume {
     double getRadius() const { return this->m_radius; }
     double getHeight() const { return this->m_height; }
 
+    // RapidJSON serialization, matching to_json below.
+    template <typename WriterType> void writeJson(WriterType &writer) const {
+        writer.StartObject();
+
+        writer.Key("volumeType");
+        writeEnumJson(writer, CYLINDER);
+        writer.Key("position");
+        this->m_position.writeJson(writer);
+        writer.Key("radius");
+        writer.Double(this->m_radius);
+        writer.Key("height");
+        writer.Double(this->m_height);
+
+        writer.EndObject();
+    }
+
     // Use custom to/from_json to allow including the volume type.
     friend void to_json(json &j, const CylinderVolume &cylinder) {
         j["volumeType"] = CYLINDER;
@@ -130,6 +170,9 @@ class TrapezoidVolume {
     Position getBottomLeft() const { return this->m_bottomLeft; }
     Position getBottomRight() const { return this->m_bottomRight; }
 
+    // RapidJSON serialization, matching to_json below.
+    template <typename WriterType> void writeJson(WriterType &writer) const { this->writeJson(writer, TRAPEZOID); }
+
     // Use custom to/from_json to allow including the volume type.
     friend void to_json(json &j, const TrapezoidVolume &trapezoid) {
         j["volumeType"] = TRAPEZOID;
@@ -149,6 +192,26 @@ class TrapezoidVolume {
     }
 
   protected:
+    // Shared with Rectangle2DVolume, which only differs in its type.
+    template <typename WriterType> void writeJson(WriterType &writer, const VolumeType type) const {
+        writer.StartObject();
+
+        writer.Key("volumeType");
+        writeEnumJson(writer, type);
+        writer.Key("position");
+        this->m_position.writeJson(writer);
+        writer.Key("topLeft");
+        this->m_topLeft.writeJson(writer);
+        writer.Key("topRight");
+        this->m_topRight.writeJson(writer);
+        writer.Key("bottomLeft");
+        this->m_bottomLeft.writeJson(writer);
+        writer.Key("bottomRight");
+        this->m_bottomRight.writeJson(writer);
+
+        writer.EndObject();
+    }
+
     Position m_position;
     Position m_topLeft, m_topRight, m_bottomLeft, m_bottomRight;
 };
@@ -163,6 +226,11 @@ class Rectangle2DVolume : public TrapezoidVolume {
   public:
     static const VolumeType volumeType = RECTANGLE2D;
 
+    // RapidJSON serialization, matching to_json below.
+    template <typename WriterType> void writeJson(WriterType &writer) const {
+        TrapezoidVolume::writeJson(writer, RECTANGLE2D);
+    }
+
     // Use custom to/from_json to allow including the volume type.
     friend void to_json(json &j, const Rectangle2DVolume &rect) {
         j["volumeType"] = RECTANGLE2D;
@@ -187,6 +255,11 @@ using AllVolumes = std::variant<BoxVolume, CylinderVolume, TrapezoidVolume, Rect
 using Volumes = std::vector<AllVolumes>;
 using VolumeMap = std::vector<std::pair<VolumeType, std::vector<double>>>;
 
+// RapidJSON serialization for any volume.
+template <typename WriterType> inline void writeVolumeJson(WriterType &writer, const AllVolumes &volume) {
+    std::visit([&writer](const auto &vol) { vol.writeJson(writer); }, volume);
+}
+
 // Define the required JSON formatters for the detector geometry volumes.
 inline static void to_json(json &j, const AllVolumes &volumes) {
     std::visit([&j](const auto &vol) { j = vol; }, volumes);
@@ -263,6 +336,14 @@ class DetectorGeometry {
 
     int size() { return this->m_volumes.size(); }
     void clear() { return this->m_volumes.clear(); }
+    const Volumes &getVolumes() const { return this->m_volumes; }
+
+    // RapidJSON serialization, matching to_json below.
+    std::string toJsonString() const {
+        return "{\"volumes\":" + parallel_to_json_array(this->m_volumes, [](auto &writer, const AllVolumes &vol) {
+                   writeVolumeJson(writer, vol);
+               }) + "}";
+    }
 
     // Define to/from_json.
     friend void to_json(json &j, const DetectorGeometry &geom) { j["volumes"] = geom.m_volumes; }
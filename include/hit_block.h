@@ -0,0 +1,261 @@
+//
+// Hit Blocks
+//
+// A block of hits, that can be shared between event states. The same hits
+// are often added to many states (i.e. the input hits for every algorithm
+// that is being debugged), so blocks are content addressed: once a block is
+// finished, it is swapped for an identical block another state already holds,
+// if there is one. Each unique block is then only stored once, along with
+// anything serialised from it, rather than once per state.
+
+#ifndef HEP_EVD_HIT_BLOCK_H
+#define HEP_EVD_HIT_BLOCK_H
+
+#include "hits.h"
+#include "utils.h"
+
+#include <cstdint>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <unordered_map>
+#include <vector>
+
+namespace HepEVD {
+
+// FNV-1a, mixed in a field at a time.
+inline uint64_t hashBytes(uint64_t hash, const void *data, const size_t size) {
+    const unsigned char *bytes = static_cast<const unsigned char *>(data);
+    for (size_t i = 0; i < size; ++i) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+template <typename T> inline uint64_t hashValue(const uint64_t hash, const T &value) {
+    return hashBytes(hash, &value, sizeof(T));
+}
+inline uint64_t hashValue(const uint64_t hash, const std::string &value) {
+    return hashBytes(hashValue(hash, value.size()), value.data(), value.size());
+}
+
+// Hash everything about a hit, so identical hits always hash the same.
+inline uint64_t hashHit(uint64_t hash, const Hit &hit) {
+    const Position &pos = hit.getPosition();
+    const Position &width = hit.getWidth();
+
+    hash = hashValue(hash, hit.getId());
+    for (const double value : {pos.x, pos.y, pos.z, width.x, width.y, width.z, hit.getEnergy()})
+        hash = hashValue(hash, value);
+    hash = hashValue(hash, static_cast<int>(pos.dim));
+    hash = hashValue(hash, static_cast<int>(pos.hitType));
+    hash = hashValue(hash, hit.getLabel());
+    hash = hashValue(hash, hit.getColour());
+
+    for (const auto &property : hit.getProperties()) {
+        hash = hashValue(hash, std::get<0>(property.first));
+        hash = hashValue(hash, static_cast<int>(std::get<1>(property.first)));
+        hash = hashValue(hash, property.second);
+    }
+
+    return hash;
+}
+
+inline bool hitsMatch(const Hit &a, const Hit &b) {
+    return a.getId() == b.getId() && a.getPosition() == b.getPosition() && a.getDim() == b.getDim() &&
+           a.getHitType() == b.getHitType() && a.getWidth() == b.getWidth() && a.getEnergy() == b.getEnergy() &&
+           a.getLabel() == b.getLabel() && a.getColour() == b.getColour() && a.getProperties() == b.getProperties();
+}
+
+template <typename HitClass> class HitBlock {
+  public:
+    using Container = std::vector<HitClass>;
+
+    HitBlock() {}
+    HitBlock(Container hits) : m_data(std::make_shared<Data>()) { m_data->hits = std::move(hits); }
+
+    // Read only access, as if this was the vector of hits itself.
+    const Container &get() const { return m_data ? m_data->hits : emptyBlock(); }
+    operator const Container &() const { return this->get(); }
+
+    size_t size() const { return this->get().size(); }
+    bool empty() const { return this->get().empty(); }
+    const HitClass &operator[](const size_t i) const { return this->get()[i]; }
+    typename Container::const_iterator begin() const { return this->get().begin(); }
+    typename Container::const_iterator end() const { return this->get().end(); }
+    typename Container::const_iterator cbegin() const { return this->get().cbegin(); }
+    typename Container::const_iterator cend() const { return this->get().cend(); }
+
+    void clear() { m_data.reset(); }
+
+    // Get the hits to change them. Shared blocks are never changed in
+    // place, so the block is copied first if anything else is using it.
+    // A block that could be shared, but isn't, is just taken out of the pool.
+    Container &edit() {
+        if (!m_data)
+            m_data = std::make_shared<Data>();
+        else if (m_data->interned)
+            this->unintern();
+
+        if (m_data.use_count() > 1) {
+            auto copy = std::make_shared<Data>();
+            copy->hits = m_data->hits;
+            m_data = copy;
+        }
+
+        return m_data->hits;
+    }
+
+    // If the hits can be changed in place, without affecting any other state.
+    bool isUnique() const { return !m_data || (!m_data->interned && m_data.use_count() == 1); }
+
+    // Swap this block for an identical one that already exists, or make it
+    // available to be shared if there isn't one. Should be called once the
+    // hits are all added (i.e. when a state is left), as the block can't be
+    // changed in place afterwards, and this hashes every hit in it.
+    void intern() {
+        if (!m_data || m_data->interned || m_data->hits.empty())
+            return;
+
+        uint64_t hash = hashValue(14695981039346656037ULL, m_data->hits.size());
+        for (const auto &hit : m_data->hits)
+            hash = hashHit(hash, hit);
+
+        std::lock_guard<std::mutex> lock(getPoolMutex());
+        auto &pool = getPool();
+
+        const auto candidates = pool.equal_range(hash);
+        for (auto it = candidates.first; it != candidates.second; ++it) {
+            const auto other = it->second.lock();
+
+            if (other && this->matches(other->hits)) {
+                m_data = other;
+                return;
+            }
+        }
+
+        // Drop any blocks no longer used by anything, every so often.
+        if (pool.size() >= 2 * getPoolSweepSize()) {
+            for (auto it = pool.begin(); it != pool.end();)
+                it = it->second.expired() ? pool.erase(it) : std::next(it);
+            getPoolSweepSize() = std::max<size_t>(pool.size(), 64);
+        }
+
+        m_data->interned = true;
+        m_data->hash = hash;
+        pool.emplace(hash, m_data);
+    }
+
+    // How many states this block is shared between.
+    size_t getShareCount() const { return m_data ? m_data.use_count() : 1; }
+
+    // Serialise the hits, reusing the output from any other state sharing
+    // this block. The output is only kept whilst the block is shared, and
+    // is per-precision, so each state can use its own.
+    template <typename SerialiseFunc>
+    std::string getJson(const OutputPrecision &precision, SerialiseFunc serialise) const {
+        if (!m_data || !m_data->interned)
+            return serialise(this->get());
+
+        std::lock_guard<std::mutex> lock(m_data->jsonMutex);
+
+        if (m_data.use_count() < 2) {
+            m_data->json.clear();
+            return serialise(this->get());
+        }
+
+        const auto key = std::make_pair(precision.positionDecimals, precision.energyDecimals);
+        auto cached = m_data->json.find(key);
+        if (cached == m_data->json.end())
+            cached = m_data->json.emplace(key, serialise(this->get())).first;
+
+        return cached->second;
+    }
+
+    // Size of any serialised output being kept for reuse.
+    size_t getJsonMemoryUsage() const {
+        if (!m_data)
+            return 0;
+
+        std::lock_guard<std::mutex> lock(m_data->jsonMutex);
+
+        size_t bytes = 0;
+        for (const auto &output : m_data->json)
+            bytes += output.second.capacity();
+        return bytes;
+    }
+
+  private:
+    struct Data {
+        Container hits;
+        bool interned = false;
+        uint64_t hash = 0;
+
+        mutable std::mutex jsonMutex;
+        std::map<std::pair<int, int>, std::string> json;
+    };
+
+    // Take the block out of the pool, if nothing else has picked it up from
+    // there. Checked under the pool lock, as that is how other states find it.
+    void unintern() {
+        std::lock_guard<std::mutex> lock(getPoolMutex());
+
+        if (m_data.use_count() > 1)
+            return;
+
+        auto &pool = getPool();
+        const auto candidates = pool.equal_range(m_data->hash);
+        for (auto it = candidates.first; it != candidates.second; ++it) {
+            if (it->second.lock() == m_data) {
+                pool.erase(it);
+                break;
+            }
+        }
+
+        m_data->interned = false;
+
+        std::lock_guard<std::mutex> jsonLock(m_data->jsonMutex);
+        m_data->json.clear();
+    }
+
+    bool matches(const Container &other) const {
+        const Container &hits = m_data->hits;
+        if (hits.size() != other.size())
+            return false;
+
+        for (size_t i = 0; i < hits.size(); ++i) {
+            if (!hitsMatch(hits[i], other[i]))
+                return false;
+        }
+
+        return true;
+    }
+
+    static const Container &emptyBlock() {
+        static const Container empty;
+        return empty;
+    }
+
+    // Every block that can currently be shared, by the hash of its hits.
+    static std::unordered_multimap<uint64_t, std::weak_ptr<Data>> &getPool() {
+        static std::unordered_multimap<uint64_t, std::weak_ptr<Data>> pool;
+        return pool;
+    }
+    static std::mutex &getPoolMutex() {
+        static std::mutex mutex;
+        return mutex;
+    }
+    static size_t &getPoolSweepSize() {
+        static size_t size = 64;
+        return size;
+    }
+
+    std::shared_ptr<Data> m_data;
+};
+
+}; // namespace HepEVD
+
+#endif // HEP_EVD_HIT_BLOCK_H
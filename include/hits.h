@@ -28,6 +28,9 @@ namespace HepEVD {
 
 using HitProperties = std::map<std::tuple<std::string, PropertyType>, double>;
 
+// Whole columns of properties, with one value per hit.
+using HitPropertyColumns = std::map<std::tuple<std::string, PropertyType>, std::vector<double>>;
+
 // Forward declare function to write hit properties as JSON.
 template <typename WriterType> void writePropertiesJson(WriterType &writer, const HitProperties &properties);
 
@@ -37,21 +40,27 @@ class Hit {
     Hit(const Position &pos, double e = 0) : m_id(getUUID()), m_position(pos), m_energy(e) {}
     Hit(const PosArray &pos, double e = 0) : m_id(getUUID()), m_position(pos), m_energy(e) {}
 
+    // Rebuild a hit that already has an ID, i.e. one being read back in.
+    Hit(const std::string &id, const Position &pos, double e) : m_id(id), m_position(pos), m_energy(e) {}
+
     void setDim(const HitDimension &dim) { this->m_position.setDim(dim); }
     void setHitType(const HitType &hitType) { this->m_position.setHitType(hitType); }
     void setLabel(const std::string &str) { this->m_label = str; }
     void setEnergy(double e) { this->m_energy = e; }
     void setPosition(const Position &pos) { this->m_position = pos; }
     void setWidth(const std::string &axis, const float width) { this->m_width.setValue(axis, width); }
+    void setWidth(const Position &width) { this->m_width = width; }
     void setColour(const std::string &colour) { this->m_colour = colour; }
 
-    std::string getId() const { return this->m_id; }
+    const std::string &getId() const { return this->m_id; }
     const Position &getPosition() const { return this->m_position; }
     const Position &getWidth() const { return this->m_width; }
     double getEnergy() const { return this->m_energy; }
     HitDimension getDim() const { return this->m_position.dim; }
     HitType getHitType() const { return this->m_position.hitType; }
     const std::string &getColour() const { return this->m_colour; }
+    const std::string &getLabel() const { return this->m_label; }
+    const HitProperties &getProperties() const { return this->m_properties; }
 
     // If no type is specified, the type is assumed to be numeric.
     void addProperties(std::map<std::string, double> props) {
@@ -69,6 +78,11 @@ class Hit {
         return;
     }
 
+    // Add a single property, without building a map of them first.
+    void addProperty(const std::tuple<std::string, PropertyType> &prop, const double value) {
+        this->m_properties.insert({prop, value});
+    }
+
     // RapidJSON serialization, which is faster than nlohmann::json.
     // This is important for the potentially large number of hits.
     template <typename WriterType> void writeJson(WriterType &writer) const {
@@ -86,7 +100,7 @@ class Hit {
         }
 
         writer.Key("energy");
-        writer.Double(m_energy);
+        writeEnergyJson(writer, m_energy);
 
         if (!m_label.empty()) {
             writer.Key("label");
@@ -118,14 +132,20 @@ class Hit {
         j["colour"] = hit.m_colour;
     }
 
+    // The RapidJSON output skips default values, so those are optional here.
     friend void from_json(const json &j, Hit &hit) {
         j.at("id").get_to(hit.m_id);
         j.at("position").get_to(hit.m_position);
-        j.at("width").get_to(hit.m_width);
         j.at("energy").get_to(hit.m_energy);
-        j.at("label").get_to(hit.m_label);
-        j.at("properties").get_to(hit.m_properties);
-        j.at("colour").get_to(hit.m_colour);
+
+        if (j.contains("width"))
+            j.at("width").get_to(hit.m_width);
+        if (j.contains("label"))
+            j.at("label").get_to(hit.m_label);
+        if (j.contains("properties"))
+            j.at("properties").get_to(hit.m_properties);
+        if (j.contains("colour"))
+            j.at("colour").get_to(hit.m_colour);
     }
 
   protected:
@@ -175,18 +195,52 @@ class MCHit : public Hit {
     MCHit(const PosArray &pos, const double pdgCode, const double energy) : Hit(pos, energy) {
         this->addProperties({{{"PDG", PropertyType::NUMERIC}, pdgCode}});
     }
+    explicit MCHit(const Hit &hit) : Hit(hit) { this->updatePDG(); }
+
+    // Wrap the property setters, to keep the cached PDG code in sync.
+    void addProperties(std::map<std::string, double> props) {
+        Hit::addProperties(props);
+        this->updatePDG();
+    }
+    void addProperties(HitProperties props) {
+        Hit::addProperties(props);
+        this->updatePDG();
+    }
+    void addProperty(const std::tuple<std::string, PropertyType> &prop, const double value) {
+        Hit::addProperty(prop, value);
+        this->updatePDG();
+    }
 
     void setPDG(const double pdgCode) { this->addProperties({{{"PDG", PropertyType::NUMERIC}, pdgCode}}); }
-    double getPDG() const {
+    double getPDG() const { return this->m_pdg; }
+
+    friend void from_json(const json &j, MCHit &hit) {
+        from_json(j, static_cast<Hit &>(hit));
+        hit.updatePDG();
+    }
+
+  private:
+    void updatePDG() {
         auto key = std::make_tuple("PDG", PropertyType::NUMERIC);
-        if (this->m_properties.count(key) == 0) {
-            return 0.0;
-        }
-        return this->m_properties.at(key);
+        auto it = this->m_properties.find(key);
+        this->m_pdg = it == this->m_properties.end() ? 0.0 : it->second;
     }
+
+    // Cached copy of the PDG property, as it is checked for every hit on output.
+    double m_pdg = 0.0;
 };
 using MCHits = std::vector<MCHit>;
 
+// Skip hits without a PDG code.
+// This is because technically you can initialize an MCHit without a PDG code.
+// But, if you don't have a PDG code, you're not really an MCHit.
+template <typename WriterType> inline void writeMCHitJson(WriterType &writer, const MCHit &hit) {
+    if (hit.getPDG() == 0.0)
+        return;
+
+    hit.writeJson(writer);
+}
+
 inline static void to_json(json &j, const MCHits &hits) {
 
     if (hits.size() == 0) {
@@ -196,9 +250,6 @@ inline static void to_json(json &j, const MCHits &hits) {
 
     for (const auto &hit : hits) {
 
-        // Skip hits without a PDG code.
-        // This is because technically you can initialize an MCHit without a PDG code.
-        // But, if you don't have a PDG code, you're not really an MCHit.
         if (hit.getPDG() == 0.0)
             continue;
 
@@ -226,8 +277,7 @@ inline void writePropertiesJson(WriterType &writer, const HepEVD::HitProperties
         writer.StartArray();
         writer.String(prop_name.c_str(), static_cast<rapidjson::SizeType>(prop_name.length()));
 
-        std::string_view type_str = prop_type == HepEVD::PropertyType::NUMERIC ? "NUMERIC" : "CATEGORIC";
-        writer.String(type_str.data(), static_cast<rapidjson::SizeType>(type_str.length()));
+        writeEnumJson(writer, prop_type);
 
         writer.EndArray();
         writer.Double(value);
@@ -6,53 +6,464 @@
 #ifndef HEP_EVD_IMAGE_H
 #define HEP_EVD_IMAGE_H
 
+#include <algorithm>
+#include <charconv>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
 #include "extern/json.hpp"
 using json = nlohmann::json;
+#include "extern/rapidjson/stringbuffer.h"
+#include "extern/rapidjson/writer.h"
 
 namespace HepEVD {
 
 enum ImageType { MONOCHROME, RGB };
-NLOHMANN_JSON_SERIALIZE_ENUM(ImageType, {{MONOCHROME, "Monochrome"}, {RGB, "RGB"}});
+HEP_EVD_SERIALIZE_ENUM(ImageType, {{MONOCHROME, "Monochrome"}, {RGB, "RGB"}});
+
+// The pixel formats an image can be sent to the browser as.
+// The integer formats are linearly quantized between the image min and max.
+enum ImageDType { FLOAT32, UINT8, UINT16 };
+
+// Write a float using the shortest form that reads back to the same value,
+// rather than as a widened double with 17 significant digits.
+template <typename WriterType> inline void writeFloatJson(WriterType &writer, const float value) {
+#if defined(__cpp_lib_to_chars)
+    if (!std::isfinite(value)) {
+        writer.Null();
+        return;
+    }
+
+    char buffer[32];
+    const auto result = std::to_chars(buffer, buffer + sizeof(buffer), value);
+    writer.RawValue(buffer, static_cast<size_t>(result.ptr - buffer), rapidjson::kNumberType);
+#else
+    writer.Double(value);
+#endif
+}
+
+// A single resolution level of an image.
+// Pixels are stored row-major in one contiguous buffer, with each row
+// starting "stride" values after the previous one. Multi-channel images
+// store each channel as a full plane, one after the other.
+struct ImageLevel {
+    int width = 0;
+    int height = 0;
+    int stride = 0;
+    int channels = 1;
+    std::vector<float> data;
+
+    size_t index(const int row, const int col, const int channel = 0) const {
+        return (static_cast<size_t>(channel) * height + row) * stride + col;
+    }
+    float at(const int row, const int col, const int channel = 0) const { return data[index(row, col, channel)]; }
+};
 
 // High level Class representing an image.
-// This is a 2D array of pixel values.
+// This is a 2D array of pixel values (optionally with several channels,
+// such as per-class network scores), plus a pyramid of downsampled copies
+// (built on first use) so large images can be fetched one zoom level / tile
+// at a time.
 class MonochromeImage {
   public:
+    // Levels are halved until they fit within a single tile.
+    static constexpr int TILE_SIZE = 256;
+
     MonochromeImage() {}
     MonochromeImage(std::vector<std::vector<float>> &image, const std::string label = "") {
 
         if (image.size() == 0)
             throw std::invalid_argument("MonochromeImage must have at least one row!");
 
-        this->m_data = image;
+        const int width = image[0].size();
+        const int height = image.size();
+
+        std::vector<float> data;
+        data.reserve(static_cast<size_t>(width) * height);
 
-        this->m_width = image[0].size();
-        this->m_height = image.size();
+        for (const auto &row : image) {
+            if (static_cast<int>(row.size()) != width)
+                throw std::invalid_argument("MonochromeImage rows must all be the same length!");
+            data.insert(data.end(), row.begin(), row.end());
+        }
+
+        this->setData(std::move(data), width, height, width);
         this->m_label = label;
     }
 
+    // Build an image directly from a contiguous, row-major buffer.
+    // A stride larger than the width allows padded rows to be used as-is.
+    // Multiple channels are given as consecutive planes (CHW order).
+    MonochromeImage(std::vector<float> data, const int width, const int height, const std::string label = "",
+                    const int stride = 0, const int channels = 1) {
+        this->setData(std::move(data), width, height, stride == 0 ? width : stride, channels);
+        this->m_label = label;
+    }
+
+    // Build an image from any strided buffer of shape (channels, height, width).
+    // Strides are in elements, as reported by libtorch / NumPy (divided by the item size).
+    // A contiguous float buffer is copied in one go, anything else is gathered once.
+    template <typename T>
+    static MonochromeImage fromStridedBuffer(const T *buffer, const int channels, const int height, const int width,
+                                             const int64_t channelStride, const int64_t rowStride,
+                                             const int64_t colStride, const std::string label = "") {
+        if (channels <= 0 || height <= 0 || width <= 0)
+            throw std::invalid_argument("MonochromeImage must have a positive width, height and channel count!");
+
+        const size_t nPixels = static_cast<size_t>(channels) * height * width;
+        std::vector<float> data(nPixels);
+
+        const bool contiguous =
+            colStride == 1 && rowStride == width && (channels == 1 || channelStride == int64_t(height) * width);
+
+        if (std::is_same<T, float>::value && contiguous) {
+            std::memcpy(data.data(), buffer, nPixels * sizeof(float));
+        } else {
+            float *out = data.data();
+            for (int channel = 0; channel < channels; ++channel) {
+                for (int row = 0; row < height; ++row) {
+                    const T *in = buffer + channel * channelStride + row * rowStride;
+                    for (int col = 0; col < width; ++col)
+                        *out++ = static_cast<float>(in[col * colStride]);
+                }
+            }
+        }
+
+        return MonochromeImage(std::move(data), width, height, label, width, channels);
+    }
+
+    int getWidth() const { return this->m_width; }
+    int getHeight() const { return this->m_height; }
+    int getStride() const { return this->m_levels.empty() ? 0 : this->m_levels[0].stride; }
+    int getChannels() const { return this->m_levels.empty() ? 1 : this->m_levels[0].channels; }
+    std::string getLabel() const { return this->m_label; }
+    ImageType getImageType() const { return this->m_imageType; }
+    float getMinValue() const { return this->m_minValue; }
+    float getMaxValue() const { return this->m_maxValue; }
+
+    float at(const int row, const int col, const int channel = 0) const {
+        return this->m_levels[0].at(row, col, channel);
+    }
+
+    // Level 0 is the full resolution image, each further level is half the size.
+    // Only level 0 is stored up front, the rest are built when first asked for.
+    int getNumLevels() const { return this->getLevelShapes().size(); }
+    const ImageLevel &getLevel(const int level) const {
+        if (level < 0 || level >= this->getNumLevels())
+            throw std::out_of_range("Image level " + std::to_string(level) + " out of range!");
+        return level == 0 ? this->m_levels[0] : this->getPyramid()[level - 1];
+    }
+
+    // The memory held by the pixel data, including any pyramid levels built so far.
+    size_t getMemoryUsage() const {
+        size_t bytes = 0;
+        for (const auto &level : this->m_levels)
+            bytes += level.data.capacity() * sizeof(float);
+
+        const auto pyramid = std::atomic_load(&this->m_pyramid);
+        if (pyramid) {
+            for (const auto &level : *pyramid)
+                bytes += level.data.capacity() * sizeof(float);
+        }
+
+        return bytes;
+    }
+
+    // Pack a region of the given level into a byte buffer of the given type.
+    // The region is clamped to the level, and rows are written without padding.
+    // A negative channel writes every channel, one plane after the other.
+    std::string toBinary(const int level, int x, int y, int width, int height, const ImageDType dtype = FLOAT32,
+                         const int channel = -1) const {
+        const ImageLevel &imageLevel = this->getLevel(level);
+
+        if (channel >= imageLevel.channels)
+            throw std::out_of_range("Image channel " + std::to_string(channel) + " out of range!");
+
+        x = std::clamp(x, 0, imageLevel.width);
+        y = std::clamp(y, 0, imageLevel.height);
+        width = std::clamp(width, 0, imageLevel.width - x);
+        height = std::clamp(height, 0, imageLevel.height - y);
+
+        const int firstChannel = channel < 0 ? 0 : channel;
+        const int lastChannel = channel < 0 ? imageLevel.channels : channel + 1;
+        const size_t planePixels = static_cast<size_t>(width) * height;
+        const size_t nPixels = planePixels * (lastChannel - firstChannel);
+        const float range = this->m_maxValue - this->m_minValue;
+
+        std::string buffer;
+
+        switch (dtype) {
+        case FLOAT32:
+            buffer.resize(nPixels * sizeof(float));
+            for (int c = firstChannel; c < lastChannel; ++c)
+                for (int row = 0; row < height; ++row)
+                    std::memcpy(&buffer[((c - firstChannel) * planePixels + static_cast<size_t>(row) * width) *
+                                        sizeof(float)],
+                                &imageLevel.data[imageLevel.index(y + row, x, c)], width * sizeof(float));
+            break;
+        case UINT8:
+            buffer.resize(nPixels * sizeof(uint8_t));
+            for (int c = firstChannel; c < lastChannel; ++c)
+                this->quantize(imageLevel, c, x, y, width, height, range,
+                               reinterpret_cast<uint8_t *>(&buffer[0]) + (c - firstChannel) * planePixels);
+            break;
+        case UINT16:
+            buffer.resize(nPixels * sizeof(uint16_t));
+            for (int c = firstChannel; c < lastChannel; ++c)
+                this->quantize(imageLevel, c, x, y, width, height, range,
+                               reinterpret_cast<uint16_t *>(&buffer[0]) + (c - firstChannel) * planePixels);
+            break;
+        }
+
+        return buffer;
+    }
+
+    // Describe the image and its pyramid, without any of the pixel data.
+    json getMetadata() const {
+        json levels = json::array();
+        for (const auto &shape : this->getLevelShapes())
+            levels.push_back({{"width", shape.first}, {"height", shape.second}});
+
+        return {{"imageType", this->m_imageType}, {"width", this->m_width},   {"height", this->m_height},
+                {"channels", this->getChannels()}, {"label", this->m_label},   {"min", this->m_minValue},
+                {"max", this->m_maxValue},         {"tileSize", TILE_SIZE},    {"levels", levels}};
+    }
+
+    // RapidJSON serialization, matching to_json below.
+    template <typename WriterType> void writeJson(WriterType &writer) const {
+        writer.StartObject();
+
+        writer.Key("imageType");
+        writeEnumJson(writer, this->m_imageType);
+
+        writer.Key("data");
+        const int channels = this->getChannels();
+        if (channels > 1)
+            writer.StartArray();
+
+        if (!this->m_levels.empty()) {
+            const ImageLevel &level = this->m_levels[0];
+            for (int channel = 0; channel < channels; ++channel) {
+                writer.StartArray();
+                for (int row = 0; row < level.height; ++row) {
+                    writer.StartArray();
+                    const float *rowStart = &level.data[level.index(row, 0, channel)];
+                    for (int col = 0; col < level.width; ++col)
+                        writeFloatJson(writer, rowStart[col]);
+                    writer.EndArray();
+                }
+                writer.EndArray();
+            }
+        } else {
+            writer.StartArray();
+            writer.EndArray();
+        }
+
+        if (channels > 1)
+            writer.EndArray();
+
+        writer.Key("width");
+        writer.Int(this->m_width);
+        writer.Key("height");
+        writer.Int(this->m_height);
+        writer.Key("channels");
+        writer.Int(channels);
+        writer.Key("label");
+        writer.String(this->m_label.c_str(), static_cast<rapidjson::SizeType>(this->m_label.length()));
+
+        writer.EndObject();
+    }
+
     // Define to_json and from_json for MonochromeImage.
+    // The JSON form keeps the nested row layout, for existing consumers.
+    // Multi-channel images add an outer channel dimension.
     friend void to_json(json &j, const MonochromeImage &image) {
+        json channels = json::array();
+
+        if (!image.m_levels.empty()) {
+            const ImageLevel &level = image.m_levels[0];
+            for (int channel = 0; channel < level.channels; ++channel) {
+                json rows = json::array();
+                for (int row = 0; row < level.height; ++row) {
+                    const auto rowStart = level.data.begin() + level.index(row, 0, channel);
+                    rows.push_back(std::vector<float>(rowStart, rowStart + level.width));
+                }
+                channels.push_back(rows);
+            }
+        }
+
         j["imageType"] = image.m_imageType;
-        j["data"] = image.m_data;
+        j["data"] = channels.size() == 1 ? channels[0] : channels;
         j["width"] = image.m_width;
         j["height"] = image.m_height;
+        j["channels"] = image.getChannels();
         j["label"] = image.m_label;
     }
 
     friend void from_json(const json &j, MonochromeImage &image) {
+        const int channels = j.value("channels", 1);
+        const std::string label = j.at("label").get<std::string>();
+
+        if (channels == 1) {
+            auto rows = j.at("data").get<std::vector<std::vector<float>>>();
+            image = MonochromeImage(rows, label);
+        } else {
+            auto planes = j.at("data").get<std::vector<std::vector<std::vector<float>>>>();
+            if (static_cast<int>(planes.size()) != channels || planes[0].empty())
+                throw std::invalid_argument("MonochromeImage channel data does not match its channel count!");
+
+            const int height = planes[0].size();
+            const int width = planes[0][0].size();
+
+            std::vector<float> data;
+            data.reserve(static_cast<size_t>(channels) * height * width);
+            for (const auto &plane : planes) {
+                if (static_cast<int>(plane.size()) != height)
+                    throw std::invalid_argument("MonochromeImage channels must all be the same size!");
+                for (const auto &row : plane) {
+                    if (static_cast<int>(row.size()) != width)
+                        throw std::invalid_argument("MonochromeImage rows must all be the same length!");
+                    data.insert(data.end(), row.begin(), row.end());
+                }
+            }
+
+            image = MonochromeImage(std::move(data), width, height, label, width, channels);
+        }
+
         j.at("imageType").get_to(image.m_imageType);
-        j.at("data").get_to(image.m_data);
-        j.at("width").get_to(image.m_width);
-        j.at("height").get_to(image.m_height);
-        j.at("label").get_to(image.m_label);
     }
 
   protected:
+    void setData(std::vector<float> data, const int width, const int height, const int stride,
+                 const int channels = 1) {
+
+        if (width <= 0 || height <= 0 || channels <= 0)
+            throw std::invalid_argument("MonochromeImage must have a positive width, height and channel count!");
+        if (stride < width)
+            throw std::invalid_argument("MonochromeImage stride must be at least the width!");
+        if (data.size() < static_cast<size_t>(stride) * (static_cast<size_t>(height) * channels - 1) + width)
+            throw std::invalid_argument("MonochromeImage buffer is smaller than its shape and stride require!");
+
+        this->m_width = width;
+        this->m_height = height;
+
+        this->m_levels.clear();
+        this->m_levels.push_back({width, height, stride, channels, std::move(data)});
+        this->m_pyramid.reset();
+
+        this->m_minValue = std::numeric_limits<float>::max();
+        this->m_maxValue = std::numeric_limits<float>::lowest();
+
+        // Channel planes are stacked, so every row of every channel can be visited in turn.
+        const ImageLevel &base = this->m_levels[0];
+        for (int row = 0; row < height * channels; ++row) {
+            const auto rowStart = base.data.begin() + static_cast<size_t>(row) * stride;
+            const auto minMax = std::minmax_element(rowStart, rowStart + width);
+            this->m_minValue = std::min(this->m_minValue, *minMax.first);
+            this->m_maxValue = std::max(this->m_maxValue, *minMax.second);
+        }
+    }
+
+    // The (width, height) of every level, without building any of them.
+    std::vector<std::pair<int, int>> getLevelShapes() const {
+        std::vector<std::pair<int, int>> shapes;
+        if (this->m_levels.empty())
+            return shapes;
+
+        shapes.push_back({this->m_width, this->m_height});
+        while (shapes.back().first > TILE_SIZE || shapes.back().second > TILE_SIZE)
+            shapes.push_back({(shapes.back().first + 1) / 2, (shapes.back().second + 1) / 2});
+
+        return shapes;
+    }
+
+    // The levels above 0, built on first use. This can be called by
+    // concurrent readers, so whichever build lands first is kept.
+    const std::vector<ImageLevel> &getPyramid() const {
+        std::shared_ptr<const std::vector<ImageLevel>> pyramid = std::atomic_load(&this->m_pyramid);
+
+        if (!pyramid) {
+            auto built = std::make_shared<const std::vector<ImageLevel>>(this->buildPyramid());
+            if (std::atomic_compare_exchange_strong(&this->m_pyramid, &pyramid, built))
+                pyramid = built;
+        }
+
+        return *pyramid;
+    }
+
+    // Halve the image until it fits in a single tile.
+    // Max pooling is used, so that sparse activity (single wire hits, or
+    // isolated network responses) stays visible when zoomed out.
+    std::vector<ImageLevel> buildPyramid() const {
+        std::vector<ImageLevel> levels;
+        levels.reserve(this->getLevelShapes().size() - 1);
+
+        while (true) {
+            const ImageLevel &prev = levels.empty() ? this->m_levels[0] : levels.back();
+            if (prev.width <= TILE_SIZE && prev.height <= TILE_SIZE)
+                break;
+
+            ImageLevel next;
+            next.width = (prev.width + 1) / 2;
+            next.height = (prev.height + 1) / 2;
+            next.stride = next.width;
+            next.channels = prev.channels;
+            next.data.resize(static_cast<size_t>(next.width) * next.height * next.channels);
+
+            for (int ch = 0; ch < next.channels; ++ch) {
+                for (int row = 0; row < next.height; ++row) {
+                    const int r0 = row * 2;
+                    const int r1 = std::min(r0 + 1, prev.height - 1);
+
+                    for (int col = 0; col < next.width; ++col) {
+                        const int c0 = col * 2;
+                        const int c1 = std::min(c0 + 1, prev.width - 1);
+
+                        next.data[next.index(row, col, ch)] = std::max(
+                            {prev.at(r0, c0, ch), prev.at(r0, c1, ch), prev.at(r1, c0, ch), prev.at(r1, c1, ch)});
+                    }
+                }
+            }
+
+            levels.push_back(std::move(next));
+        }
+
+        return levels;
+    }
+
+    template <typename T>
+    void quantize(const ImageLevel &level, const int channel, const int x, const int y, const int width,
+                  const int height, const float range, T *out) const {
+        const float maxOut = std::numeric_limits<T>::max();
+        const float scale = range > 0.f ? maxOut / range : 0.f;
+
+        for (int row = 0; row < height; ++row) {
+            for (int col = 0; col < width; ++col) {
+                const float value = (level.at(y + row, x + col, channel) - this->m_minValue) * scale;
+
+                // NaN fails every comparison, so would pass straight through the clamp.
+                *out++ = std::isnan(value) ? T(0) : static_cast<T>(std::lround(std::clamp(value, 0.f, maxOut)));
+            }
+        }
+    }
+
     ImageType m_imageType = MONOCHROME;
-    std::vector<std::vector<float>> m_data;
-    int m_width;
-    int m_height;
+    std::vector<ImageLevel> m_levels;
+    mutable std::shared_ptr<const std::vector<ImageLevel>> m_pyramid;
+    int m_width = 0;
+    int m_height = 0;
+    float m_minValue = 0.f;
+    float m_maxValue = 0.f;
     std::string m_label;
 };
 
@@ -76,7 +487,7 @@ inline static void from_json(const json &j, Images &images) {
         throw std::invalid_argument("Images must be an array!");
 
     for (const auto &jsonImage : j) {
-        images.push_back(MonochromeImage(jsonImage));
+        images.push_back(jsonImage.get<MonochromeImage>());
     }
 }
 
@@ -195,6 +195,8 @@ static void addRecoHits(const art::Event &evt, const std::string hitLabel, const
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     // Get the hit and detector property info.
     auto const detProps = art::ServiceHandle<detinfo::DetectorPropertiesService const>()->DataFor(evt);
     hepEVDDetProps = &detProps;
@@ -225,6 +227,8 @@ static void showMCParticles(const art::Event &evt, const std::string hitLabel, c
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     // Get the hit and detector property info.
     auto const detProps = art::ServiceHandle<detinfo::DetectorPropertiesService const>()->DataFor(evt);
     hepEVDDetProps = &detProps;
@@ -274,6 +278,8 @@ static void showMCTruth(const art::Event &evt, const std::string mcTruthLabel) {
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     art::Handle<std::vector<simb::MCTruth>> mcTruthHandle;
     std::vector<art::Ptr<simb::MCTruth>> mcTruthVector;
 
@@ -325,6 +331,8 @@ static Particle addParticle(const art::Ptr<recob::PFParticle> &pfp,
                             const std::vector<art::Ptr<recob::Vertex>> &vertices,
                             const art::FindManyP<recob::Hit> &clusterHitAssoc, const std::string label = "") {
 
+    // This fills in the hit maps, so needs the lock even on its own.
+    const ServerUpdateLock lock;
     Hits hits;
 
     // Add the 2D Hits first, which we need to get to via the clusters...
@@ -395,6 +403,8 @@ static void addPFPs(const art::Event &evt, const std::string pfpModuleLabel, con
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     // Get the hit and detector property info.
     // TODO: Consider adding a setup command, maybe one the builds on top of isServerInitialised.
     // It could setup some of these global variables and quit out if not available.
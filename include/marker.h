@@ -25,7 +25,7 @@ using json = nlohmann::json;
 namespace HepEVD {
 
 enum MarkerType { POINT, LINE, RING };
-NLOHMANN_JSON_SERIALIZE_ENUM(MarkerType, {{POINT, "Point"}, {LINE, "Line"}, {RING, "Ring"}});
+HEP_EVD_SERIALIZE_ENUM(MarkerType, {{POINT, "Point"}, {LINE, "Line"}, {RING, "Ring"}});
 
 // High level Marker class, defining the things that every marker has.
 class Marker {
@@ -39,8 +39,18 @@ class Marker {
     void setLabel(const std::string label) { this->m_label = label; }
     std::string getColour() const { return this->m_colour; }
     std::string getLabel() const { return this->m_label; }
+    const Position &getPosition() const { return this->m_position; }
 
   protected:
+    // Write the fields every marker has, other than the position.
+    template <typename WriterType> void writeCommonJson(WriterType &writer) const {
+        writer.Key("colour");
+        writer.String(this->m_colour.c_str(), static_cast<rapidjson::SizeType>(this->m_colour.length()));
+
+        writer.Key("label");
+        writer.String(this->m_label.c_str(), static_cast<rapidjson::SizeType>(this->m_label.length()));
+    }
+
     Position m_position;
     std::string m_colour;
     std::string m_label;
@@ -60,22 +70,16 @@ class Point : public Marker {
     }
 
     // RapidJSON serialization for Point.
-    // Markers aren't (currently) numerous enough to cause
-    // performance issues...but needed for Particles which are.
     template <typename WriterType> void writeJson(WriterType &writer) const {
         writer.StartObject();
 
         writer.Key("markerType");
-        writer.String("Point");
+        writeEnumJson(writer, POINT);
 
         writer.Key("position");
         this->m_position.writeJson(writer);
 
-        writer.Key("colour");
-        writer.String(this->m_colour.c_str(), static_cast<rapidjson::SizeType>(this->m_colour.length()));
-
-        writer.Key("label");
-        writer.String(this->m_label.c_str(), static_cast<rapidjson::SizeType>(this->m_label.length()));
+        this->writeCommonJson(writer);
 
         writer.EndObject();
     }
@@ -110,6 +114,30 @@ class Line : public Marker {
         this->m_position.setDim(dim);
         this->m_end.setDim(dim);
     }
+    void setHitType(const HitType &hitType) override {
+        this->m_position.setHitType(hitType);
+        this->m_end.setHitType(hitType);
+    }
+
+    const Position &getEnd() const { return this->m_end; }
+
+    // RapidJSON serialization for Line.
+    template <typename WriterType> void writeJson(WriterType &writer) const {
+        writer.StartObject();
+
+        writer.Key("markerType");
+        writeEnumJson(writer, LINE);
+
+        writer.Key("position");
+        this->m_position.writeJson(writer);
+
+        writer.Key("end");
+        this->m_end.writeJson(writer);
+
+        this->writeCommonJson(writer);
+
+        writer.EndObject();
+    }
 
     // to_json and from_json for Line.
     friend void to_json(json &j, const Line &line) {
@@ -141,6 +169,30 @@ class Ring : public Marker {
     Ring(const PosArray &center, const double inner, const double outer)
         : Marker(center), m_inner(inner), m_outer(outer) {}
 
+    double getInner() const { return this->m_inner; }
+    double getOuter() const { return this->m_outer; }
+
+    // RapidJSON serialization for Ring.
+    template <typename WriterType> void writeJson(WriterType &writer) const {
+        writer.StartObject();
+
+        writer.Key("markerType");
+        writeEnumJson(writer, RING);
+
+        writer.Key("position");
+        this->m_position.writeJson(writer);
+
+        writer.Key("inner");
+        writer.Double(this->m_inner);
+
+        writer.Key("outer");
+        writer.Double(this->m_outer);
+
+        this->writeCommonJson(writer);
+
+        writer.EndObject();
+    }
+
     // to_json and from_json for Ring.
     friend void to_json(json &j, const Ring &ring) {
         j["markerType"] = RING;
@@ -170,6 +222,11 @@ class Ring : public Marker {
 using AllMarkers = std::variant<Point, Line, Ring>;
 using Markers = std::vector<AllMarkers>;
 
+// RapidJSON serialization for any marker.
+template <typename WriterType> inline void writeMarkerJson(WriterType &writer, const AllMarkers &marker) {
+    std::visit([&writer](const auto &m) { m.writeJson(writer); }, marker);
+}
+
 // Define the required JSON formatters for the markers variant.
 inline static void to_json(json &j, const AllMarkers &marker) {
     std::visit([&j](const auto &m) { j = m; }, marker);
@@ -57,6 +57,25 @@ inline PandoraHitMap caloHitToEvdHit;
 // to the HepEVD hits via HepEVDServer::getHitById.
 static PandoraHitMap *getHitMap() { return &caloHitToEvdHit; }
 
+// The IDs given to each CaloHit, kept for the whole event. The same CaloHits
+// are added to many states, and reusing their IDs means those states end up
+// with identical hits, which can then be shared rather than stored again.
+// The n-th use of a CaloHit in a state gets its n-th ID, so IDs are still
+// unique within each state, other than particles reusing the IDs of the hits
+// they are made of.
+inline std::map<const pandora::CaloHit *, std::vector<std::string>> caloHitIds;
+inline std::map<const pandora::CaloHit *, size_t> caloHitUses;
+
+static std::string getCaloHitId(const pandora::CaloHit *pCaloHit) {
+    std::vector<std::string> &ids = caloHitIds[pCaloHit];
+    const size_t use = caloHitUses[pCaloHit]++;
+
+    if (use == ids.size())
+        ids.push_back(getUUID());
+
+    return ids[use];
+}
+
 // Set the HepEVD geometry by pulling the relevant information from the
 // Pandora GeometryManager.
 // Also register the map to the manager, so we don't leak memory.
@@ -112,7 +131,11 @@ static void setHepEVDGeometry(const pandora::GeometryManager *manager) {
 
     // Register the clear function for the hit map,
     // so we can clear it when we need to.
-    HepEVD::registerClearFunction([&]() { caloHitToEvdHit.clear(); });
+    HepEVD::registerClearFunction([&]() {
+        caloHitToEvdHit.clear();
+        caloHitUses.clear();
+    });
+    HepEVD::registerResetFunction([&]() { caloHitIds.clear(); });
 }
 
 // Helper function to convert a Pandora HitType to a HepEVD Hit Dimension.
@@ -152,7 +175,8 @@ static HepEVD::Hits getHits(const pandora::CaloHitList *caloHits, std::string la
 
     for (const pandora::CaloHit *const pCaloHit : *caloHits) {
         const auto pos = pCaloHit->GetPositionVector();
-        Hit hit(Position({pos.GetX(), pos.GetY(), pos.GetZ()}), pCaloHit->GetMipEquivalentEnergy());
+        Hit hit(getCaloHitId(pCaloHit), Position({pos.GetX(), pos.GetY(), pos.GetZ()}),
+                pCaloHit->GetMipEquivalentEnergy());
 
         if (label != "")
             hit.setLabel(label);
@@ -175,6 +199,8 @@ static void addHits(const pandora::CaloHitList *caloHits, std::string label = ""
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     const auto hits = HepEVD::getHits(caloHits, label);
     hepEVDLog("Adding " + std::to_string(hits.size()) + " hits to the HepEVD server.");
     hepEVDServer->addHits(hits);
@@ -191,6 +217,8 @@ static void addClusters(const pandora::ClusterList *clusters, std::string label
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     HepEVD::Particles particles;
 
     for (const pandora::Cluster *const pCluster : *clusters) {
@@ -210,6 +238,8 @@ static void addClusterProperties(const pandora::Cluster *cluster, std::map<std::
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     for (const auto &orderedList : cluster->GetOrderedCaloHitList()) {
         for (const auto caloHit : *(orderedList.second)) {
             if (caloHitToEvdHit.count(caloHit) == 0)
@@ -226,6 +256,8 @@ static void addSlices(const SliceList *slices, const std::string label = "") {
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     HepEVD::Particles particles;
 
     for (unsigned int sliceNumber = 0; sliceNumber < slices->size(); ++sliceNumber) {
@@ -247,11 +279,23 @@ static void addSlices(const SliceList *slices, const std::string label = "") {
     hepEVDServer->addParticles(particles);
 }
 
+// The MC list the event MC was last built from.
+inline std::string eventMCListName;
+
 static void showMC(const pandora::Algorithm &pAlgorithm, const std::string &listName = "") {
 
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
+    // The MC is the same for every state in the event, so only build it once,
+    // then share it with any later states that want it too.
+    if (listName == eventMCListName && hepEVDServer->showEventMC()) {
+        hepEVDLog("Reusing the MC hits already built for this event.");
+        return;
+    }
+
     MCHits mcHits;
     pandora::CaloHitList caloHitList;
 
@@ -321,7 +365,8 @@ static void showMC(const pandora::Algorithm &pAlgorithm, const std::string &list
     }
 
     hepEVDLog("Adding " + std::to_string(mcHits.size()) + " MC hits to the HepEVD server.");
-    hepEVDServer->addMCHits(mcHits);
+    hepEVDServer->setEventMC(mcHits);
+    eventMCListName = listName;
 
     // Now, build up a string to show the interaction as a string:
     //   - \nu_e (3.18 GeV) -> e- (0.51 GeV) + p ...
@@ -385,13 +430,20 @@ static void getAllCaloHits(const pandora::ParticleFlowObject *pPfo, pandora::Cal
 static Particle addParticle(const pandora::Pandora &pPandora, const pandora::ParticleFlowObject *pPfo,
                             std::string label = "") {
 
+    // This fills in the hit maps, so needs the lock even on its own.
+    const ServerUpdateLock lock;
     Hits hits;
     pandora::CaloHitList caloHitList;
     HepEVD::getAllCaloHits(pPfo, caloHitList);
 
     for (const pandora::CaloHit *const pCaloHit : caloHitList) {
+        // Reuse the ID of a CaloHit that is already in the state, so the
+        // particle only refers to that hit, rather than storing it again.
+        const auto existing = caloHitToEvdHit.find(pCaloHit);
+        const std::string hitId = existing != caloHitToEvdHit.end() ? existing->second : getCaloHitId(pCaloHit);
+
         const auto pos = pCaloHit->GetPositionVector();
-        Hit hit(Position({pos.GetX(), pos.GetY(), pos.GetZ()}), pCaloHit->GetMipEquivalentEnergy());
+        Hit hit(hitId, Position({pos.GetX(), pos.GetY(), pos.GetZ()}), pCaloHit->GetMipEquivalentEnergy());
 
         if (label != "")
             hit.setLabel(label);
@@ -454,6 +506,8 @@ static void addPFOs(const pandora::Pandora &pPandora, const pandora::PfoList *pP
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     if (pPfoList->empty())
         return;
 
@@ -522,32 +576,35 @@ template <typename T> static void addDLTensorImage(const at::Tensor inputImageTe
     if (!isServerInitialised())
         return;
 
-    const auto imageTensor = inputImageTensor.clone().squeeze();
+    const ServerUpdateLock lock;
+
+    // Drop any batch dimension, then treat the input as (channels, height, width).
+    // Multi-channel inputs (such as per-class scores) become a single multi-channel image.
+    const auto imageTensor = inputImageTensor.squeeze();
 
-    if (imageTensor.dim() != 2) {
-        std::cout << "HepEVD: Input image should be 2D!" << std::endl;
+    if (imageTensor.dim() != 2 && imageTensor.dim() != 3) {
+        std::cout << "HepEVD: Input image should be 2D, or 3D with channels first!" << std::endl;
         std::cout << "HepEVD: Was instead " << imageTensor.dim() << "D" << std::endl;
         std::cout << "HepEVD: Maybe pre-process the image first? (Apply softmax etc)" << std::endl;
         return;
     }
 
-    auto imageAccessor = imageTensor.accessor<T, 2>();
-    const unsigned int height = imageAccessor.size(0);
-    const unsigned int width = imageAccessor.size(1);
+    const auto cpuTensor = imageTensor.device().is_cpu() ? imageTensor : imageTensor.cpu();
+    const bool hasChannels = cpuTensor.dim() == 3;
+    const int offset = hasChannels ? 1 : 0;
 
-    std::vector<std::vector<float>> imageVector;
-    for (unsigned int y = 0; y < height; ++y) {
-        std::vector<float> row;
-        for (unsigned int x = 0; x < width; ++x) {
-            row.push_back(imageAccessor[y][x]);
-        }
-        imageVector.push_back(row);
-    }
+    // Read straight out of the tensor storage, using its strides.
+    // Contiguous float tensors are copied in a single block.
+    MonochromeImage image = MonochromeImage::fromStridedBuffer(
+        cpuTensor.template data_ptr<T>(), hasChannels ? cpuTensor.size(0) : 1, cpuTensor.size(offset),
+        cpuTensor.size(offset + 1), hasChannels ? cpuTensor.stride(0) : 0, cpuTensor.stride(offset),
+        cpuTensor.stride(offset + 1), name);
 
-    MonochromeImage image(imageVector, name);
+    Images images;
+    images.push_back(std::move(image));
 
     hepEVDLog("Adding " + name + " image to the HepEVD server.");
-    hepEVDServer->addImages({image});
+    hepEVDServer->addImages(std::move(images));
 }
 #endif
 
@@ -15,17 +15,131 @@ using json = nlohmann::json;
 #include "extern/rapidjson/stringbuffer.h"
 #include "extern/rapidjson/writer.h"
 
+#include <array>
+#include <limits>
 #include <map>
+#include <numeric>
+#include <unordered_map>
 #include <vector>
 
 namespace HepEVD {
 
 enum InteractionType { BEAM, COSMIC, NEUTRINO, OTHER };
-NLOHMANN_JSON_SERIALIZE_ENUM(InteractionType,
-                             {{BEAM, "Beam"}, {COSMIC, "Cosmic"}, {NEUTRINO, "Neutrino"}, {OTHER, "Other"}});
+HEP_EVD_SERIALIZE_ENUM(InteractionType, {{BEAM, "Beam"}, {COSMIC, "Cosmic"}, {NEUTRINO, "Neutrino"}, {OTHER, "Other"}});
 
 enum RenderType { PARTICLE, TRACK, SHOWER };
-NLOHMANN_JSON_SERIALIZE_ENUM(RenderType, {{PARTICLE, "Particle"}, {TRACK, "Track"}, {SHOWER, "Shower"}});
+HEP_EVD_SERIALIZE_ENUM(RenderType, {{PARTICLE, "Particle"}, {TRACK, "Track"}, {SHOWER, "Shower"}});
+
+// Aggregate information about the hits of a particle, computed once when the
+// particle is added to a state, so the hits themselves don't need to be
+// revisited (or even sent) to sort, filter or cull particles.
+struct ParticleSummary {
+
+    // The extent of the hits in a single dimension (3D or 2D).
+    struct Extent {
+        unsigned int nHits = 0;
+        PosArray min = {0.0, 0.0, 0.0};
+        PosArray max = {0.0, 0.0, 0.0};
+        PosArray centroid = {0.0, 0.0, 0.0};
+    };
+
+    double energy = 0.0;
+    unsigned int nHits = 0;
+    std::array<unsigned int, 4> viewCounts = {0, 0, 0, 0};
+    std::array<Extent, 2> extents;
+
+    template <typename IteratorType> static ParticleSummary fromHits(IteratorType begin, IteratorType end) {
+        ParticleSummary summary;
+        summary.nHits = std::distance(begin, end);
+
+        constexpr double inf = std::numeric_limits<double>::infinity();
+        std::array<PosArray, 2> mins = {{{inf, inf, inf}, {inf, inf, inf}}};
+        std::array<PosArray, 2> maxs = {{{-inf, -inf, -inf}, {-inf, -inf, -inf}}};
+        std::array<PosArray, 2> sums = {{{0.0, 0.0, 0.0}, {0.0, 0.0, 0.0}}};
+
+        // Single pass, with no branching on the hit contents beyond picking
+        // the dimension / view bucket to accumulate into.
+        for (auto it = begin; it != end; ++it) {
+            const Position &pos = it->getPosition();
+            const PosArray xyz = {pos.x, pos.y, pos.z};
+            const int dim = pos.dim;
+
+            summary.energy += it->getEnergy();
+            ++summary.viewCounts[pos.hitType];
+            ++summary.extents[dim].nHits;
+
+            for (int axis = 0; axis < 3; ++axis) {
+                mins[dim][axis] = std::min(mins[dim][axis], xyz[axis]);
+                maxs[dim][axis] = std::max(maxs[dim][axis], xyz[axis]);
+                sums[dim][axis] += xyz[axis];
+            }
+        }
+
+        for (int dim = 0; dim < 2; ++dim) {
+            Extent &extent = summary.extents[dim];
+
+            if (extent.nHits == 0)
+                continue;
+
+            for (int axis = 0; axis < 3; ++axis) {
+                extent.min[axis] = mins[dim][axis];
+                extent.max[axis] = maxs[dim][axis];
+                extent.centroid[axis] = sums[dim][axis] / extent.nHits;
+            }
+        }
+
+        return summary;
+    }
+
+    // Write out the summary, converting 2D positions to XY, as is done for
+    // the hit positions themselves.
+    template <typename WriterType> void writeJson(WriterType &writer) const {
+        writer.Key("energy");
+        writeEnergyJson(writer, energy);
+        writer.Key("nHits");
+        writer.Uint(nHits);
+
+        writer.Key("viewCounts");
+        writer.StartObject();
+        for (const auto hitType : {GENERAL, TWO_D_U, TWO_D_V, TWO_D_W}) {
+            const std::string_view name = enumToString(hitType);
+            writer.Key(name.data(), static_cast<rapidjson::SizeType>(name.size()));
+            writer.Uint(viewCounts[hitType]);
+        }
+        writer.EndObject();
+
+        auto writePos = [&](const PosArray &pos, const bool is2D) {
+            writer.StartArray();
+            writePositionJson(writer, pos[0]);
+            writePositionJson(writer, is2D ? pos[2] : pos[1]);
+            writePositionJson(writer, is2D ? 0.0 : pos[2]);
+            writer.EndArray();
+        };
+
+        writer.Key("extents");
+        writer.StartObject();
+        for (const auto dim : {THREE_D, TWO_D}) {
+            const Extent &extent = extents[dim];
+
+            if (extent.nHits == 0)
+                continue;
+
+            const std::string_view name = enumToString(dim);
+            writer.Key(name.data(), static_cast<rapidjson::SizeType>(name.size()));
+            writer.StartObject();
+            writer.Key("nHits");
+            writer.Uint(extent.nHits);
+            writer.Key("min");
+            writePos(extent.min, dim == TWO_D);
+            writer.Key("max");
+            writePos(extent.max, dim == TWO_D);
+            writer.Key("centroid");
+            writePos(extent.centroid, dim == TWO_D);
+            writer.EndObject();
+        }
+        writer.EndObject();
+    }
+};
 
 // Represent a single particle in the event.
 class Particle {
@@ -37,20 +151,56 @@ class Particle {
             m_id = getUUID();
     }
 
+    // Once in a state, the energy comes from the cached summary, rather than
+    // re-summing the hits.
     double getEnergy() const {
+        if (this->isFlattened())
+            return this->m_summary.energy;
+
         double energy = 0.0;
         for (const auto &hit : this->m_hits)
             energy += hit.getEnergy();
         return energy;
     }
 
-    unsigned int getNHits() const { return this->m_hits.size(); }
+    const ParticleSummary &getSummary() const { return this->m_summary; }
+    void setSummary(const ParticleSummary &summary) { this->m_summary = summary; }
+
+    unsigned int getNHits() const { return this->isFlattened() ? this->m_hitCount : this->m_hits.size(); }
     std::string getLabel() const { return this->m_label; }
     std::string getID() const { return this->m_id; }
 
+    // The hits a particle was constructed with.
+    // Once the particle has been added to an EventState, these are moved into
+    // the state, and the particle instead refers to them by a range of the
+    // state's particle hit indices (see EventState::getParticleHits).
     Hits &getHits() { return this->m_hits; }
     const Hits &getHits() const { return this->m_hits; }
 
+    bool isFlattened() const { return this->m_flattened; }
+    size_t getHitOffset() const { return this->m_hitOffset; }
+
+    // Move the particle's own hits out, and refer to them by their position in
+    // a state instead.
+    Hits releaseHits(const size_t hitOffset) {
+        Hits hits;
+        hits.swap(this->m_hits);
+
+        this->m_hitOffset = hitOffset;
+        this->m_hitCount = hits.size();
+        this->m_flattened = true;
+
+        return hits;
+    }
+
+    // Give a particle copied out of a state its hits back, so it stands on its own again.
+    void restoreHits(Hits hits) {
+        this->m_hits = std::move(hits);
+        this->m_hitOffset = 0;
+        this->m_hitCount = 0;
+        this->m_flattened = false;
+    }
+
     void setVertices(const Markers &vertices) {
         // Check that the markers are all Point-type.
         for (const auto &marker : vertices) {
@@ -64,9 +214,11 @@ class Particle {
     Markers getVertices() const { return this->m_vertices; }
 
     void setParentID(const std::string parentID) { this->m_parentID = parentID; }
+    const std::string &getParentID() const { return this->m_parentID; }
 
     void setChildIDs(const std::vector<std::string> &childIDs) { this->m_childIDs = childIDs; }
     void addChild(const std::string childID) { this->m_childIDs.push_back(childID); }
+    const std::vector<std::string> &getChildIDs() const { return this->m_childIDs; }
 
     void setPrimary(bool primary) { this->m_primary = primary; }
     bool getPrimary() const { return this->m_primary; }
@@ -88,12 +240,13 @@ class Particle {
         writer.Key("label");
         writer.String(m_label.c_str(), static_cast<rapidjson::SizeType>(m_label.length()));
 
-        writer.Key("hits");
-        writer.StartArray();
-        for (const auto &hit : m_hits) {
-            hit.writeJson(writer);
-        }
-        writer.EndArray();
+        // Hits are not nested, but are instead referenced as a range of
+        // the flat hit array that is sent alongside the particles.
+        writer.Key("hitOffset");
+        writer.Uint64(m_hitOffset);
+
+        writer.Key("hitCount");
+        writer.Uint64(this->getNHits());
 
         writer.Key("vertices");
         writer.StartArray();
@@ -107,12 +260,10 @@ class Particle {
         writer.Bool(m_primary);
 
         writer.Key("interactionType");
-        writer.String(enumToString(m_interactionType).c_str(),
-                      static_cast<rapidjson::SizeType>(enumToString(m_interactionType).length()));
+        writeEnumJson(writer, m_interactionType);
 
         writer.Key("renderType");
-        writer.String(enumToString(m_renderType).c_str(),
-                      static_cast<rapidjson::SizeType>(enumToString(m_renderType).length()));
+        writeEnumJson(writer, m_renderType);
 
         writer.Key("parentID");
         writer.String(m_parentID.c_str(), static_cast<rapidjson::SizeType>(m_parentID.length()));
@@ -127,11 +278,38 @@ class Particle {
         writer.EndObject();
     }
 
+    // Lightweight alternative to writeJson, with no hits or vertices, but
+    // the cached summary of the hits instead.
+    template <typename WriterType> void writeSummaryJson(WriterType &writer) const {
+        writer.StartObject();
+
+        writer.Key("id");
+        writer.String(m_id.c_str(), static_cast<rapidjson::SizeType>(m_id.length()));
+
+        writer.Key("label");
+        writer.String(m_label.c_str(), static_cast<rapidjson::SizeType>(m_label.length()));
+
+        writer.Key("interactionType");
+        writeEnumJson(writer, m_interactionType);
+
+        writer.Key("renderType");
+        writeEnumJson(writer, m_renderType);
+
+        m_summary.writeJson(writer);
+
+        writer.EndObject();
+    }
+
     // Define to_json and from_json for Particle.
     friend void to_json(json &j, const Particle &particle) {
         j["id"] = particle.m_id;
         j["label"] = particle.m_label;
-        j["hits"] = particle.m_hits;
+        if (particle.isFlattened()) {
+            j["hitOffset"] = particle.m_hitOffset;
+            j["hitCount"] = particle.m_hitCount;
+        } else {
+            j["hits"] = particle.m_hits;
+        }
         j["vertices"] = particle.m_vertices;
         j["primary"] = particle.m_primary;
         j["interactionType"] = particle.m_interactionType;
@@ -143,7 +321,8 @@ class Particle {
     friend void from_json(const json &j, Particle &particle) {
         j.at("id").get_to(particle.m_id);
         j.at("label").get_to(particle.m_label);
-        j.at("hits").get_to(particle.m_hits);
+        if (j.contains("hits"))
+            j.at("hits").get_to(particle.m_hits);
         j.at("vertices").get_to(particle.m_vertices);
         j.at("primary").get_to(particle.m_primary);
         j.at("interactionType").get_to(particle.m_interactionType);
@@ -158,8 +337,9 @@ class Particle {
     std::string m_label;
     std::string m_id;
 
-    bool m_primary;
-    InteractionType m_interactionType;
+    // Unset unless given, but still initialised, as both are written out.
+    bool m_primary = false;
+    InteractionType m_interactionType = InteractionType::OTHER;
 
     // How to render the particle.
     // Default is PARTICLE, but can also be TRACK, SHOWER.
@@ -171,9 +351,201 @@ class Particle {
     // easier to serialise.
     std::string m_parentID;
     std::vector<std::string> m_childIDs;
+
+    // Where the hits for this particle live in the owning state's hit store.
+    bool m_flattened = false;
+    size_t m_hitOffset = 0;
+    size_t m_hitCount = 0;
+
+    ParticleSummary m_summary;
 };
 using Particles = std::vector<Particle>;
 
+// Integer-indexed view of the parent/child relationships between a set of
+// particles, where particle i is Particles[i].
+//
+// The string IDs are resolved once, on construction, into a parent array,
+// CSR child lists, and the depth / root of every particle. Particles are also
+// stored in depth-first order, such that the subtree of any particle is a
+// contiguous block of that ordering.
+class ParticleHierarchy {
+  public:
+    ParticleHierarchy() {}
+    ParticleHierarchy(const Particles &particles) {
+
+        const size_t numParticles = particles.size();
+        m_idToIndex.reserve(numParticles);
+
+        for (size_t i = 0; i < numParticles; ++i)
+            m_idToIndex.insert({particles[i].getID(), i});
+
+        // Prefer the parent ID of the particle, but fall back to any
+        // particle that lists it as a child.
+        m_parents.assign(numParticles, NO_PARENT);
+        for (size_t i = 0; i < numParticles; ++i) {
+            for (const auto &childID : particles[i].getChildIDs()) {
+                const int child = this->getIndex(childID);
+
+                if (child >= 0 && child != static_cast<int>(i) && m_parents[child] == NO_PARENT)
+                    m_parents[child] = i;
+            }
+        }
+        for (size_t i = 0; i < numParticles; ++i) {
+            const int parent = this->getIndex(particles[i].getParentID());
+
+            if (parent >= 0 && parent != static_cast<int>(i))
+                m_parents[i] = parent;
+        }
+
+        // Break any cycles, promoting the particle that closes the loop to
+        // be a root, so every particle is reachable from some root.
+        std::vector<unsigned char> visitState(numParticles, 0);
+        for (size_t i = 0; i < numParticles; ++i) {
+            std::vector<unsigned int> path;
+            int current = i;
+
+            while (current != NO_PARENT && visitState[current] == 0) {
+                visitState[current] = 1;
+                path.push_back(current);
+                current = m_parents[current];
+            }
+
+            if (current != NO_PARENT && visitState[current] == 1)
+                m_parents[current] = NO_PARENT;
+
+            for (const auto idx : path)
+                visitState[idx] = 2;
+        }
+
+        // Build the CSR child lists, via a counting sort on the parents.
+        m_childOffsets.assign(numParticles + 1, 0);
+        for (size_t i = 0; i < numParticles; ++i) {
+            if (m_parents[i] == NO_PARENT)
+                m_roots.push_back(i);
+            else
+                ++m_childOffsets[m_parents[i] + 1];
+        }
+
+        std::partial_sum(m_childOffsets.begin(), m_childOffsets.end(), m_childOffsets.begin());
+        m_children.resize(m_childOffsets.back());
+
+        std::vector<unsigned int> insertPos(m_childOffsets.begin(), m_childOffsets.end() - 1);
+        for (size_t i = 0; i < numParticles; ++i) {
+            if (m_parents[i] != NO_PARENT)
+                m_children[insertPos[m_parents[i]]++] = i;
+        }
+
+        // Finally, walk every tree depth first, filling in the depth, root,
+        // and subtree size of every particle.
+        m_depths.assign(numParticles, 0);
+        m_rootOf.assign(numParticles, 0);
+        m_subtreeSizes.assign(numParticles, 1);
+        m_order.reserve(numParticles);
+        m_orderPos.assign(numParticles, 0);
+
+        std::vector<unsigned int> stack;
+        for (const auto root : m_roots) {
+            stack.push_back(root);
+            m_depths[root] = 0;
+
+            while (!stack.empty()) {
+                const unsigned int current = stack.back();
+                stack.pop_back();
+
+                m_orderPos[current] = m_order.size();
+                m_order.push_back(current);
+                m_rootOf[current] = root;
+
+                // Push in reverse, so children are visited in their stored order.
+                for (unsigned int c = m_childOffsets[current + 1]; c > m_childOffsets[current]; --c) {
+                    const unsigned int child = m_children[c - 1];
+                    m_depths[child] = m_depths[current] + 1;
+                    stack.push_back(child);
+                }
+            }
+        }
+
+        // Children always come after their parents in the ordering, so
+        // accumulate the subtree sizes in reverse.
+        for (auto it = m_order.rbegin(); it != m_order.rend(); ++it) {
+            if (m_parents[*it] != NO_PARENT)
+                m_subtreeSizes[m_parents[*it]] += m_subtreeSizes[*it];
+        }
+    }
+
+    static constexpr int NO_PARENT = -1;
+
+    size_t size() const { return m_parents.size(); }
+
+    // Resolve a particle ID to its index, or -1 if it is unknown.
+    int getIndex(const std::string &id) const {
+        const auto it = m_idToIndex.find(id);
+        return it == m_idToIndex.end() ? -1 : static_cast<int>(it->second);
+    }
+
+    int getParent(const unsigned int idx) const { return m_parents.at(idx); }
+    unsigned int getDepth(const unsigned int idx) const { return m_depths.at(idx); }
+    unsigned int getRoot(const unsigned int idx) const { return m_rootOf.at(idx); }
+    unsigned int getSubtreeSize(const unsigned int idx) const { return m_subtreeSizes.at(idx); }
+    const std::vector<unsigned int> &getRoots() const { return m_roots; }
+
+    std::vector<unsigned int> getChildren(const unsigned int idx) const {
+        return std::vector<unsigned int>(m_children.begin() + m_childOffsets.at(idx),
+                                         m_children.begin() + m_childOffsets.at(idx + 1));
+    }
+
+    // The given particle and all of its descendants, in depth-first order.
+    std::vector<unsigned int> getSubtree(const unsigned int idx) const {
+        const auto begin = m_order.begin() + m_orderPos.at(idx);
+        return std::vector<unsigned int>(begin, begin + m_subtreeSizes[idx]);
+    }
+
+    // Write out the hierarchy information for a single particle.
+    template <typename WriterType>
+    void writeNodeJson(WriterType &writer, const Particles &particles, const unsigned int idx) const {
+        writer.StartObject();
+
+        const std::string &id = particles.at(idx).getID();
+        writer.Key("index");
+        writer.Uint(idx);
+        writer.Key("id");
+        writer.String(id.c_str(), static_cast<rapidjson::SizeType>(id.length()));
+
+        writer.Key("parent");
+        writer.Int(m_parents[idx]);
+        writer.Key("depth");
+        writer.Uint(m_depths[idx]);
+        writer.Key("root");
+        writer.Uint(m_rootOf[idx]);
+        writer.Key("subtreeSize");
+        writer.Uint(m_subtreeSizes[idx]);
+
+        writer.Key("children");
+        writer.StartArray();
+        for (unsigned int c = m_childOffsets[idx]; c < m_childOffsets[idx + 1]; ++c)
+            writer.Uint(m_children[c]);
+        writer.EndArray();
+
+        writer.EndObject();
+    }
+
+  private:
+    std::unordered_map<std::string, unsigned int> m_idToIndex;
+
+    std::vector<int> m_parents;
+    std::vector<unsigned int> m_childOffsets;
+    std::vector<unsigned int> m_children;
+    std::vector<unsigned int> m_roots;
+
+    std::vector<unsigned int> m_depths;
+    std::vector<unsigned int> m_rootOf;
+    std::vector<unsigned int> m_subtreeSizes;
+
+    // Depth-first ordering of the particles, and where each particle sits in it.
+    std::vector<unsigned int> m_order;
+    std::vector<unsigned int> m_orderPos;
+};
+
 inline static void to_json(json &j, const Particles &particles) {
 
     if (particles.size() == 0) {
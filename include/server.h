@@ -9,6 +9,7 @@
 #ifndef HEP_EVD_SERVER_H
 #define HEP_EVD_SERVER_H
 
+#include "archive.h"
 #include "config.h"
 #include "geometry.h"
 #include "hits.h"
@@ -17,9 +18,18 @@
 #include "state.h"
 #include "utils.h"
 
+#include <atomic>
+#include <cctype>
+#include <charconv>
 #include <chrono>
 #include <cstdint>
 #include <fstream>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+#include <unordered_map>
 
 #include "extern/json.hpp"
 using json = nlohmann::json;
@@ -44,7 +54,14 @@ class HepEVDServer {
         m_eventStates[m_currentState] = EventState(name, {}, hits, mc, {}, {}, "");
     }
 
-    ~HepEVDServer() { this->m_eventStates.clear(); }
+    ~HepEVDServer() {
+        this->stopServer();
+
+        if (this->m_exportThread.joinable())
+            this->m_exportThread.join();
+
+        this->m_eventStates.clear();
+    }
 
     // Check if the server is initialised.
     // Technically, all we need is a geometry.
@@ -56,6 +73,14 @@ class HepEVDServer {
     void resetServer(const bool resetGeo = false) {
 
         this->m_eventStates.clear();
+        this->m_storedStates.clear();
+        this->m_recentStates.clear();
+        this->m_recentStateIndex.clear();
+        this->m_spillFile.reset();
+        this->m_compressedStates.reset();
+        this->m_eventMCHits.clear();
+        this->m_eventMCTruth.clear();
+        this->m_hasEventMC = false;
         this->m_currentState = 0;
         this->m_eventStates[this->m_currentState] = EventState("Initial", {}, {}, {}, {}, {}, "");
 
@@ -68,40 +93,136 @@ class HepEVDServer {
     // Less destructive clear function.
     // This will clear the hits, markers, particles, and MC hits,
     // but leave the geometry and event states alone.
-    void clearState(const bool clearMCTruth = false) { this->m_eventStates[this->m_currentState].clear(clearMCTruth); }
+    void clearState(const bool clearMCTruth = false) { this->getState()->clear(clearMCTruth); }
 
     // Add a new event state.
     // This will be used to store multiple events, or multiple
     // parts of the same event.
-    EventState *getState() { return &this->m_eventStates[this->m_currentState]; }
+    EventState *getState() { return this->loadState(this->m_currentState); }
+
+    // The current state, only for reading. Unlike getState, this leaves a
+    // state from an archive able to be dropped from memory, rather than
+    // needing to keep any changes made to it.
+    const EventState *viewState() { return this->loadState(this->m_currentState, false); }
     void addEventState(std::string name = "", Particles particles = {}, Hits hits = {}, MCHits mcHits = {},
                        Markers markers = {}, Images images = {}, std::string mcTruth = "") {
-        this->m_eventStates[this->m_eventStates.size()] =
-            EventState(name, particles, hits, mcHits, markers, images, mcTruth);
+        if (this->m_eventMCTruth.empty())
+            this->m_eventMCTruth = mcTruth;
+
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+        const int id = this->getNumberOfEventStates();
+        this->m_eventStates[id] = EventState(name, particles, hits, mcHits, markers, images, mcTruth);
+        this->markStateUsed(id);
+        this->enforceMemoryBudget(this->m_currentState);
+    }
+
+    // Add a whole, already built state, such as one built in another process
+    // and sent over as an encoded state block. The newest state is kept as
+    // the one being built, so it is moved after the new state if anything
+    // has been added to it, or replaced by it (keeping only its name) if not.
+    void appendEventState(EventState state) {
+        if (this->m_eventMCTruth.empty())
+            this->m_eventMCTruth = state.m_mcTruth;
+
+        const int newestState = std::max(0, this->getNumberOfEventStates() - 1);
+        EventState *building = this->loadState(newestState);
+        const bool hasContent = building->hasContent();
+        EventState nextState = hasContent ? std::move(*building) : EventState();
+
+        // A state that was only named so far keeps its name, as it is still being built.
+        if (!hasContent)
+            nextState.m_name = building->m_name;
+
+        const bool isBuilding = static_cast<int>(this->m_currentState) == newestState;
+
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+        this->m_storedStates.erase(newestState);
+        this->m_eventStates[newestState] = std::move(state);
+        this->m_eventStates[newestState + 1] = std::move(nextState);
+        this->markStateUsed(newestState);
+        this->markStateUsed(newestState + 1);
+
+        if (isBuilding)
+            this->m_currentState = newestState + 1;
+
+        this->enforceMemoryBudget(this->m_currentState);
     }
 
     // Swap to a different event state.
+    // The state that was current may no longer need to be kept in memory.
     void swapEventState(const int state) {
-        if (this->m_eventStates.find(state) != this->m_eventStates.end())
-            this->m_currentState = state;
+        if (this->m_eventStates.find(state) != this->m_eventStates.end() ||
+            this->m_storedStates.find(state) != this->m_storedStates.end())
+            this->setCurrentState(state);
     }
     void swapEventState(const std::string name) {
-        for (auto &state : this->m_eventStates) {
-            if (state.second.m_name == name) {
-                this->m_currentState = state.first;
+        for (int i = 0; i < this->getNumberOfEventStates(); ++i) {
+            if (this->getStateName(i) == name) {
+                this->setCurrentState(i);
                 return;
             }
         }
     }
     void nextEventState() {
-        if (this->m_currentState < this->m_eventStates.size() - 1)
-            this->m_currentState++;
+        if (static_cast<int>(this->m_currentState) < this->getNumberOfEventStates() - 1)
+            this->setCurrentState(this->m_currentState + 1);
     }
     void previousEventState() {
         if (this->m_currentState > 0)
-            this->m_currentState--;
+            this->setCurrentState(this->m_currentState - 1);
+    }
+    int getNumberOfEventStates() {
+        int numStates = this->m_eventStates.empty() ? 0 : this->m_eventStates.rbegin()->first + 1;
+        if (!this->m_storedStates.empty())
+            numStates = std::max(numStates, this->m_storedStates.rbegin()->first + 1);
+        return numStates;
+    }
+
+    // Browse the states stored in one or more archive files (see archive.h),
+    // replacing any current states. The files are mapped rather than read in,
+    // and each state is only decoded the first time it is looked at, so memory
+    // use grows with the states actually viewed, not the size of the files.
+    // The geometry and config are taken from the first archive, if not already set.
+    void openArchives(const std::vector<std::string> &paths);
+
+    // Summary of every state, without decoding any stored ones.
+    json getAllStateInfo();
+
+    // Limit the memory used by the states, in bytes, with 0 meaning no limit.
+    // Once over the budget, the least recently used states are spilled out to
+    // a temporary file (in the given directory, or TMPDIR), and read back in
+    // when they are next needed. The current state and the newest state, that
+    // is likely still being filled, are always kept in memory.
+    void setMemoryBudget(const size_t bytes, const std::string &spillDirectory = "") {
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+
+        this->m_memoryBudget = bytes;
+        this->m_spillDirectory = spillDirectory;
+        this->enforceMemoryBudget(this->m_currentState);
+    }
+    size_t getMemoryBudget() const { return this->m_memoryBudget; }
+
+    // How many states are in memory, and the size of the spill file, to see
+    // how the budget is being kept to.
+    size_t getNumResidentStates() {
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+        return this->m_eventStates.size();
+    }
+    size_t getSpillFileSize() {
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+        return this->m_spillFile ? this->m_spillFile->getSize() : 0;
     }
-    int getNumberOfEventStates() { return this->m_eventStates.size(); }
+
+    // Keep every state other than the current and newest compressed in
+    // memory, regardless of any budget. This is often a 3-5x saving, at the
+    // cost of decompressing a state (in parallel) when it is swapped to.
+    void setStateCompression(const bool compress) {
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+
+        this->m_compressStates = compress;
+        this->enforceMemoryBudget(this->m_currentState);
+    }
+    bool getStateCompression() const { return this->m_compressStates; }
     void setName(const std::string name) { this->getState()->m_name = name; }
 
     // Start/stop the event display server, blocking until exit is called by the
@@ -109,44 +230,107 @@ class HepEVDServer {
     void startServer();
     void stopServer();
 
+    // Start the server on its own thread instead, returning once it is listening,
+    // so states can still be added whilst viewing them. Anything changing the
+    // states from another thread whilst it runs should hold lockForUpdate, as
+    // the helpers (see ServerUpdateLock) and Python bindings do.
+    bool startServerInBackground();
+    bool isRunning() const { return this->m_server.is_running(); }
+    std::unique_lock<std::shared_mutex> lockForUpdate() {
+        return std::unique_lock<std::shared_mutex>(this->m_updateMutex);
+    }
+
+    // Write out every state to disk, along with a top level info file.
+    // Used for saving the event display, or for the GitHub pages version of it.
+    void writeOutAllStates(const bool compress = false);
+    json getExportProgress();
+
+    // Write every state to a single binary archive file, see archive.h.
+    // Returns the number of states written.
+    size_t writeArchive(const std::string &path);
+
     // GUI configuration.
     GUIConfig *getConfig() { return &this->m_config; }
 
     // Pass over the required event information.
     // TODO: Verify the information passed over.
-    bool addHits(const Hits &inputHits) {
+    // Once the state is left, the hits are shared with any other state that has the exact same hits.
+    // Until then, they are only appended to, so adding hits in many batches stays linear.
+    bool addHits(Hits inputHits) {
+        EventState *state = this->getState();
+
+        if (state->m_hits.size() == 0) {
+            state->m_hits = std::move(inputHits);
+        } else {
+            Hits &hits = state->m_hits.edit();
+            hits.insert(hits.end(), std::make_move_iterator(inputHits.begin()),
+                        std::make_move_iterator(inputHits.end()));
+        }
 
-        if (this->getState()->m_hits.size() == 0) {
-            this->getState()->m_hits = inputHits;
-            return true;
+        return true;
+    }
+    Hits getHits() { return this->viewState()->m_hits; }
+    size_t getNumberOfHits() { return this->viewState()->m_hits.size(); }
+
+    // Add whole columns of properties to hits of the current state at once,
+    // with each hit given by its index in the state, i.e. the order it was added in.
+    bool addHitProperties(const std::vector<size_t> &hitIndices, const HitPropertyColumns &columns) {
+        EventState *state = this->getState();
+        const size_t numHits = state->m_hits.size();
+
+        for (const auto &column : columns) {
+            if (column.second.size() != hitIndices.size())
+                throw std::invalid_argument("HepEVD: Property " + std::get<0>(column.first) + " has " +
+                                            std::to_string(column.second.size()) + " values, for " +
+                                            std::to_string(hitIndices.size()) + " hits!");
         }
 
-        Hits newHits = this->getState()->m_hits;
-        newHits.insert(newHits.end(), inputHits.begin(), inputHits.end());
-        this->getState()->m_hits = newHits;
+        // Each hit should only be given once, so they can be updated in parallel.
+        std::vector<bool> seen(numHits, false);
+        for (const size_t index : hitIndices) {
+            if (index >= numHits)
+                throw std::out_of_range("HepEVD: No hit with index " + std::to_string(index) + " in this state!");
+            if (seen[index])
+                throw std::invalid_argument("HepEVD: Hit index " + std::to_string(index) + " given more than once!");
+            seen[index] = true;
+        }
+
+        if (hitIndices.empty() || columns.empty())
+            return true;
+
+        std::vector<size_t> rows(hitIndices.size());
+        std::iota(rows.begin(), rows.end(), 0);
+
+        Hits &hits = state->m_hits.edit();
+        parallel_process(rows, [&](std::vector<size_t>::const_iterator begin, std::vector<size_t>::const_iterator end) {
+            for (auto row = begin; row != end; ++row) {
+                Hit &hit = hits[hitIndices[*row]];
+                for (const auto &column : columns)
+                    hit.addProperty(column.first, column.second[*row]);
+            }
+            return true;
+        });
 
         return true;
     }
-    Hits getHits() { return this->getState()->m_hits; }
 
     // Look up a hit that was already added (directly, or via a Particle) by its ID,
     // so callers can attach properties to it after the fact without holding a pointer.
     Hit *getHitById(const std::string &id) { return this->getState()->getHitById(id); }
 
-    bool addMarkers(const Markers &inputMarkers) {
+    bool addMarkers(Markers inputMarkers) {
+        Markers &markers = this->getState()->m_markers;
 
-        if (this->getState()->m_markers.size() == 0) {
-            this->getState()->m_markers = inputMarkers;
+        if (markers.size() == 0) {
+            markers = std::move(inputMarkers);
             return true;
         }
 
-        Markers newMarkers = this->getState()->m_markers;
-        newMarkers.insert(newMarkers.end(), inputMarkers.begin(), inputMarkers.end());
-        this->getState()->m_markers = newMarkers;
-
+        markers.insert(markers.end(), std::make_move_iterator(inputMarkers.begin()),
+                       std::make_move_iterator(inputMarkers.end()));
         return true;
     }
-    Markers getMarkers() { return this->getState()->m_markers; }
+    Markers getMarkers() { return this->viewState()->m_markers; }
 
     bool addImages(const Images &images) {
 
@@ -155,72 +339,382 @@ class HepEVDServer {
             return true;
         }
 
-        Images newImages = this->getState()->m_images;
-        newImages.insert(newImages.end(), images.begin(), images.end());
-        this->getState()->m_images = newImages;
+        Images &currentImages = this->getState()->m_images;
+        currentImages.insert(currentImages.end(), images.begin(), images.end());
 
         return true;
     }
-    Images getImages() { return this->getState()->m_images; }
+    bool addImages(Images &&images) {
+        Images &currentImages = this->getState()->m_images;
+        std::move(images.begin(), images.end(), std::back_inserter(currentImages));
 
-    bool addParticles(const Particles &inputParticles) {
-        if (this->getState()->m_particles.size() == 0) {
-            this->getState()->m_particles = inputParticles;
-            return true;
-        }
-
-        Particles newParticles = this->getState()->m_particles;
-        newParticles.insert(newParticles.end(), inputParticles.begin(), inputParticles.end());
-        this->getState()->m_particles = newParticles;
+        return true;
+    }
+    Images getImages() { return this->viewState()->m_images; }
 
+    bool addParticles(Particles inputParticles) {
+        this->getState()->addParticles(std::move(inputParticles));
         return true;
     }
-    Particles getParticles() { return this->getState()->m_particles; }
 
-    bool addMCHits(const MCHits &inputMCHits) {
-        if (this->getState()->m_mcHits.size() == 0) {
-            this->getState()->m_mcHits = inputMCHits;
-            return true;
+    // Copies of the particles in the current state, each with its hits, so
+    // they can be used (or added to another state) on their own.
+    Particles getParticles() {
+        const EventState *state = this->viewState();
+        Particles particles = state->m_particles;
+
+        for (auto &particle : particles)
+            particle.restoreHits(state->getParticleHits(particle));
+
+        return particles;
+    }
+
+    bool addMCHits(MCHits inputMCHits) {
+        EventState *state = this->getState();
+
+        if (state->m_mcHits.size() == 0) {
+            state->m_mcHits = std::move(inputMCHits);
+        } else {
+            MCHits &mcHits = state->m_mcHits.edit();
+            mcHits.insert(mcHits.end(), inputMCHits.begin(), inputMCHits.end());
         }
 
-        MCHits newHits = this->getState()->m_mcHits;
-        newHits.insert(newHits.end(), inputMCHits.begin(), inputMCHits.end());
-        this->getState()->m_mcHits = newHits;
+        return true;
+    }
+    MCHits getMCHits() { return this->viewState()->m_mcHits; }
+
+    // The MC hits for the whole event, rather than any one state, which are
+    // also added to the current state. They only need working out once per
+    // event (i.e. until the server is reset), after which showEventMC can add
+    // them to other states, sharing the same hits rather than copying them.
+    void setEventMC(const MCHits &mcHits) {
+        this->m_eventMCHits = mcHits;
+        this->m_eventMCHits.intern();
+        this->m_hasEventMC = true;
+        this->showEventMC();
+    }
+    bool hasEventMC() const { return this->m_hasEventMC; }
+
+    // Add the event MC hits to the current state, returning false if there aren't any yet.
+    bool showEventMC() {
+        if (!this->m_hasEventMC)
+            return false;
+
+        EventState *state = this->getState();
+        if (state->m_mcHits.size() == 0) {
+            state->m_mcHits = this->m_eventMCHits;
+        } else if (state->m_mcHits.get().data() != this->m_eventMCHits.get().data()) {
+            MCHits &mcHits = state->m_mcHits.edit();
+            mcHits.insert(mcHits.end(), this->m_eventMCHits.begin(), this->m_eventMCHits.end());
+        }
 
         return true;
     }
-    MCHits getMCHits() { return this->getState()->m_mcHits; }
 
-    void setMCTruth(const std::string mcTruth) { this->getState()->m_mcTruth = mcTruth; }
+    // The MC truth is per event, so is the same across all states.
+    void setMCTruth(const std::string mcTruth) {
+        this->getState()->m_mcTruth = mcTruth;
+        this->m_eventMCTruth = mcTruth;
+    }
 
-    // The MC truth is slightly unique, in that it should be the same across all states.
-    // If there is multiple MC truths that aren't the same, either return the current one,
-    // or return an empty string.
-    // However, if there is just one in a single event state, just assume that's the one.
+    // States can still have their own MC truth (i.e. if each state is a
+    // different event), which is used over the event one if it is set.
     std::string getMCTruth() {
-        std::set<std::string> truths;
+        const std::string &stateTruth = this->viewState()->m_mcTruth;
+        return stateTruth.empty() ? this->m_eventMCTruth : stateTruth;
+    }
 
-        for (auto &state : this->m_eventStates) {
-            if (state.second.m_mcTruth.size() > 0)
-                truths.insert(state.second.m_mcTruth);
+    // Limit the precision of numbers in the JSON output, to cut down on its size.
+    void setOutputPrecision(const OutputPrecision &precision) {
+        if (!precision.isValid())
+            throw std::invalid_argument("Output precision must be between -1 and " +
+                                        std::to_string(OutputPrecision::MAX_DECIMALS) + " decimal places");
+        this->m_outputPrecision = precision;
+    }
+    const OutputPrecision &getOutputPrecision() const { return this->m_outputPrecision; }
+
+  private:
+    // Where a state that isn't in memory is stored.
+    struct StoredStateRef {
+        std::shared_ptr<StateStore> store;
+        size_t index;
+    };
+
+    // While any of these exist, no states are evicted, so that state
+    // pointers (i.e. from peekState) stay valid.
+    class EvictionGuard {
+      public:
+        EvictionGuard(std::atomic<int> &guards) : m_guards(guards) { m_guards++; }
+        ~EvictionGuard() { m_guards--; }
+
+      private:
+        std::atomic<int> &m_guards;
+    };
+
+    // The name of a state, without decoding it if it is stored.
+    std::string getStateName(const int id) {
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+
+        const auto state = this->m_eventStates.find(id);
+        if (state != this->m_eventStates.end())
+            return state->second.m_name;
+
+        const auto storedState = this->m_storedStates.find(id);
+        if (storedState != this->m_storedStates.end())
+            return storedState->second.store->getStateName(storedState->second.index);
+
+        return "";
+    }
+
+    // The state being left is done with for now, so its hits can be shared
+    // with other states, having only been appended to or edited in place
+    // (i.e. by getHitById) whilst it was current.
+    void setCurrentState(const unsigned int state) {
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+
+        const auto previous = this->m_eventStates.find(this->m_currentState);
+        if (previous != this->m_eventStates.end() && this->m_currentState != state)
+            previous->second.shareHits();
+
+        this->m_currentState = state;
+        this->enforceMemoryBudget(state);
+    }
+
+    // Get a state, decoding it from where it is stored first if needed.
+    // States only stored temporarily (i.e. spilled) are forgotten from there
+    // once they are back in memory, as they may then be changed. States in a
+    // persistent store are only forgotten from there once they are loaded to
+    // be changed, so that they are then spilled like any other state, rather
+    // than dropped along with those changes.
+    //
+    // This is called for every hit added by some callers, so for a state that
+    // is already in memory it only moves it to the front of the recent list.
+    // The budget is enforced when a state is brought in, or the current state
+    // changes, not here.
+    EventState *loadState(const int id, const bool forUpdate = true) {
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+
+        this->markStateUsed(id);
+
+        auto state = this->m_eventStates.find(id);
+        if (state != this->m_eventStates.end()) {
+            if (forUpdate && !this->m_storedStates.empty())
+                this->m_storedStates.erase(id);
+            return &state->second;
         }
 
-        if (truths.size() == 1)
-            return truths.begin()->c_str();
+        const auto storedState = this->m_storedStates.find(id);
 
-        if (truths.size() > 1)
-            return this->getState()->m_mcTruth;
+        if (storedState == this->m_storedStates.end()) {
+            state = this->m_eventStates.emplace(id, EventState()).first;
+        } else {
+            const StoredStateRef ref = storedState->second;
+            state = this->m_eventStates.emplace(id, ref.store->readState(ref.index)).first;
 
-        return "";
+            if (this->m_eventMCTruth.empty())
+                this->m_eventMCTruth = state->second.m_mcTruth;
+
+            if (!ref.store->isPersistent())
+                ref.store->removeState(ref.index);
+            if (!ref.store->isPersistent() || forUpdate)
+                this->m_storedStates.erase(id);
+        }
+
+        this->enforceMemoryBudget(id);
+        return &state->second;
+    }
+
+    // Move a state to the front of the recent list. It can be changed through
+    // the pointer it was loaded for, so its memory use is measured again the
+    // next time the budget is enforced. Expects the state mutex to be held.
+    void markStateUsed(const int id) {
+        const auto recent = this->m_recentStateIndex.find(id);
+
+        if (recent == this->m_recentStateIndex.end()) {
+            this->m_recentStates.push_front({id, 0});
+            this->m_recentStateIndex[id] = this->m_recentStates.begin();
+            return;
+        }
+
+        this->m_recentStates.splice(this->m_recentStates.begin(), this->m_recentStates, recent->second);
+        recent->second->memoryUsage = 0;
+    }
+    void forgetState(const int id) {
+        const auto recent = this->m_recentStateIndex.find(id);
+
+        if (recent == this->m_recentStateIndex.end())
+            return;
+
+        this->m_recentStates.erase(recent->second);
+        this->m_recentStateIndex.erase(recent);
+    }
+
+    // Evict the least recently used states, until the resident ones fit in
+    // the memory budget, or every state if they are being compressed. The
+    // current, newest (i.e. being built) and given states are always kept.
+    // Expects the state mutex to be held.
+    void enforceMemoryBudget(const int keepState) {
+        if ((this->m_memoryBudget == 0 && !this->m_compressStates) || this->m_evictionGuards > 0)
+            return;
+
+        const int newestState = this->getNumberOfEventStates() - 1;
+        size_t usage = 0;
+        std::vector<int> toEvict;
+        std::vector<int> toForget;
+
+        for (auto &recent : this->m_recentStates) {
+            const int id = recent.id;
+            const auto state = this->m_eventStates.find(id);
+            if (state == this->m_eventStates.end()) {
+                toForget.push_back(id);
+                continue;
+            }
+
+            // Only states used since the last check need measuring again.
+            if (recent.memoryUsage == 0)
+                recent.memoryUsage = state->second.getMemoryUsage();
+
+            const bool isKept = id == static_cast<int>(this->m_currentState) || id == newestState || id == keepState;
+            usage += recent.memoryUsage;
+
+            const bool isOverBudget = this->m_memoryBudget > 0 && usage > this->m_memoryBudget;
+            if (!isKept && (this->m_compressStates || isOverBudget))
+                toEvict.push_back(id);
+        }
+
+        for (const int id : toEvict) {
+            EventState &state = this->m_eventStates.at(id);
+
+            // States still in a persistent store are unchanged (see
+            // loadState), so can just be dropped, anything else needs
+            // compressing or spilling.
+            if (this->m_storedStates.count(id) == 0 && this->m_compressStates) {
+                if (this->m_compressedStates == nullptr)
+                    this->m_compressedStates = std::make_shared<CompressedStateStore>();
+
+                this->m_storedStates[id] = {this->m_compressedStates, this->m_compressedStates->addState(state)};
+            } else if (this->m_storedStates.count(id) == 0) {
+                if (this->m_spillFile == nullptr)
+                    this->m_spillFile = std::make_shared<SpillFile>(this->m_spillDirectory);
+
+                this->m_storedStates[id] = {this->m_spillFile, this->m_spillFile->addState(state)};
+            }
+
+            this->m_eventStates.erase(id);
+            this->forgetState(id);
+        }
+
+        for (const int id : toForget)
+            this->forgetState(id);
+    }
+
+    // Get a state to read from, without keeping it around if it has to be
+    // decoded. The given scratch state is used to hold it in that case.
+    const EventState *peekState(const int id, EventState &scratch) {
+        StoredStateRef ref;
+        {
+            std::lock_guard<std::mutex> lock(this->m_stateMutex);
+
+            const auto state = this->m_eventStates.find(id);
+            if (state != this->m_eventStates.end())
+                return &state->second;
+
+            const auto storedState = this->m_storedStates.find(id);
+            if (storedState == this->m_storedStates.end())
+                return nullptr;
+            ref = storedState->second;
+        }
+
+        scratch = ref.store->readState(ref.index);
+        return &scratch;
+    }
+
+    // Where a state is stored, if it isn't currently in memory.
+    std::shared_ptr<StateStore> getUnloadedState(const int id, size_t &index) {
+        std::lock_guard<std::mutex> lock(this->m_stateMutex);
+
+        const auto storedState = this->m_storedStates.find(id);
+        if (storedState == this->m_storedStates.end() || this->m_eventStates.count(id) > 0)
+            return nullptr;
+
+        index = storedState->second.index;
+        return storedState->second.store;
+    }
+
+    // Mark an export as started, returning false if one is already running.
+    bool beginExport() {
+        std::lock_guard<std::mutex> lock(this->m_exportMutex);
+
+        if (this->m_exportProgress.running)
+            return false;
+
+        this->m_exportProgress = ExportProgress();
+        this->m_exportProgress.running = true;
+        return true;
+    }
+
+    struct ExportProgress {
+        bool running = false;
+        size_t written = 0;
+        size_t total = 0;
+        size_t bytes = 0;
+        std::string outputDir;
+        std::string error;
+    };
+
+    // Endpoints that only read the states can run alongside each other, but
+    // not whilst the states are being changed, by an endpoint or from elsewhere.
+    template <typename Handler> httplib::Server::Handler reading(Handler handler) {
+        return [this, handler](const httplib::Request &req, httplib::Response &res) {
+            std::shared_lock<std::shared_mutex> lock(this->m_updateMutex);
+            handler(req, res);
+        };
+    }
+    template <typename Handler> httplib::Server::Handler updating(Handler handler) {
+        return [this, handler](const httplib::Request &req, httplib::Response &res) {
+            std::unique_lock<std::shared_mutex> lock(this->m_updateMutex);
+            handler(req, res);
+        };
     }
 
-  private:
     httplib::Server m_server;
+    std::shared_mutex m_updateMutex;
+    std::thread m_serverThread;
+    std::atomic<bool> m_serverThreadDone{false};
 
     DetectorGeometry m_geometry;
-    unsigned int m_currentState;
+    unsigned int m_currentState = 0;
     EventStates m_eventStates;
+    std::map<int, StoredStateRef> m_storedStates;
+    std::mutex m_stateMutex;
+
+    // Keeping the resident states under a memory budget.
+    size_t m_memoryBudget = 0;
+    std::string m_spillDirectory;
+    std::shared_ptr<SpillFile> m_spillFile;
+    bool m_compressStates = false;
+    std::shared_ptr<CompressedStateStore> m_compressedStates;
+
+    // The resident states, most recently used first, with the memory each was
+    // last measured to use, or 0 if it may have changed since.
+    struct RecentState {
+        int id;
+        size_t memoryUsage;
+    };
+    std::list<RecentState> m_recentStates;
+    std::unordered_map<int, std::list<RecentState>::iterator> m_recentStateIndex;
+    std::atomic<int> m_evictionGuards{0};
+    // MC for the whole event, shared by the states.
+    HitBlock<MCHit> m_eventMCHits;
+    std::string m_eventMCTruth;
+    bool m_hasEventMC = false;
+
     GUIConfig m_config;
+    OutputPrecision m_outputPrecision;
+
+    std::mutex m_exportMutex;
+    ExportProgress m_exportProgress;
+    std::thread m_exportThread;
 };
 
 // Run the actual server, spinning up the API endpoints and serving the
@@ -232,86 +726,333 @@ inline void HepEVDServer::startServer() {
     if (noDisplay && std::string(noDisplay) == "1")
         return;
 
+    // It may already be running in the background.
+    if (this->m_server.is_running())
+        return;
+
     // Every endpoint has two parts:
     // 1. Get: Access the data.
     // 2. Post: Update the data.
 
     // First, the actual event hits.
-    this->m_server.Get("/hits", [&](const Request &, Response &res) {
-        const std::string hitJson = parallel_to_json_array<Hits>(this->getHits());
+    this->m_server.Get("/hits", this->reading([&](const Request &, Response &res) {
+        const std::string hitJson = this->viewState()->hitsToJson(this->m_outputPrecision);
         res.set_content(hitJson, "application/json");
-    });
-    this->m_server.Post("/hits", [&](const Request &req, Response &res) {
+    }));
+    this->m_server.Post("/hits", this->updating([&](const Request &req, Response &res) {
         try {
             this->addHits(json::parse(req.body));
             res.set_content("OK", "text/plain");
         } catch (const std::exception &e) {
             res.set_content("Error: " + std::string(e.what()), "text/plain");
         }
-    });
+    }));
 
     // Next, the MC truth hits.
-    this->m_server.Get("/mcHits", [&](const Request &, Response &res) {
-        res.set_content(json(this->getMCHits()).dump(), "application/json");
-    });
-    this->m_server.Post("/mcHits", [&](const Request &req, Response &res) {
+    this->m_server.Get("/mcHits", this->reading([&](const Request &, Response &res) {
+        res.set_content(this->viewState()->mcHitsToJson(this->m_outputPrecision), "application/json");
+    }));
+    this->m_server.Post("/mcHits", this->updating([&](const Request &req, Response &res) {
         try {
             this->addMCHits(json::parse(req.body));
             res.set_content("OK", "text/plain");
         } catch (const std::exception &e) {
             res.set_content("Error: " + std::string(e.what()), "text/plain");
         }
-    });
+    }));
 
     // And the MC truth information.
-    this->m_server.Get("/mcTruth",
-                       [&](const Request &, Response &res) { res.set_content(this->getMCTruth(), "text/plain"); });
+    this->m_server.Get("/mcTruth", this->reading([&](const Request &, Response &res) {
+        res.set_content(this->getMCTruth(), "text/plain");
+    }));
 
     // Then any actual particles.
-    this->m_server.Get("/particles", [&](const Request &, Response &res) {
-        const auto particleJson = parallel_to_json_array<Particles>(this->getParticles());
-        res.set_content(particleJson, "application/json");
-    });
-    this->m_server.Post("/particles", [&](const Request &req, Response &res) {
+    this->m_server.Get("/particles", this->reading([&](const Request &, Response &res) {
+        res.set_content(this->viewState()->particlesToJson(this->m_outputPrecision), "application/json");
+    }));
+    this->m_server.Get("/particles/summary", this->reading([&](const Request &, Response &res) {
+        const auto summaryJson = parallel_to_json_array(
+            this->viewState()->m_particles, [](auto &writer, const Particle &p) { p.writeSummaryJson(writer); },
+            this->m_outputPrecision);
+        res.set_content(summaryJson, "application/json");
+    }));
+
+    // Fetch the hits for only some particles, so clients can start from the
+    // summaries and load hits as particles are actually looked at.
+    //  - ids: Comma separated particle IDs (default: all particles).
+    //  - indices: Comma separated particle indices, as an alternative to ids.
+    //  - maxHits: Evenly thin out each particle to at most this many hits.
+    // The result is in the same flat format as /particles, but only with the
+    // ID and hit range of each requested particle.
+    this->m_server.Get("/particles/hits", this->reading([&](const Request &req, Response &res) {
+        const auto state = this->viewState();
+        const auto &hierarchy = state->getHierarchy();
+
+        auto splitParam = [&](const std::string &key) {
+            std::vector<std::string> values;
+            std::stringstream ss(req.get_param_value(key));
+            std::string value;
+            while (std::getline(ss, value, ','))
+                if (!value.empty())
+                    values.push_back(value);
+            return values;
+        };
+
+        std::vector<unsigned int> selected;
+        size_t maxHits = 0;
+        try {
+            for (const auto &id : splitParam("ids")) {
+                const int index = hierarchy.getIndex(id);
+                if (index < 0)
+                    throw std::invalid_argument("No particle with ID " + id);
+                selected.push_back(index);
+            }
+            for (const auto &indexStr : splitParam("indices")) {
+                const unsigned long index = std::stoul(indexStr);
+                if (index >= state->m_particles.size())
+                    throw std::out_of_range("No particle with index " + indexStr);
+                selected.push_back(index);
+            }
+            if (req.has_param("maxHits"))
+                maxHits = std::stoul(req.get_param_value("maxHits"));
+        } catch (const std::exception &e) {
+            res.status = 400;
+            res.set_content("Error: " + std::string(e.what()), "text/plain");
+            return;
+        }
+
+        if (!req.has_param("ids") && !req.has_param("indices")) {
+            selected.resize(state->m_particles.size());
+            std::iota(selected.begin(), selected.end(), 0);
+        }
+
+        // Gather the requested hits, so they can be written out in parallel.
+        std::vector<const Hit *> hits;
+        std::vector<std::pair<size_t, size_t>> ranges;
+
+        for (const auto index : selected) {
+            const Particle &particle = state->m_particles[index];
+            const size_t nHits = particle.getNHits();
+            const size_t stride = (maxHits > 0 && nHits > maxHits) ? (nHits + maxHits - 1) / maxHits : 1;
+
+            ranges.push_back({hits.size(), 0});
+            for (size_t i = 0; i < nHits; i += stride)
+                hits.push_back(&resolveParticleHit(state->m_hits, state->m_particleHits,
+                                                   state->m_particleHitRefs[particle.getHitOffset() + i]));
+            ranges.back().second = hits.size() - ranges.back().first;
+        }
+
+        rapidjson::StringBuffer s;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(s);
+
+        writer.StartArray();
+        for (size_t i = 0; i < selected.size(); ++i) {
+            const std::string &id = state->m_particles[selected[i]].getID();
+
+            writer.StartObject();
+            writer.Key("id");
+            writer.String(id.c_str(), static_cast<rapidjson::SizeType>(id.length()));
+            writer.Key("index");
+            writer.Uint(selected[i]);
+            writer.Key("hitOffset");
+            writer.Uint64(ranges[i].first);
+            writer.Key("hitCount");
+            writer.Uint64(ranges[i].second);
+            writer.EndObject();
+        }
+        writer.EndArray();
+
+        const std::string hitJson = parallel_to_json_array(
+            hits, [](auto &w, const Hit *hit) { hit->writeJson(w); }, this->m_outputPrecision);
+        res.set_content("{\"hits\":" + hitJson + ",\"particles\":" + s.GetString() + "}", "application/json");
+    }));
+
+    // Navigate the particle hierarchy, without needing every particle.
+    // Particles are referred to by their index in the /particles array.
+    this->m_server.Get("/particles/roots", this->reading([&](const Request &, Response &res) {
+        const auto state = this->viewState();
+        const auto &hierarchy = state->getHierarchy();
+
+        rapidjson::StringBuffer s;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(s);
+
+        writer.StartArray();
+        for (const auto root : hierarchy.getRoots())
+            hierarchy.writeNodeJson(writer, state->m_particles, root);
+        writer.EndArray();
+
+        res.set_content(s.GetString(), "application/json");
+    }));
+    this->m_server.Get("/particles/:id/subtree", this->reading([&](const Request &req, Response &res) {
+        const auto state = this->viewState();
+        const auto &hierarchy = state->getHierarchy();
+
+        // Accept either a particle ID, or the index of the particle.
+        const std::string &id = req.path_params.at("id");
+        int index = hierarchy.getIndex(id);
+
+        const auto isDigit = [](const unsigned char c) { return std::isdigit(c) != 0; };
+        if (index < 0 && !id.empty() && std::all_of(id.begin(), id.end(), isDigit)) {
+            unsigned int value = 0;
+            const auto result = std::from_chars(id.data(), id.data() + id.size(), value);
+
+            if (result.ec == std::errc() && result.ptr == id.data() + id.size() && value < hierarchy.size())
+                index = static_cast<int>(value);
+        }
+
+        if (index < 0 || index >= static_cast<int>(hierarchy.size())) {
+            res.status = 404;
+            res.set_content("Error: No particle with ID " + id, "text/plain");
+            return;
+        }
+
+        rapidjson::StringBuffer s;
+        rapidjson::Writer<rapidjson::StringBuffer> writer(s);
+
+        writer.StartArray();
+        for (const auto idx : hierarchy.getSubtree(index))
+            hierarchy.writeNodeJson(writer, state->m_particles, idx);
+        writer.EndArray();
+
+        res.set_content(s.GetString(), "application/json");
+    }));
+    this->m_server.Post("/particles", this->updating([&](const Request &req, Response &res) {
         try {
             this->addParticles(json::parse(req.body));
             res.set_content("OK", "text/plain");
         } catch (const std::exception &e) {
             res.set_content("Error: " + std::string(e.what()), "text/plain");
         }
-    });
+    }));
 
     // Then, any markers (points, lines, rings, etc.)
-    this->m_server.Get("/markers", [&](const Request &, Response &res) {
-        res.set_content(json(this->getMarkers()).dump(), "application/json");
-    });
-    this->m_server.Post("/markers", [&](const Request &req, Response &res) {
+    this->m_server.Get("/markers", this->reading([&](const Request &, Response &res) {
+        res.set_content(this->viewState()->markersToJson(this->m_outputPrecision), "application/json");
+    }));
+    this->m_server.Post("/markers", this->updating([&](const Request &req, Response &res) {
         try {
             this->addMarkers(json::parse(req.body));
             res.set_content("OK", "text/plain");
         } catch (const std::exception &e) {
             res.set_content("Error: " + std::string(e.what()), "text/plain");
         }
-    });
+    }));
 
     // Any supplied raw images
-    this->m_server.Get("/images", [&](const Request &, Response &res) {
-        res.set_content(json(this->getImages()).dump(), "application/json");
-    });
-    this->m_server.Post("/images", [&](const Request &req, Response &res) {
+    this->m_server.Get("/images", this->reading([&](const Request &, Response &res) {
+        res.set_content(this->viewState()->imagesToJson(), "application/json");
+    }));
+    this->m_server.Post("/images", this->updating([&](const Request &req, Response &res) {
         try {
             this->addImages(json::parse(req.body));
             res.set_content("OK", "text/plain");
         } catch (const std::exception &e) {
             res.set_content("Error: " + std::string(e.what()), "text/plain");
         }
-    });
+    }));
+
+    // Image metadata, so the browser can pick which levels / tiles to fetch.
+    this->m_server.Get("/images/info", this->reading([&](const Request &, Response &res) {
+        json info = json::array();
+        for (const auto &image : this->viewState()->m_images)
+            info.push_back(image.getMetadata());
+        res.set_content(info.dump(), "application/json");
+    }));
+
+    // Raw image data, as "/images/<idx>.bin".
+    // Optional parameters:
+    //   dtype:  float32 (default), uint8 or uint16.
+    //   level:  Pyramid level, 0 being full resolution.
+    //   channel: A single channel of a multi-channel image, otherwise all planes are sent.
+    //   tile:   "col,row" of a TILE_SIZE tile within the level, or...
+    //   x, y, width, height: An arbitrary region within the level.
+    this->m_server.Get("/images/:file", this->reading([&](const Request &req, Response &res) {
+        const std::string &file = req.path_params.at("file");
+        const std::string suffix = ".bin";
+
+        try {
+            if (file.size() <= suffix.size() || file.compare(file.size() - suffix.size(), suffix.size(), suffix) != 0)
+                throw std::invalid_argument("Expected /images/<idx>.bin");
+
+            const Images &images = this->viewState()->m_images;
+            const int idx = std::stoi(file.substr(0, file.size() - suffix.size()));
+
+            if (idx < 0 || idx >= static_cast<int>(images.size())) {
+                res.status = 404;
+                res.set_content("Error: No image " + std::to_string(idx), "text/plain");
+                return;
+            }
+
+            const MonochromeImage &image = images[idx];
+            const std::string dtypeName = req.has_param("dtype") ? req.get_param_value("dtype") : "float32";
+            const std::map<std::string, ImageDType> dtypes = {
+                {"float32", FLOAT32}, {"uint8", UINT8}, {"uint16", UINT16}};
+
+            if (dtypes.count(dtypeName) == 0)
+                throw std::invalid_argument("Unknown dtype " + dtypeName);
+
+            const ImageDType dtype = dtypes.at(dtypeName);
+            const int level = req.has_param("level") ? std::stoi(req.get_param_value("level")) : 0;
+            const int channel = req.has_param("channel") ? std::stoi(req.get_param_value("channel")) : -1;
+            const ImageLevel &imageLevel = image.getLevel(level);
+
+            int x = 0, y = 0, width = imageLevel.width, height = imageLevel.height;
+
+            if (req.has_param("tile")) {
+                const std::string tile = req.get_param_value("tile");
+                const size_t comma = tile.find(',');
+                if (comma == std::string::npos)
+                    throw std::invalid_argument("tile should be given as col,row");
+
+                // Checked before scaling to pixels, so large indices can't overflow.
+                const int col = std::stoi(tile.substr(0, comma));
+                const int row = std::stoi(tile.substr(comma + 1));
+                const int numCols = (imageLevel.width + MonochromeImage::TILE_SIZE - 1) / MonochromeImage::TILE_SIZE;
+                const int numRows = (imageLevel.height + MonochromeImage::TILE_SIZE - 1) / MonochromeImage::TILE_SIZE;
+
+                if (col < 0 || col >= numCols || row < 0 || row >= numRows)
+                    throw std::out_of_range("tile " + tile + " is outside of the image");
+
+                x = col * MonochromeImage::TILE_SIZE;
+                y = row * MonochromeImage::TILE_SIZE;
+                width = MonochromeImage::TILE_SIZE;
+                height = MonochromeImage::TILE_SIZE;
+            } else {
+                x = req.has_param("x") ? std::clamp(std::stoi(req.get_param_value("x")), 0, width) : x;
+                y = req.has_param("y") ? std::clamp(std::stoi(req.get_param_value("y")), 0, height) : y;
+                width = req.has_param("width") ? std::stoi(req.get_param_value("width")) : width - x;
+                height = req.has_param("height") ? std::stoi(req.get_param_value("height")) : height - y;
+            }
+
+            // Clamp here too, so the headers match the returned buffer.
+            x = std::clamp(x, 0, imageLevel.width);
+            y = std::clamp(y, 0, imageLevel.height);
+            width = std::clamp(width, 0, imageLevel.width - x);
+            height = std::clamp(height, 0, imageLevel.height - y);
+
+            const std::string buffer = image.toBinary(level, x, y, width, height, dtype, channel);
+
+            res.set_header("X-Image-Width", std::to_string(width));
+            res.set_header("X-Image-Height", std::to_string(height));
+            res.set_header("X-Image-Channels", std::to_string(channel < 0 ? imageLevel.channels : 1));
+            res.set_header("X-Image-X", std::to_string(x));
+            res.set_header("X-Image-Y", std::to_string(y));
+            res.set_header("X-Image-Level", std::to_string(level));
+            res.set_header("X-Image-DType", dtypeName);
+            res.set_header("X-Image-Min", std::to_string(image.getMinValue()));
+            res.set_header("X-Image-Max", std::to_string(image.getMaxValue()));
+            res.set_content(buffer, "application/octet-stream");
+        } catch (const std::exception &e) {
+            res.status = 400;
+            res.set_content("Error: " + std::string(e.what()), "text/plain");
+        }
+    }));
 
     // Finally, the detector geometry.
-    this->m_server.Get("/geometry", [&](const Request &, Response &res) {
-        res.set_content(json(this->m_geometry).dump(), "application/json");
-    });
-    this->m_server.Post("/geometry", [&](const Request &req, Response &res) {
+    this->m_server.Get("/geometry", this->reading([&](const Request &, Response &res) {
+        res.set_content(this->m_geometry.toJsonString(), "application/json");
+    }));
+    this->m_server.Post("/geometry", this->updating([&](const Request &req, Response &res) {
         try {
             Volumes vols(json::parse(req.body));
             this->m_geometry = DetectorGeometry(vols);
@@ -319,165 +1060,153 @@ inline void HepEVDServer::startServer() {
         } catch (const std::exception &e) {
             res.set_content("Error: " + std::string(e.what()), "text/plain");
         }
-    });
+    }));
 
     // Add a top level, dump everything endpoint.
-    this->m_server.Get("/stateToJson", [&](const Request &, Response &res) {
-        json output;
-        output["detectorGeometry"] = this->m_geometry;
-        output["hits"] = this->getHits();
-        output["mcHits"] = this->getMCHits();
-        output["particles"] = this->getParticles();
-        output["markers"] = this->getMarkers();
-        output["stateInfo"] = *this->getState();
-        output["config"] = *this->getConfig();
-        res.set_content(output.dump(4), "application/json");
-    });
-    this->m_server.Get("/writeOutAllStates", [&](const Request &, Response &res) {
-        // This is very different to the rest of the endpoints, as it needs to
-        // write out JSON files for each state, rather than just returning the
-        // data.
-
-        // This was made because this is only really useful for either saving
-        // the current event display state, or for producing data for the
-        // GitHub pages version of the event display.
-
-        // We want two things:
-        // 1. A top level file that contains 3 things:
-        //    - The detector geometry (static, so just define it once)
-        //    - The number of states
-        //    - An array of states names to a blank string.
-        //      The blank string can be filled in later, if needed,
-        //      with individual URLs to the state files.
-        // 2. A file for each state, containing the full state information.
-
-        // Populate the top level file.
-        json infoFile;
-        infoFile["detectorGeometry"] = this->m_geometry;
-        infoFile["config"] = *this->getConfig();
-        infoFile["stateInfo"] = *this->getState();
-
-        // Define a lambda to produce a valid file name from a state name, which
-        // can be used in the state files.
-        auto getFileName = [](const int i, const std::string &name) {
-            std::string formattedName = name;
-
-            // Replace any spaces with underscores.
-            std::replace(formattedName.begin(), formattedName.end(), ' ', '_');
-
-            // Remove any non-alphanumeric characters.
-            formattedName.erase(std::remove_if(formattedName.begin(), formattedName.end(),
-                                               [](char c) { return !std::isalnum(c) && c != '_'; }),
-                                formattedName.end());
-
-            return std::to_string(i) + "_" + formattedName + ".json";
-        };
-
-        int numberOfStates(0);
-
-        for (auto &state : this->m_eventStates) {
-
-            if (state.second.isEmpty())
-                continue;
-
-            json nameUrlPair({{"name", state.second.m_name},
-                              {
-                                  "url",
-                                  "",
-                              },
-                              {"file_name", getFileName(numberOfStates, state.second.m_name)}});
-            infoFile["states"].push_back(nameUrlPair);
-            ++numberOfStates;
+    this->m_server.Get("/stateToJson", this->reading([&](const Request &, Response &res) {
+        const auto state = this->viewState();
+        const std::string output = "{\"detectorGeometry\":" + this->m_geometry.toJsonString() +
+                                   ",\"hits\":" + state->hitsToJson(this->m_outputPrecision) +
+                                   ",\"mcHits\":" + state->mcHitsToJson(this->m_outputPrecision) +
+                                   ",\"particles\":" + state->particlesToJson(this->m_outputPrecision) +
+                                   ",\"markers\":" + state->markersToJson(this->m_outputPrecision) +
+                                   ",\"stateInfo\":" + json(*state).dump() +
+                                   ",\"config\":" + json(*this->getConfig()).dump() + "}";
+        res.set_content(output, "application/json");
+    }));
+    // The current state in the binary archive format. States that haven't been
+    // decoded are sent as they are stored, i.e. straight from a mapped archive.
+    this->m_server.Get("/stateToBinary", this->reading([&](const Request &, Response &res) {
+        // Keep the stored copy from being freed and reused while it is read.
+        const EvictionGuard guard(this->m_evictionGuards);
+
+        size_t index = 0;
+        const auto store = this->getUnloadedState(this->m_currentState, index);
+
+        if (store == nullptr) {
+            res.set_content(encodeEventState(*this->viewState()), "application/octet-stream");
+            return;
         }
 
-        // Add an empty, top level property of "root_url".
-        // This can then be used to set a link later, for Gist usage.
-        infoFile["root_url"] = "";
-
-        // Now write out the top level file.
-        infoFile["numberOfStates"] = numberOfStates;
-        std::ofstream infoFileOut("eventDisplayInfo.json");
-        infoFileOut << infoFile.dump(4);
-
-        // Then populate the state files...
-        for (unsigned int i = 0; i < this->m_eventStates.size(); i++) {
-            json stateFile;
-            EventState state = this->m_eventStates[i];
+        std::string buffer;
+        const std::string_view block = store->getStateBlock(index, buffer);
 
-            if (state.isEmpty())
-                continue;
+        if (!buffer.empty()) {
+            res.set_content(std::move(buffer), "application/octet-stream");
+            return;
+        }
 
-            stateFile["name"] = state.m_name;
-            stateFile["hits"] = state.m_hits;
-            stateFile["mcHits"] = state.m_mcHits;
-            stateFile["particles"] = state.m_particles;
-            stateFile["markers"] = state.m_markers;
-            stateFile["mcTruth"] = state.m_mcTruth;
+        res.set_content_provider(block.size(), "application/octet-stream",
+                                 [store, block](size_t offset, size_t length, DataSink &sink) {
+                                     return sink.write(block.data() + offset, length);
+                                 });
+    }));
+
+    // Write every state out to disk, see writeOutAllStates.
+    //  - gzip: Compress each state file (needs zlib).
+    //  - async: Return straight away, and follow along via /writeOutAllStates/progress.
+    this->m_server.Get("/writeOutAllStates", this->reading([&](const Request &req, Response &res) {
+        const bool compress = req.has_param("gzip") && req.get_param_value("gzip") != "0";
+        const bool async = req.has_param("async") && req.get_param_value("async") != "0";
+
+        if (!this->beginExport()) {
+            res.status = 409;
+            res.set_content("Error: An export is already running", "text/plain");
+            return;
+        }
 
-            std::string formattedName = state.m_name;
+        if (async) {
+            if (this->m_exportThread.joinable())
+                this->m_exportThread.join();
 
-            // Replace any spaces with underscores.
-            std::replace(formattedName.begin(), formattedName.end(), ' ', '_');
+            this->m_exportThread = std::thread([this, compress]() {
+                std::shared_lock<std::shared_mutex> lock(this->m_updateMutex);
+                this->writeOutAllStates(compress);
+            });
+            res.set_content("Started writing out event display state files to " + getCWD(), "text/plain");
+            return;
+        }
 
-            // Remove any non-alphanumeric characters.
-            formattedName.erase(std::remove_if(formattedName.begin(), formattedName.end(),
-                                               [](char c) { return !std::isalnum(c) && c != '_'; }),
-                                formattedName.end());
+        this->writeOutAllStates(compress);
 
-            std::ofstream stateFileOut(std::to_string(i) + "_" + formattedName + ".json");
-            stateFileOut << stateFile.dump();
+        const json progress = this->getExportProgress();
+        if (!progress["error"].get<std::string>().empty()) {
+            res.status = 500;
+            res.set_content("Error: " + progress["error"].get<std::string>(), "text/plain");
+            return;
         }
 
         // Alert the user to the files being written out.
-        const auto currentDir = getCWD();
-        res.set_content("Wrote out event display state files to " + currentDir, "text/plain");
-    });
-
-    // State controls...
-    this->m_server.Get("/allStateInfo", [&](const Request &, Response &res) {
-        res.set_content(json(this->m_eventStates).dump(), "application/json");
-    });
-    this->m_server.Get("/stateInfo", [&](const Request &, Response &res) {
-        auto state = this->getState();
-        const auto mcTruth = this->getMCTruth();
+        res.set_content("Wrote out event display state files to " + progress["outputDir"].get<std::string>(),
+                        "text/plain");
+    }));
+    this->m_server.Get("/writeOutAllStates/progress", this->reading([&](const Request &, Response &res) {
+        res.set_content(this->getExportProgress().dump(), "application/json");
+    }));
+
+    // Write every state into one binary archive, in the current directory.
+    //  - file: The archive file name, defaulting to eventDisplay.hepevd.
+    this->m_server.Get("/writeArchive", this->reading([&](const Request &req, Response &res) {
+        const std::string fileName = req.has_param("file") ? req.get_param_value("file") : "eventDisplay.hepevd";
+
+        if (fileName.empty() || fileName.find('/') != std::string::npos || fileName.find('\\') != std::string::npos) {
+            res.status = 400;
+            res.set_content("Error: The archive file name must not include a directory", "text/plain");
+            return;
+        }
 
-        // If the MC truth string and the MC truth in the state are different,
-        // then we need to add the MC truth to the state.
-        if (mcTruth.size() > 0 && state->m_mcTruth.size() == 0)
-            state->m_mcTruth = mcTruth;
+        try {
+            const size_t numStates = this->writeArchive(fileName);
+            res.set_content("Wrote out " + std::to_string(numStates) + " states to " + getCWD() + "/" + fileName,
+                            "text/plain");
+        } catch (const std::exception &e) {
+            res.status = 500;
+            res.set_content("Error: " + std::string(e.what()), "text/plain");
+        }
+    }));
 
-        res.set_content(json(*state).dump(), "application/json");
-    });
-    this->m_server.Get("/swap/id/:id", [&](const Request &req, Response &res) {
+    // State controls...
+    this->m_server.Get("/allStateInfo", this->reading([&](const Request &, Response &res) {
+        res.set_content(this->getAllStateInfo().dump(), "application/json");
+    }));
+    this->m_server.Get("/stateInfo", this->reading([&](const Request &, Response &res) {
+        // Fall back to the event MC truth in the response, rather than
+        // writing it into the state, as this only holds a reading lock.
+        json stateInfo = *this->viewState();
+        stateInfo["mcTruth"] = this->getMCTruth();
+
+        res.set_content(stateInfo.dump(), "application/json");
+    }));
+    this->m_server.Get("/swap/id/:id", this->updating([&](const Request &req, Response &res) {
         try {
             this->swapEventState(std::stoi(req.path_params.at("id")));
             res.set_content("OK", "text/plain");
         } catch (const std::exception &e) {
             res.set_content("Error: " + std::string(e.what()), "text/plain");
         }
-    });
-    this->m_server.Get("/swap/name/:name", [&](const Request &req, Response &res) {
+    }));
+    this->m_server.Get("/swap/name/:name", this->updating([&](const Request &req, Response &res) {
         try {
             this->swapEventState(req.path_params.at("name"));
             res.set_content("OK", "text/plain");
         } catch (const std::exception &e) {
             res.set_content("Error: " + std::string(e.what()), "text/plain");
         }
-    });
-    this->m_server.Get("/nextState", [&](const Request &, Response &res) {
+    }));
+    this->m_server.Get("/nextState", this->updating([&](const Request &, Response &res) {
         this->nextEventState();
         res.set_content("OK", "text/plain");
-    });
-    this->m_server.Get("/previousState", [&](const Request &, Response &res) {
+    }));
+    this->m_server.Get("/previousState", this->updating([&](const Request &, Response &res) {
         this->previousEventState();
         res.set_content("OK", "text/plain");
-    });
+    }));
 
     // Management controls...
     this->m_server.Get("/quit", [&](const Request &, Response &) { this->m_server.stop(); });
-    this->m_server.Get("/config", [&](const Request &, Response &res) {
+    this->m_server.Get("/config", this->reading([&](const Request &, Response &res) {
         res.set_content(json(*this->getConfig()).dump(), "application/json");
-    });
+    }));
 
     // Finally, mount the www folder, which contains the actual HepEVD JS code.
     this->m_server.set_mount_point("/", WEB_FOLDER());
@@ -491,10 +1220,250 @@ inline void HepEVDServer::startServer() {
     std::string host = HOST();
     std::cout << "Starting HepEVD server on http://" << host << ":" << port << "..." << std::endl;
     this->m_server.listen(host, port);
+
+    // Don't let the states change under a background export.
+    if (this->m_exportThread.joinable())
+        this->m_exportThread.join();
+
     std::cout << "Server closed, continuing..." << std::endl;
 }
 
-inline void HepEVDServer::stopServer() { this->m_server.stop(); }
+inline void HepEVDServer::stopServer() {
+    this->m_server.stop();
+
+    if (this->m_serverThread.joinable() && this->m_serverThread.get_id() != std::this_thread::get_id())
+        this->m_serverThread.join();
+}
+
+inline bool HepEVDServer::startServerInBackground() {
+    if (this->m_server.is_running())
+        return true;
+
+    // It may have been stopped via /quit, so just needs cleaning up.
+    if (this->m_serverThread.joinable())
+        this->m_serverThread.join();
+
+    this->m_serverThreadDone = false;
+    this->m_serverThread = std::thread([this]() {
+        this->startServer();
+        this->m_serverThreadDone = true;
+    });
+
+    // Wait until it's listening, or has given up (i.e. there's no display).
+    while (!this->m_server.is_running() && !this->m_serverThreadDone)
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    return this->m_server.is_running();
+}
+
+// We want two things:
+// 1. A top level file that contains 3 things:
+//    - The detector geometry (static, so just define it once)
+//    - The number of states
+//    - An array of states names to a blank string.
+//      The blank string can be filled in later, if needed,
+//      with individual URLs to the state files.
+// 2. A file for each state, containing the full state information.
+//
+// The state files are independent, so are written in parallel, each one
+// streamed to disk part by part rather than built up in memory first.
+// Expects beginExport to have been called, so progress can be followed.
+inline void HepEVDServer::writeOutAllStates(const bool compress) {
+
+    auto setError = [&](const std::string &error) {
+        std::lock_guard<std::mutex> lock(this->m_exportMutex);
+        this->m_exportProgress.error = error;
+        this->m_exportProgress.running = false;
+    };
+
+    // Don't evict the states that are being written out.
+    const EvictionGuard guard(this->m_evictionGuards);
+
+    try {
+        // Check up front, so the info file doesn't point at files that can't be written.
+        if (compress && !OutputFile::supportsCompression())
+            throw std::invalid_argument("HepEVD was built without zlib, so can't compress output");
+
+        // Produce a valid file name from a state name.
+        auto getFileName = [&](const int i, const std::string &name) {
+            std::string formattedName = name;
+
+            // Replace any spaces with underscores.
+            std::replace(formattedName.begin(), formattedName.end(), ' ', '_');
+
+            // Remove any non-alphanumeric characters.
+            formattedName.erase(std::remove_if(formattedName.begin(), formattedName.end(),
+                                               [](char c) { return !std::isalnum(c) && c != '_'; }),
+                                formattedName.end());
+
+            return std::to_string(i) + "_" + formattedName + (compress ? ".json.gz" : ".json");
+        };
+
+        // Gather the states to write, and the file each one goes to.
+        // Archived states that haven't been looked at are only decoded when written.
+        std::vector<std::pair<int, std::string>> outputs;
+        std::vector<std::string> names;
+        for (int i = 0; i < this->getNumberOfEventStates(); ++i) {
+            size_t index = 0;
+            EventState scratch;
+            const bool isUnloaded = this->getUnloadedState(i, index) != nullptr;
+            const EventState *state = isUnloaded ? nullptr : this->peekState(i, scratch);
+
+            if (!isUnloaded && (state == nullptr || state->isEmpty()))
+                continue;
+
+            names.push_back(this->getStateName(i));
+            outputs.push_back({i, getFileName(outputs.size(), names.back())});
+        }
+
+        {
+            std::lock_guard<std::mutex> lock(this->m_exportMutex);
+            this->m_exportProgress.total = outputs.size();
+            this->m_exportProgress.outputDir = getCWD();
+        }
+
+        // Populate the top level file.
+        json infoFile;
+        infoFile["detectorGeometry"] = json::parse(this->m_geometry.toJsonString());
+        infoFile["config"] = *this->getConfig();
+        infoFile["stateInfo"] = *this->viewState();
+        infoFile["states"] = json::array();
+
+        for (size_t i = 0; i < outputs.size(); ++i)
+            infoFile["states"].push_back({{"name", names[i]}, {"url", ""}, {"file_name", outputs[i].second}});
+
+        // Add an empty, top level property of "root_url".
+        // This can then be used to set a link later, for Gist usage.
+        infoFile["root_url"] = "";
+        infoFile["numberOfStates"] = outputs.size();
+
+        OutputFile infoFileOut("eventDisplayInfo.json");
+        infoFileOut.write(infoFile.dump(4));
+        infoFileOut.close();
+
+        // Then the state files, with each worker taking the next unwritten state.
+        // With several workers, each state is serialised on its worker's thread,
+        // and only a lone state is split across threads itself.
+        const size_t numThreads = std::min<size_t>(std::max(1u, std::thread::hardware_concurrency()), outputs.size());
+        std::atomic<size_t> nextOutput(0);
+        auto writeStates = [&]() {
+            const ParallelWorkerScope scope(numThreads > 1);
+
+            for (size_t i = nextOutput++; i < outputs.size(); i = nextOutput++) {
+                EventState scratch;
+                const EventState *state = this->peekState(outputs[i].first, scratch);
+
+                OutputFile stateFileOut(outputs[i].second, compress);
+                state->writeContentsJson(stateFileOut, this->m_outputPrecision);
+                stateFileOut.close();
+
+                std::lock_guard<std::mutex> lock(this->m_exportMutex);
+                this->m_exportProgress.written++;
+                this->m_exportProgress.bytes += stateFileOut.getBytesWritten();
+            }
+        };
+
+        std::vector<std::future<void>> workers;
+        for (size_t i = 0; i < numThreads; ++i)
+            workers.push_back(std::async(std::launch::async, writeStates));
+
+        for (auto &worker : workers)
+            worker.get();
+
+    } catch (const std::exception &e) {
+        setError(e.what());
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->m_exportMutex);
+    this->m_exportProgress.running = false;
+}
+
+// Stored states that haven't been decoded are copied across as they are.
+inline size_t HepEVDServer::writeArchive(const std::string &path) {
+    ArchiveWriter writer(path, this->m_geometry, this->m_config);
+
+    const EvictionGuard guard(this->m_evictionGuards);
+
+    for (int i = 0; i < this->getNumberOfEventStates(); ++i) {
+        size_t index = 0;
+        const auto store = this->getUnloadedState(i, index);
+
+        if (store != nullptr) {
+            std::string buffer;
+            writer.addEncodedState(store->getStateBlock(index, buffer), store->getEntry(index));
+            continue;
+        }
+
+        EventState scratch;
+        const EventState *state = this->peekState(i, scratch);
+        if (state != nullptr && !state->isEmpty())
+            writer.addState(*state);
+    }
+
+    writer.close();
+    return writer.getNumStates();
+}
+
+inline void HepEVDServer::openArchives(const std::vector<std::string> &paths) {
+    std::vector<std::shared_ptr<ArchiveFile>> archives;
+    for (const auto &path : paths)
+        archives.push_back(std::make_shared<ArchiveFile>(path));
+
+    this->resetServer();
+
+    for (const auto &archive : archives) {
+        const json &metadata = archive->getMetadata();
+
+        if (this->m_geometry.size() == 0 && metadata.contains("detectorGeometry")) {
+            this->m_geometry = metadata.at("detectorGeometry").get<DetectorGeometry>();
+            if (metadata.contains("config"))
+                this->m_config = metadata.at("config").get<GUIConfig>();
+        }
+
+        for (size_t i = 0; i < archive->getNumStates(); ++i)
+            this->m_storedStates[this->m_storedStates.size()] = {archive, i};
+    }
+
+    // Drop the empty initial state, if there is anything to show.
+    if (!this->m_storedStates.empty())
+        this->m_eventStates.clear();
+}
+
+// Matches the JSON of EventStates, including being null if there are no states.
+inline json HepEVDServer::getAllStateInfo() {
+    json info;
+    const EvictionGuard guard(this->m_evictionGuards);
+
+    EventState scratch;
+    for (int i = 0; i < this->getNumberOfEventStates(); ++i) {
+        size_t index = 0;
+        const auto store = this->getUnloadedState(i, index);
+
+        if (store != nullptr) {
+            info.push_back({{"id", i}, {"state", store->getStateInfo(index)}});
+            continue;
+        }
+
+        // Don't include empty states.
+        const EventState *state = this->peekState(i, scratch);
+        if (state == nullptr || (state->m_hits.size() == 0 && state->m_mcHits.size() == 0 &&
+                                 state->m_markers.size() == 0 && state->m_particles.size() == 0))
+            continue;
+
+        info.push_back({{"id", i}, {"state", *state}});
+    }
+
+    return info;
+}
+
+inline json HepEVDServer::getExportProgress() {
+    std::lock_guard<std::mutex> lock(this->m_exportMutex);
+    const ExportProgress &progress = this->m_exportProgress;
+
+    return {{"running", progress.running}, {"written", progress.written},     {"total", progress.total},
+            {"bytes", progress.bytes},     {"outputDir", progress.outputDir}, {"error", progress.error}};
+}
 
 }; // namespace HepEVD
 
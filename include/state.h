@@ -10,6 +10,7 @@
 
 #include "config.h"
 #include "geometry.h"
+#include "hit_block.h"
 #include "hits.h"
 #include "image.h"
 #include "marker.h"
@@ -18,70 +19,287 @@
 #include "extern/json.hpp"
 using json = nlohmann::json;
 
+#include <array>
+#include <memory>
 #include <unordered_map>
 
 namespace HepEVD {
 
+// Particles refer to their hits by index. A hit the state already has is
+// referred to by its index in the state's hits, and any other hit by its
+// index i in the particle hit store, as -1 - i.
+template <typename HitsType>
+const Hit &resolveParticleHit(const HitsType &hits, const HitsType &particleHits, const int64_t ref) {
+    return ref >= 0 ? hits[ref] : particleHits[-1 - ref];
+}
+
 // Top level state object, that contains everything about the current state of the
 // event. This means we can more easily store multiple events or multiple
 // parts of the same event.
 class EventState {
   public:
-    EventState() : m_name(""), m_particles(), m_hits(), m_mcHits(), m_markers(), m_images(), m_mcTruth("") {}
+    EventState()
+        : m_name(""), m_particles(), m_hits(), m_particleHits(), m_mcHits(), m_markers(), m_images(), m_mcTruth("") {}
     EventState(std::string name, Particles particles = {}, Hits hits = {}, MCHits mcHits = {}, Markers markers = {},
                Images images = {}, std::string mcTruth = "")
-        : m_name(name), m_particles(particles), m_hits(hits), m_mcHits(mcHits), m_markers(markers), m_images(images),
-          m_mcTruth(mcTruth) {}
+        : m_name(name), m_particles(), m_hits(hits), m_particleHits(), m_mcHits(mcHits), m_markers(markers),
+          m_images(images), m_mcTruth(mcTruth) {
+        this->addParticles(particles);
+        this->shareHits();
+    }
 
-    bool isEmpty() {
-        return m_name.size() == 0 && m_particles.empty() && m_hits.empty() && m_mcHits.empty() && m_markers.empty() &&
-               m_images.empty();
+    bool isEmpty() const { return m_name.size() == 0 && !this->hasContent(); }
+
+    // If anything has been added to the state, ignoring its name.
+    bool hasContent() const {
+        return !(m_particles.empty() && m_hits.empty() && m_mcHits.empty() && m_markers.empty() && m_images.empty());
     }
 
     void clear(const bool resetMCTruth = false) {
         m_name = "";
         m_particles.clear();
         m_hits.clear();
+        m_particleHits.clear();
+        m_particleHitRefs.clear();
+        m_particleHitIndex.clear();
+        m_particleHitIndexSize = 0;
+        m_hierarchy.reset();
         m_mcHits.clear();
         m_markers.clear();
         m_images.clear();
 
         m_hitIdCache.clear();
         m_hitIdCacheSize = 0;
+        m_hitIdCacheBlocks = {nullptr, nullptr};
 
         if (resetMCTruth)
             m_mcTruth = "";
     }
 
+    // Add particles to the state, with each particle then referring to its
+    // hits by index (see resolveParticleHit), rather than holding its own.
+    // Hits are matched up by ID, so a hit the state already has, either
+    // directly or through another particle, is only referred to, not stored
+    // again. Hits that match by ID are taken to be the same hit.
+    void addParticles(Particles particles) {
+        if (particles.empty())
+            return;
+
+        Hits &particleHits = m_particleHits.edit();
+        this->updateParticleHitIndex();
+
+        // Particles read straight out of a state no longer hold their own hits,
+        // only a range of that state's, so can't be added again as they are.
+        size_t totalHits = m_particleHitRefs.size();
+        for (const auto &particle : particles) {
+            if (particle.isFlattened())
+                throw std::invalid_argument("HepEVD: Particle " + particle.getID() + " already belongs to a state!");
+            totalHits += particle.getHits().size();
+        }
+
+        m_particleHitRefs.reserve(totalHits);
+        m_particles.reserve(m_particles.size() + particles.size());
+
+        // Summarise the hits of each new particle whilst it still has them, so
+        // that doesn't need repeating every time the energy, extent etc. is needed.
+        std::vector<size_t> newParticles(particles.size());
+        std::iota(newParticles.begin(), newParticles.end(), 0);
+
+        parallel_process(newParticles, [&](std::vector<size_t>::const_iterator begin,
+                                           std::vector<size_t>::const_iterator end) {
+            for (auto it = begin; it != end; ++it) {
+                const Hits &hits = particles[*it].getHits();
+                particles[*it].setSummary(ParticleSummary::fromHits(hits.cbegin(), hits.cend()));
+            }
+            return true;
+        });
+
+        for (auto &particle : particles) {
+            Hits hits = particle.releaseHits(m_particleHitRefs.size());
+
+            for (auto &hit : hits) {
+                const int64_t newRef = -static_cast<int64_t>(particleHits.size()) - 1;
+
+                if (!hit.getId().empty()) {
+                    const auto existing = m_particleHitIndex.emplace(hit.getId(), newRef);
+                    if (!existing.second) {
+                        m_particleHitRefs.push_back(existing.first->second);
+                        continue;
+                    }
+                }
+
+                m_particleHitRefs.push_back(newRef);
+                particleHits.push_back(std::move(hit));
+            }
+
+            m_particles.push_back(std::move(particle));
+        }
+
+        // Only resolved when it is next asked for, so adding particles in
+        // many small batches doesn't rebuild it every time. The same goes
+        // for sharing the hits, which is left until shareHits.
+        m_hierarchy.reset();
+    }
+
+    // The parent/child relationships between the particles in this state,
+    // resolved to particle indices. Built on first use after particles are
+    // added. This can be called by concurrent readers, so whichever build
+    // lands first is kept, and the others are discarded.
+    const ParticleHierarchy &getHierarchy() const {
+        std::shared_ptr<const ParticleHierarchy> hierarchy = std::atomic_load(&m_hierarchy);
+
+        if (!hierarchy) {
+            auto built = std::make_shared<const ParticleHierarchy>(m_particles);
+            if (std::atomic_compare_exchange_strong(&m_hierarchy, &hierarchy, built))
+                hierarchy = built;
+        }
+
+        return *hierarchy;
+    }
+
+    // Get a copy of the hits for a given particle in this state.
+    Hits getParticleHits(const Particle &particle) const {
+        if (!particle.isFlattened())
+            return particle.getHits();
+
+        Hits hits;
+        hits.reserve(particle.getNHits());
+
+        const auto begin = m_particleHitRefs.begin() + particle.getHitOffset();
+        for (auto ref = begin; ref != begin + particle.getNHits(); ++ref)
+            hits.push_back(resolveParticleHit(m_hits, m_particleHits, *ref));
+
+        return hits;
+    }
+
     // Find a hit that was previously added (either directly, or as part of a
     // Particle), by its ID, so properties can be attached to it after the
     // fact. Returns nullptr if no such hit exists.
     //
-    // The lookup cache is rebuilt whenever the total number of hits changes,
-    // rather than on every mutation, since hits/particles are effectively
-    // append-only between calls to clear().
+    // The lookup cache is rebuilt whenever the total number of hits or either
+    // hit block changes, rather than on every mutation, since hits/particles
+    // are effectively append-only between calls to clear(). As the hit may
+    // then be changed, this state stops sharing its hits with any others,
+    // until shareHits is called.
     Hit *getHitById(const std::string &id) {
-        size_t currentSize = m_hits.size();
-        for (const auto &particle : m_particles)
-            currentSize += particle.getHits().size();
-
-        if (currentSize != m_hitIdCacheSize) {
+        const size_t currentSize = m_hits.size() + m_particleHits.size();
+        const bool isCacheValid = currentSize == m_hitIdCacheSize && m_hits.isUnique() &&
+                                  m_particleHits.isUnique() && m_hits.get().data() == m_hitIdCacheBlocks[0] &&
+                                  m_particleHits.get().data() == m_hitIdCacheBlocks[1];
+
+        if (!isCacheValid) {
+            Hits &hits = m_hits.edit();
+            Hits &particleHits = m_particleHits.edit();
             m_hitIdCache.clear();
 
-            for (auto &hit : m_hits)
+            for (auto &hit : hits)
                 m_hitIdCache[hit.getId()] = &hit;
 
-            for (auto &particle : m_particles)
-                for (auto &hit : particle.getHits())
-                    m_hitIdCache[hit.getId()] = &hit;
+            for (auto &hit : particleHits)
+                m_hitIdCache[hit.getId()] = &hit;
 
             m_hitIdCacheSize = currentSize;
+            m_hitIdCacheBlocks = {hits.data(), particleHits.data()};
         }
 
         const auto it = m_hitIdCache.find(id);
         return it == m_hitIdCache.end() ? nullptr : it->second;
     }
 
+    // Let the hits be shared with identical ones in other states, once this
+    // state is done being changed (i.e. added to, or after getHitById).
+    void shareHits() {
+        m_hits.intern();
+        m_particleHits.intern();
+        m_mcHits.intern();
+
+        // Only needed whilst particles are being added, so is rebuilt if any more are.
+        m_particleHitIndex = {};
+        m_particleHitIndexSize = 0;
+    }
+
+    // A rough estimate of the memory used by the state, for keeping to a memory budget.
+    size_t getMemoryUsage() const {
+        auto hitBytes = [](const auto &hits) {
+            size_t bytes = hits.capacity() * sizeof(hits[0]);
+            for (const auto &hit : hits) {
+                bytes += getStringMemoryUsage(hit.getId()) + getStringMemoryUsage(hit.getLabel()) +
+                         getStringMemoryUsage(hit.getColour());
+                bytes += hit.getProperties().size() * 96;
+            }
+            return bytes;
+        };
+
+        // Blocks shared with other states are split between them.
+        auto blockBytes = [&](const auto &block) {
+            return (hitBytes(block.get()) + block.getJsonMemoryUsage()) / block.getShareCount();
+        };
+
+        size_t bytes = sizeof(EventState) + blockBytes(m_hits) + blockBytes(m_particleHits) + blockBytes(m_mcHits);
+        bytes += m_particles.capacity() * sizeof(Particle) + m_particleHitRefs.capacity() * sizeof(int64_t);
+        bytes += m_markers.capacity() * sizeof(AllMarkers);
+
+        for (const auto &image : m_images)
+            bytes += image.getMemoryUsage();
+
+        return bytes;
+    }
+
+    // RapidJSON serialization of each part of the state, using the parallel writer.
+    // Hits shared with other states reuse their output.
+    std::string hitsToJson(const OutputPrecision &precision = OutputPrecision()) const {
+        return this->m_hits.getJson(precision, [&](const Hits &hits) {
+            return parallel_to_json_array(hits, precision);
+        });
+    }
+    std::string mcHitsToJson(const OutputPrecision &precision = OutputPrecision()) const {
+        return this->m_mcHits.getJson(precision, [&](const MCHits &mcHits) {
+            return parallel_to_json_array(
+                mcHits, [](auto &writer, const MCHit &hit) { writeMCHitJson(writer, hit); }, precision);
+        });
+    }
+    std::string markersToJson(const OutputPrecision &precision = OutputPrecision()) const {
+        return parallel_to_json_array(
+            this->m_markers, [](auto &writer, const AllMarkers &marker) { writeMarkerJson(writer, marker); },
+            precision);
+    }
+    std::string imagesToJson() const { return parallel_to_json_array(this->m_images); }
+
+    // Only the hits the state doesn't already have are sent with the particles,
+    // along with the indices each particle refers to its hits by (see
+    // resolveParticleHit), with each particle referencing its range of those.
+    std::string particlesToJson(const OutputPrecision &precision = OutputPrecision()) const {
+        const std::string hits = this->m_particleHits.getJson(
+            precision, [&](const Hits &particleHits) { return parallel_to_json_array(particleHits, precision); });
+
+        std::string hitIndices = "[";
+        for (size_t i = 0; i < this->m_particleHitRefs.size(); ++i)
+            hitIndices += (i == 0 ? "" : ",") + std::to_string(this->m_particleHitRefs[i]);
+        hitIndices += "]";
+
+        return "{\"hits\":" + hits + ",\"hitIndices\":" + hitIndices +
+               ",\"particles\":" + parallel_to_json_array(this->m_particles, precision) + "}";
+    }
+
+    // Write the full contents of the state, as used for the per-state output files.
+    // Each part is written as soon as it is ready, so the whole state never
+    // needs to be held as one string.
+    template <typename OutputType>
+    void writeContentsJson(OutputType &out, const OutputPrecision &precision = OutputPrecision()) const {
+        out.write("{\"name\":" + json(this->m_name).dump());
+        out.write(",\"hits\":");
+        out.write(this->hitsToJson(precision));
+        out.write(",\"mcHits\":");
+        out.write(this->mcHitsToJson(precision));
+        out.write(",\"particles\":");
+        out.write(this->particlesToJson(precision));
+        out.write(",\"markers\":");
+        out.write(this->markersToJson(precision));
+        out.write(",\"images\":");
+        out.write(this->imagesToJson());
+        out.write(",\"mcTruth\":" + json(this->m_mcTruth).dump() + "}");
+    }
+
     // Only need a to JSON method, as we don't need to read in the state.
     // We also only want to pass the metadata, not the actual data.
     friend void to_json(json &j, const EventState &state) {
@@ -96,15 +314,46 @@ class EventState {
 
     std::string m_name;
     Particles m_particles;
-    Hits m_hits;
-    MCHits m_mcHits;
+    HitBlock<Hit> m_hits;
+    HitBlock<Hit> m_particleHits;
+    std::vector<int64_t> m_particleHitRefs;
+    HitBlock<MCHit> m_mcHits;
     Markers m_markers;
     Images m_images;
     std::string m_mcTruth;
 
   private:
+    // Add any hits since the last particles were added to the index of hits
+    // by ID, starting again if the hits have been replaced since.
+    void updateParticleHitIndex() {
+        if (m_hits.size() < m_particleHitIndexSize)
+            m_particleHitIndex.clear();
+
+        // Hits only the particles have are indexed as they are added, so
+        // need adding back in when starting again.
+        if (m_particleHitIndex.empty()) {
+            m_particleHitIndexSize = 0;
+            for (size_t i = 0; i < m_particleHits.size(); ++i) {
+                if (!m_particleHits[i].getId().empty())
+                    m_particleHitIndex.emplace(m_particleHits[i].getId(), -static_cast<int64_t>(i) - 1);
+            }
+        }
+
+        for (size_t i = m_particleHitIndexSize; i < m_hits.size(); ++i) {
+            if (!m_hits[i].getId().empty())
+                m_particleHitIndex[m_hits[i].getId()] = i;
+        }
+        m_particleHitIndexSize = m_hits.size();
+    }
+
+    mutable std::shared_ptr<const ParticleHierarchy> m_hierarchy;
+
+    std::unordered_map<std::string, int64_t> m_particleHitIndex;
+    size_t m_particleHitIndexSize = 0;
+
     std::unordered_map<std::string, Hit *> m_hitIdCache;
     size_t m_hitIdCacheSize = 0;
+    std::array<const Hit *, 2> m_hitIdCacheBlocks = {nullptr, nullptr};
 };
 
 using EventStates = std::map<int, EventState>;
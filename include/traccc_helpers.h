@@ -110,6 +110,8 @@ static void addSpacepoints(const traccc::edm::spacepoint_collection::const_view
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     Hits hits;
 
     const traccc::edm::spacepoint_collection::const_device spacePointsView{spacePoints};
@@ -136,6 +138,8 @@ static void addSeeds(const traccc::edm::seed_collection::const_view &seeds,
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     Particles hepSeeds;
 
     // Create a device collection around the seed container view.
@@ -172,6 +176,8 @@ addTrackCandidates(const traccc::edm::track_candidate_collection<traccc::default
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     Particles hepTracks;
 
     // Create a device collection around the track container view.
@@ -228,6 +234,8 @@ static void addTracks(const traccc::track_state_container_types::const_view &tra
     if (!isServerInitialised())
         return;
 
+    const ServerUpdateLock lock;
+
     Particles hepTracks;
 
     // Create a device collection around the track container view.
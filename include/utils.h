@@ -14,8 +14,18 @@ using json = nlohmann::json;
 #include "extern/rapidjson/stringbuffer.h"
 #include "extern/rapidjson/writer.h"
 
+// Compressed output needs zlib, which is only used if asked for.
+// httplib's own zlib support implies it is available.
+#if defined(HEP_EVD_ZLIB_SUPPORT) || defined(CPPHTTPLIB_ZLIB_SUPPORT)
+#define HEP_EVD_HAS_ZLIB 1
+#include <zlib.h>
+#endif
+
 #include <algorithm>
 #include <array>
+#include <cmath>
+#include <cstdint>
+#include <fstream>
 #include <functional>
 #include <future>
 #include <iostream>
@@ -24,24 +34,108 @@ using json = nlohmann::json;
 #include <ostream>
 #include <random>
 #include <sstream>
+#include <stdexcept>
+#include <string_view>
+#include <utility>
 
 namespace HepEVD {
 
 using PosArray = std::array<double, 3>;
 
+// Define the JSON serialization of an enum, along with a constexpr
+// enumToString overload built from the same name table. This avoids going
+// through a temporary nlohmann::json object when writing JSON by hand.
+// As with the nlohmann version, unknown values map to the first name.
+#define HEP_EVD_SERIALIZE_ENUM(ENUM_TYPE, ...)                                                                       \
+    NLOHMANN_JSON_SERIALIZE_ENUM(ENUM_TYPE, __VA_ARGS__)                                                             \
+    inline constexpr std::string_view enumToString(const ENUM_TYPE enumValue) {                                      \
+        constexpr std::pair<ENUM_TYPE, std::string_view> names[] = __VA_ARGS__;                                      \
+        for (const auto &name : names) {                                                                             \
+            if (name.first == enumValue)                                                                             \
+                return name.second;                                                                                  \
+        }                                                                                                            \
+        return names[0].second;                                                                                      \
+    }
+
 enum HitDimension { THREE_D, TWO_D };
-NLOHMANN_JSON_SERIALIZE_ENUM(HitDimension, {{THREE_D, "3D"}, {TWO_D, "2D"}});
+HEP_EVD_SERIALIZE_ENUM(HitDimension, {{THREE_D, "3D"}, {TWO_D, "2D"}});
 
 enum HitType { GENERAL, TWO_D_U, TWO_D_V, TWO_D_W };
-NLOHMANN_JSON_SERIALIZE_ENUM(HitType,
-                             {{GENERAL, "Hit"}, {TWO_D_U, "U View"}, {TWO_D_V, "V View"}, {TWO_D_W, "W View"}});
+HEP_EVD_SERIALIZE_ENUM(HitType, {{GENERAL, "Hit"}, {TWO_D_U, "U View"}, {TWO_D_V, "V View"}, {TWO_D_W, "W View"}});
 
 enum class PropertyType { CATEGORIC, NUMERIC };
-NLOHMANN_JSON_SERIALIZE_ENUM(PropertyType,
-                             {{PropertyType::CATEGORIC, "CATEGORIC"}, {PropertyType::NUMERIC, "NUMERIC"}});
+HEP_EVD_SERIALIZE_ENUM(PropertyType, {{PropertyType::CATEGORIC, "CATEGORIC"}, {PropertyType::NUMERIC, "NUMERIC"}});
+
+// Write an enum as a JSON string, using its enumToString table.
+template <typename WriterType, typename EnumType> inline void writeEnumJson(WriterType &writer, const EnumType value) {
+    const std::string_view name = enumToString(value);
+    writer.String(name.data(), static_cast<rapidjson::SizeType>(name.size()));
+}
+
+// How many decimal places to use when writing numbers out as JSON.
+// -1 keeps the full, round-trippable precision, which is the default.
+// Values are rounded first, so 0.01 cm steps can be written as "positionDecimals = 2".
+// Past 15 decimal places a double has nothing left to round.
+struct OutputPrecision {
+    static constexpr int MAX_DECIMALS = 15;
+
+    int positionDecimals = -1;
+    int energyDecimals = -1;
+
+    bool isDefault() const { return positionDecimals < 0 && energyDecimals < 0; }
+    bool isValid() const {
+        return positionDecimals >= -1 && positionDecimals <= MAX_DECIMALS && energyDecimals >= -1 &&
+               energyDecimals <= MAX_DECIMALS;
+    }
+};
+
+// A RapidJSON writer that carries an output precision along with it, so
+// the writeJson methods can pick it up without changing their signature.
+template <typename OutputStream> class JsonWriter : public rapidjson::Writer<OutputStream> {
+  public:
+    JsonWriter(OutputStream &os, const OutputPrecision &precision = OutputPrecision())
+        : rapidjson::Writer<OutputStream>(os), m_precision(precision) {}
+
+    const OutputPrecision &getPrecision() const { return m_precision; }
+
+  private:
+    OutputPrecision m_precision;
+};
 
-// Forward declare enumToString, so we can use it in Position.
-template <typename EnumType> static inline std::string enumToString(const EnumType &enumValue);
+// Any other writer just uses full precision.
+template <typename WriterType> inline OutputPrecision getOutputPrecision(const WriterType &) {
+    return OutputPrecision();
+}
+template <typename OutputStream> inline OutputPrecision getOutputPrecision(const JsonWriter<OutputStream> &writer) {
+    return writer.getPrecision();
+}
+
+// Write a double rounded to the given number of decimal places, if any.
+template <typename WriterType> inline void writeDoubleJson(WriterType &writer, const double value, const int decimals) {
+    if (decimals < 0 || !std::isfinite(value)) {
+        writer.Double(value);
+        return;
+    }
+
+    // Very large values can't be scaled up to round them, but they don't
+    // have any decimal places to remove either.
+    const int places = std::min(decimals, OutputPrecision::MAX_DECIMALS);
+    const double scale = std::pow(10.0, places);
+    if (!std::isfinite(value * scale)) {
+        writer.Double(value);
+        return;
+    }
+
+    writer.SetMaxDecimalPlaces(places);
+    writer.Double(std::round(value * scale) / scale);
+    writer.SetMaxDecimalPlaces(WriterType::kDefaultMaxDecimalPlaces);
+}
+template <typename WriterType> inline void writePositionJson(WriterType &writer, const double value) {
+    writeDoubleJson(writer, value, getOutputPrecision(writer).positionDecimals);
+}
+template <typename WriterType> inline void writeEnergyJson(WriterType &writer, const double value) {
+    writeDoubleJson(writer, value, getOutputPrecision(writer).energyDecimals);
+}
 
 // Store a 3D position, and include a helper for JSON production.
 class Position {
@@ -87,18 +181,17 @@ class Position {
 
         const bool is2D = this->dim == TWO_D;
         writer.Key("x");
-        writer.Double(this->x);
+        writePositionJson(writer, this->x);
         writer.Key("y");
-        writer.Double(is2D ? this->z : this->y);
+        writePositionJson(writer, is2D ? this->z : this->y);
         writer.Key("z");
-        writer.Double(is2D ? 0.0 : this->z);
+        writePositionJson(writer, is2D ? 0.0 : this->z);
 
         writer.Key("dim");
         writer.String(is2D ? "2D" : "3D");
 
         writer.Key("hitType");
-        writer.String(enumToString(this->hitType).c_str(),
-                      static_cast<rapidjson::SizeType>(enumToString(this->hitType).length()));
+        writeEnumJson(writer, this->hitType);
 
         writer.EndObject();
     }
@@ -154,19 +247,26 @@ template <typename T> bool postData(const std::string &endPoint, const T &data)
 }
 
 // Very basic UUID generator.
+// Every hit gets one of these, so the generator is only seeded once per
+// thread, rather than reading from the random device on every call.
 static std::string getUUID() {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, 15);
+    thread_local std::mt19937_64 gen = []() {
+        std::random_device rd;
+        std::seed_seq seed{rd(), rd(), rd(), rd(), rd(), rd(), rd(), rd()};
+        return std::mt19937_64(seed);
+    }();
     const char *v = "0123456789abcdef";
     const bool dash[] = {0, 0, 0, 0, 1, 0, 1, 0, 1, 0, 1, 0, 0, 0, 0, 0};
+    const uint64_t bits[] = {gen(), gen()};
 
     std::string res;
+    res.reserve(36);
     for (int i = 0; i < 16; i++) {
         if (dash[i])
             res += "-";
-        res += v[dis(gen)];
-        res += v[dis(gen)];
+        const uint64_t byte = (bits[i / 8] >> (8 * (i % 8))) & 0xFF;
+        res += v[byte >> 4];
+        res += v[byte & 15];
     }
 
     return res;
@@ -182,6 +282,108 @@ static std::string getCWD() {
     return "";
 }
 
+// Heap memory used by a string, beyond the string object itself.
+// Short strings are stored inside the object, so use nothing extra.
+inline size_t getStringMemoryUsage(const std::string &str) {
+    const uintptr_t object = reinterpret_cast<uintptr_t>(&str);
+    const uintptr_t data = reinterpret_cast<uintptr_t>(str.data());
+    const bool isShort = data >= object && data < object + sizeof(std::string);
+    return isShort ? 0 : str.capacity() + 1;
+}
+
+// An output file, that is optionally gzip compressed as it is written.
+class OutputFile {
+  public:
+    OutputFile(const std::string &path, const bool compress = false) : m_compress(compress) {
+        if (compress) {
+#ifdef HEP_EVD_HAS_ZLIB
+            m_gzFile = gzopen(path.c_str(), "wb");
+            if (m_gzFile == nullptr)
+                throw std::runtime_error("Could not open " + path + " for writing");
+            return;
+#else
+            throw std::invalid_argument("HepEVD was built without zlib, so can't compress output");
+#endif
+        }
+
+        m_file.open(path, std::ios::binary);
+        if (!m_file)
+            throw std::runtime_error("Could not open " + path + " for writing");
+    }
+    // Errors can't be reported from here, so anything that needs them
+    // reported should call close itself.
+    ~OutputFile() {
+        try {
+            this->close();
+        } catch (const std::exception &) {
+        }
+    }
+
+    OutputFile(const OutputFile &) = delete;
+    OutputFile &operator=(const OutputFile &) = delete;
+
+    void write(std::string_view data) {
+        m_bytesWritten += data.size();
+
+#ifdef HEP_EVD_HAS_ZLIB
+        if (m_compress) {
+            // gzwrite takes an unsigned int length, so large writes are split up.
+            while (!data.empty()) {
+                const unsigned int chunk = std::min<size_t>(data.size(), GZ_CHUNK_SIZE);
+                if (gzwrite(m_gzFile, data.data(), chunk) != static_cast<int>(chunk))
+                    throw std::runtime_error("Failed to write compressed output");
+                data.remove_prefix(chunk);
+            }
+            return;
+        }
+#endif
+
+        m_file.write(data.data(), data.size());
+        if (!m_file)
+            throw std::runtime_error("Failed to write output");
+    }
+
+    // Flush and close the file, throwing if anything couldn't be written.
+    void close() {
+#ifdef HEP_EVD_HAS_ZLIB
+        if (m_gzFile != nullptr) {
+            const int result = gzclose(m_gzFile);
+            m_gzFile = nullptr;
+
+            if (result != Z_OK)
+                throw std::runtime_error("Failed to write compressed output");
+        }
+#endif
+        if (m_file.is_open()) {
+            m_file.close();
+
+            if (!m_file)
+                throw std::runtime_error("Failed to write output");
+        }
+    }
+
+    static bool supportsCompression() {
+#ifdef HEP_EVD_HAS_ZLIB
+        return true;
+#else
+        return false;
+#endif
+    }
+
+    // Uncompressed size of everything written so far.
+    size_t getBytesWritten() const { return m_bytesWritten; }
+
+  private:
+    static constexpr size_t GZ_CHUNK_SIZE = 1 << 30;
+
+    bool m_compress;
+    size_t m_bytesWritten = 0;
+    std::ofstream m_file;
+#ifdef HEP_EVD_HAS_ZLIB
+    gzFile m_gzFile = nullptr;
+#endif
+};
+
 // A basic map of PDG codes to particle names in LaTeX, and if they are visible
 // in the detector.  This is used to provide a human-readable name for
 // particles.
@@ -251,6 +453,21 @@ static inline bool portInUse(const int port) {
     return std::system(cmd.c_str()) == 0;
 }
 
+// Set on threads that are already one of several parallel workers, so that
+// any parallel_process they call runs on that thread, rather than multiplying
+// the number of threads.
+inline thread_local bool isParallelWorker = false;
+
+// Marks the current thread as a parallel worker (or not) while in scope.
+class ParallelWorkerScope {
+  public:
+    ParallelWorkerScope(const bool isWorker = true) : m_previous(isParallelWorker) { isParallelWorker = isWorker; }
+    ~ParallelWorkerScope() { isParallelWorker = m_previous; }
+
+  private:
+    bool m_previous;
+};
+
 // Processes elements of a container in parallel using multiple threads.
 //
 // Splits the container into chunks and applies a processing function to each chunk
@@ -273,7 +490,7 @@ std::vector<ResultType> parallel_process(const Container &container, Func proces
 
     // Avoid over-threading for small workloads.
     size_t min_items_per_thread = 50;
-    if (num_items < num_threads * min_items_per_thread) {
+    if (num_items < num_threads * min_items_per_thread || isParallelWorker) {
         num_threads = 1;
     }
 
@@ -298,7 +515,10 @@ std::vector<ResultType> parallel_process(const Container &container, Func proces
         auto chunk_end = std::next(chunk_begin, current_chunk_size);
 
         // Launch async task, passing the process_chunk function
-        futures.push_back(std::async(std::launch::async, process_chunk, chunk_begin, chunk_end));
+        futures.push_back(std::async(std::launch::async, [&process_chunk, chunk_begin, chunk_end]() {
+            const ParallelWorkerScope scope;
+            return process_chunk(chunk_begin, chunk_end);
+        }));
     }
 
     // Collect results from all threads
@@ -311,17 +531,20 @@ std::vector<ResultType> parallel_process(const Container &container, Func proces
 }
 
 // Given a container, process its element into a JSON string, using multiple threads.
-template <typename Container> std::string parallel_to_json_array(const Container &container) {
+// Each element is written with the given function, which takes the writer and the element.
+template <typename Container, typename WriteFunc>
+std::string parallel_to_json_array(const Container &container, WriteFunc write_item,
+                                   const OutputPrecision &precision = OutputPrecision()) {
     // Define a lambda to process one chunk and return a JSON array string
     auto process_chunk = [&](typename Container::const_iterator begin,
                              typename Container::const_iterator end) -> std::string {
         rapidjson::StringBuffer s;
-        rapidjson::Writer<rapidjson::StringBuffer> writer(s);
+        JsonWriter<rapidjson::StringBuffer> writer(s, precision);
 
         writer.StartArray();
         for (auto it = begin; it != end; ++it) {
             const auto &item = *it;
-            item.writeJson(writer);
+            write_item(writer, item);
         }
         writer.EndArray();
 
@@ -363,11 +586,11 @@ template <typename Container> std::string parallel_to_json_array(const Container
     return final_json_stream.str();
 }
 
-// Basic helper to convert an enum to a string for JSON output.
-// Relies on nlohmann::json serialization of the enum.
-template <typename EnumType> static inline std::string enumToString(const EnumType &enumValue) {
-    json j = enumValue;
-    return j.get<std::string>();
+// By default, use the writeJson method of each element.
+template <typename Container>
+std::string parallel_to_json_array(const Container &container, const OutputPrecision &precision = OutputPrecision()) {
+    return parallel_to_json_array(
+        container, [](auto &writer, const auto &item) { item.writeJson(writer); }, precision);
 }
 
 }; // namespace HepEVD
@@ -19,6 +19,7 @@
 #include "include/hits.hpp"
 #include "include/markers.hpp"
 #include "include/particles.hpp"
+#include "include/states.hpp"
 
 namespace nb = nanobind;
 
@@ -63,16 +64,51 @@ NB_MODULE(_hepevd_impl, m) {
     m.def("is_initialised", &HepEVD::isServerInitialised,
           "Checks if the server is initialised - i.e. does a server exists, with the geometry set?",
           nb::arg("quiet") = false);
-    m.def("start_server", &HepEVD_py::start_server, "Starts the HepEVD server", nb::arg("start_state") = -1,
-          nb::arg("clear_on_show") = true);
+    m.def("start_server", &HepEVD_py::start_server,
+          "Starts the HepEVD server.\n"
+          "By default, this blocks until the server is closed. With background set, the server runs on its own "
+          "thread instead and this returns straight away, such that states can still be added and are shown live "
+          "(i.e. from a notebook). Nothing is cleared in that case, and stop_server can be used to stop it.",
+          nb::arg("start_state") = -1, nb::arg("clear_on_show") = true, nb::arg("background") = false);
+    m.def("stop_server", &HepEVD_py::stop_server, "Stops the HepEVD server, if it is running in the background");
     m.def("set_verbose", &HepEVD::setVerboseLogging, "Sets the verbosity of the HepEVD server", nb::arg("verbose"));
+    m.def("set_output_precision", &HepEVD::setOutputPrecision, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Limits the number of decimal places used for hit positions and energies in the server output.\n"
+          "-1 keeps the full precision, and at most 15 decimal places can be used. The geometry must be set first.",
+          nb::arg("position_decimals"), nb::arg("energy_decimals") = -1);
 
-    m.def("save_state", &HepEVD::saveState, "Saves the current state", nb::arg("state_name"), nb::arg("min_size") = -1,
-          nb::arg("clear_on_show") = true);
-    m.def("reset_server", &HepEVD::resetServer, "Resets the server", nb::arg("reset_geo") = false);
+    m.def("save_state", &HepEVD::saveState, nb::call_guard<HepEVD_py::UpdateGuard>(), "Saves the current state",
+          nb::arg("state_name"), nb::arg("min_size") = -1, nb::arg("clear_on_show") = true);
+    m.def("reset_server", &HepEVD::resetServer, nb::call_guard<HepEVD_py::UpdateGuard>(), "Resets the server",
+          nb::arg("reset_geo") = false);
+    m.def("set_memory_budget", &HepEVD::setMemoryBudget, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Limits the memory used by saved states, in megabytes, spilling the least recently used ones to disk.\n"
+          "A budget of 0 removes the limit. The current and newest states always stay in memory.",
+          nb::arg("megabytes"), nb::arg("spill_directory") = "");
+    m.def("set_state_compression", &HepEVD::setStateCompression, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Keeps every state other than the current and newest compressed in memory, decompressing them when viewed",
+          nb::arg("compress"));
+    m.def("write_archive", &HepEVD::writeArchive, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Writes every state to a single binary archive file, without needing to start the server",
+          nb::arg("path"));
 
-    m.def("set_mc_string", &set_mc_string, "Sets the current MC interaction string", nb::arg("mc_string"));
-    m.def("set_config", &load_config,
+    // Build states in other processes, and merge them in.
+    HepEVD_py::init_state_classes(m);
+    m.def("get_state", &HepEVD_py::get_state, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Gets the current state, in a compact binary form that can be pickled.\n"
+          "This allows states to be built in parallel, in the worker processes of a multiprocessing "
+          "or concurrent.futures pool, each with their own geometry set, and then returned to be merged "
+          "into the server's process with merge_states.\n"
+          "If a name is given, the state is named that first, as with save_state.",
+          nb::arg("name") = "", nb::sig("def get_state(name: str = '') -> EventState | None"));
+    m.def("merge_states", &HepEVD_py::merge_states, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Adds every given state, as returned by get_state, to the server, after any existing states.\n"
+          "The states are decoded in parallel. Any state currently being built is kept, after the merged states.",
+          nb::arg("states"), nb::sig("def merge_states(states: collections.abc.Iterable[EventState]) -> None"));
+
+    m.def("set_mc_string", &set_mc_string, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Sets the current MC interaction string", nb::arg("mc_string"));
+    m.def("set_config", &load_config, nb::call_guard<HepEVD_py::UpdateGuard>(),
           "Sets any top level config options for the server.\n"
           "This can include the following:\n"
           "  - show2D (default: 1)\n"
@@ -85,49 +121,102 @@ NB_MODULE(_hepevd_impl, m) {
 
     // Set the current HepEVD geometry.
     // Input will either be a string or a list/array of numbers.
-    m.def("set_geometry", &HepEVD_py::set_geometry, "Sets the geometry of the server", nb::arg("geometry"),
+    m.def("set_geometry", &HepEVD_py::set_geometry, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Sets the geometry of the server", nb::arg("geometry"),
           nb::sig("def set_geometry(geometry: typing.Union[str, "
                   "collections.abc.Collection[collections.abc.Collection[float | int]]]) -> None"));
 
-    m.def("add_hits", &HepEVD_py::add_hits<HepEVD::Hit>,
+    m.def("add_hits", &HepEVD_py::add_hits<HepEVD::Hit>, nb::call_guard<HepEVD_py::UpdateGuard>(),
           "Adds hits to the current event state.\n"
           "Hits must be passed as an (NHits, Y) list or array, with the columns being "
           "(x, y, z, energy) and two optional columns (view, dimension) for the hit type and dimension.\n"
-          "The view and dimension values must be from the HepEVD.HitType and HepEVD.HitDimension enums respectively.",
-          nb::arg("hits"), nb::arg("label") = "",
+          "The view and dimension values must be from the HepEVD.HitType and HepEVD.HitDimension enums respectively.\n"
+          "Arrays can be of any float or integer dtype and layout, and are read in place without a copy.\n"
+          "Arrow record batches and tables (PyArrow, Polars etc.) are also accepted, with the columns read by name: "
+          "x, y, z, energy and the optional view and dim, with any other numeric columns added as hit properties.\n"
+          "The same goes for a dict of columns, a NumPy structured array or a pandas / Polars dataframe, "
+          "with categorical columns added as categoric properties. NaN property values are left off that hit.\n"
+          "If return_handles is set, an array of an integer handle for each hit is returned, "
+          "which can be used with add_hit_properties_bulk.",
+          nb::arg("hits"), nb::arg("label") = "", nb::arg("return_handles") = false,
           nb::sig("def add_hits(hits: collections.abc.Collection[collections.abc.Collection[float | int | HitType | "
                   "HitDimension]], "
-                  "label: str = '') -> None"));
-    m.def("add_mc", &HepEVD_py::add_hits<HepEVD::MCHit>,
+                  "label: str = '', return_handles: bool = False) -> numpy.typing.NDArray[numpy.int64] | None"));
+    m.def("add_mc", &HepEVD_py::add_mc, nb::call_guard<HepEVD_py::UpdateGuard>(),
           "Adds MC hits to the current event state.\n"
           "Hits must be passed as an (NHits, Y) list or array, with the columns being "
           "(x, y, z, energy, PDG) and two optional columns (view, dimension) for the hit type and dimension.\n"
-          "The view and dimension values must be from the HepEVD.HitType and HepEVD.HitDimension enums respectively.",
+          "The view and dimension values must be from the HepEVD.HitType and HepEVD.HitDimension enums respectively.\n"
+          "Arrays can be of any float or integer dtype and layout, and are read in place without a copy.\n"
+          "Arrow record batches and tables (PyArrow, Polars etc.) are also accepted, with the columns read by name: "
+          "x, y, z, energy, pdg and the optional view and dim, with any other numeric columns added as hit "
+          "properties.\n"
+          "The same goes for a dict of columns, a NumPy structured array or a pandas / Polars dataframe.",
           nb::arg("mcHits"), nb::arg("label") = "",
           nb::sig("def add_mc(hits: collections.abc.Collection[collections.abc.Collection[float | int | HitType | "
                   "HitDimension]], "
                   "label: str = '') -> None"));
-    m.def("add_particles", &HepEVD_py::add_particles,
+    m.def("add_particles", &HepEVD_py::add_particles, nb::call_guard<HepEVD_py::UpdateGuard>(),
           "Adds particles to the current event state.\n"
           "Particles must be passed as an (NParticles, NHits, Y) list or array, with the columns being "
           "(x, y, z, energy) and two optional columns (view, dimension) for the hit type and dimension.\n"
-          "The view and dimension values must be from the HepEVD.HitType and HepEVD.HitDimension enums respectively.",
-          nb::arg("particles"), nb::arg("label") = "",
+          "The view and dimension values must be from the HepEVD.HitType and HepEVD.HitDimension enums respectively.\n"
+          "Alternatively, particles of different sizes can be passed as a flat (NHits, Y) array of every hit, "
+          "along with either the offsets of each particle's first hit (plus the end of the last particle), "
+          "or the number of hits in each particle, as produced by awkward-array. Every hit must be in a particle.\n"
+          "The flat hits can also be an Arrow record batch or table, as in add_hits.\n"
+          "Parents can optionally be given as the index of each particle's parent, or -1 if it has none.",
+          nb::arg("particles"), nb::arg("label") = "", nb::arg("offsets") = nb::none(), nb::arg("counts") = nb::none(),
+          nb::arg("parents") = nb::none(),
           nb::sig("def add_particles(particles: "
                   "collections.abc.Collection[collections.abc.Collection[collections.abc.Collection[float | int | "
-                  "HitType | HitDimension]]], label: str = '') -> None"));
-    m.def("add_hit_properties", &HepEVD_py::set_hit_properties,
+                  "HitType | HitDimension]]] | collections.abc.Collection[collections.abc.Collection[float | int | "
+                  "HitType | HitDimension]], label: str = '', "
+                  "offsets: collections.abc.Collection[int] | None = None, "
+                  "counts: collections.abc.Collection[int] | None = None, "
+                  "parents: collections.abc.Collection[int] | None = None) -> None"));
+    m.def("get_hits", &HepEVD_py::get_hits<HepEVD::Hit>, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Gets the hits of the current event state, as an (NHits, 6) array of "
+          "(x, y, z, energy, dimension, view), the same layout add_hits takes, along with a dictionary of "
+          "an array per property, with NaN for any hits without that property.",
+          nb::sig("def get_hits() -> tuple[numpy.typing.NDArray[numpy.float64], "
+                  "dict[str, numpy.typing.NDArray[numpy.float64]]] | None"));
+    m.def("get_mc", &HepEVD_py::get_hits<HepEVD::MCHit>, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Gets the MC hits of the current event state, as an (NHits, 7) array of "
+          "(x, y, z, energy, PDG, dimension, view), the same layout add_mc takes, along with a dictionary of "
+          "an array per property, with NaN for any hits without that property.",
+          nb::sig("def get_mc() -> tuple[numpy.typing.NDArray[numpy.float64], "
+                  "dict[str, numpy.typing.NDArray[numpy.float64]]] | None"));
+    m.def("get_particles", &HepEVD_py::get_particles, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Gets the particles of the current event state, as a flat (NHits, 6) array of every particle hit, "
+          "the offsets of each particle's first hit (plus the end of the last particle) and the index of "
+          "each particle's parent (or -1), the same layout add_particles takes, along with a dictionary of "
+          "an array per hit property.",
+          nb::sig("def get_particles() -> tuple[numpy.typing.NDArray[numpy.float64], "
+                  "numpy.typing.NDArray[numpy.int64], numpy.typing.NDArray[numpy.int64], "
+                  "dict[str, numpy.typing.NDArray[numpy.float64]]] | None"));
+    m.def("add_hit_properties", &HepEVD_py::set_hit_properties, nb::call_guard<HepEVD_py::UpdateGuard>(),
           "Add custom properties to a hit, via a string / double dictionary.\n"
           "The hit must be passed as a (x, y, z, energy) list or array.",
           nb::arg("hit"), nb::arg("properties"),
           nb::sig("def add_hit_properties(hit: collections.abc.Collection[float | int], properties: "
                   "typing.Dict[float | int]) "
                   "-> None"));
-    m.def("add_markers", &HepEVD_py::add_markers,
+    m.def("add_hit_properties_bulk", &HepEVD_py::set_hit_properties_bulk, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Add whole columns of custom properties to many hits at once.\n"
+          "The hits must be given by the handles returned from add_hits(..., return_handles=True), "
+          "and each property by a list, array or series with one value per hit.\n"
+          "Categorical pandas / Polars series are added as categoric properties, with the category code as the value.\n"
+          "Handles are only valid for the state the hits were added to.",
+          nb::arg("handles"), nb::arg("properties"),
+          nb::sig("def add_hit_properties_bulk(handles: collections.abc.Collection[int], properties: "
+                  "typing.Dict[str, collections.abc.Collection[float | int]]) -> None"));
+    m.def("add_markers", &HepEVD_py::add_markers, nb::call_guard<HepEVD_py::UpdateGuard>(),
           "Adds markers to the current event state.\n"
           "Markers must be passed as a list or array of marker objects."
           "The various marker types are Point, Line and Ring."
-          "Any required parameters (labels, colours, hit dims etc), should be applied to the underlying object.",
+          "Any required parameters (labels, colours, hit dims etc), should be applied to the underlying object.\n"
+          "For many markers at once, add_points, add_lines and add_rings are much faster.",
           nb::arg("markers"), nb::sig("def add_markers(markers: collections.abc.Collection[HepEVD.Marker]) -> None"));
 
     // Add enums
@@ -146,6 +235,39 @@ NB_MODULE(_hepevd_impl, m) {
 
     // Add marker classes
     HepEVD_py::init_marker_classes(m);
+
+    // Array based marker functions, after the enums they default to.
+    m.def("add_points", &HepEVD_py::add_points, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Adds a Point marker for every row of an (N, 3) list or array of positions, in one go.\n"
+          "Colours and labels can be a single string for every point, or one per point.",
+          nb::arg("positions"), nb::arg("colours") = nb::none(), nb::arg("labels") = nb::none(),
+          nb::arg("dim") = HepEVD::HitDimension::THREE_D, nb::arg("view") = HepEVD::HitType::GENERAL,
+          nb::sig("def add_points(positions: collections.abc.Collection[collections.abc.Collection[float | int]], "
+                  "colours: str | collections.abc.Collection[str] | None = None, "
+                  "labels: str | collections.abc.Collection[str] | None = None, "
+                  "dim: HitDimension = HitDimension.THREE_D, view: HitType = HitType.GENERAL) -> None"));
+    m.def("add_lines", &HepEVD_py::add_lines, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Adds a Line marker between every row of two (N, 3) lists or arrays of start and end positions, in one go.\n"
+          "Colours and labels can be a single string for every line, or one per line.",
+          nb::arg("starts"), nb::arg("ends"), nb::arg("colours") = nb::none(), nb::arg("labels") = nb::none(),
+          nb::arg("dim") = HepEVD::HitDimension::THREE_D, nb::arg("view") = HepEVD::HitType::GENERAL,
+          nb::sig("def add_lines(starts: collections.abc.Collection[collections.abc.Collection[float | int]], "
+                  "ends: collections.abc.Collection[collections.abc.Collection[float | int]], "
+                  "colours: str | collections.abc.Collection[str] | None = None, "
+                  "labels: str | collections.abc.Collection[str] | None = None, "
+                  "dim: HitDimension = HitDimension.THREE_D, view: HitType = HitType.GENERAL) -> None"));
+    m.def("add_rings", &HepEVD_py::add_rings, nb::call_guard<HepEVD_py::UpdateGuard>(),
+          "Adds a Ring marker around every row of an (N, 3) list or array of centres, in one go.\n"
+          "The inner and outer radii can be a single number for every ring, or one per ring, "
+          "as can the colours and labels.",
+          nb::arg("centres"), nb::arg("inner"), nb::arg("outer"), nb::arg("colours") = nb::none(),
+          nb::arg("labels") = nb::none(), nb::arg("dim") = HepEVD::HitDimension::THREE_D,
+          nb::arg("view") = HepEVD::HitType::GENERAL,
+          nb::sig("def add_rings(centres: collections.abc.Collection[collections.abc.Collection[float | int]], "
+                  "inner: float | collections.abc.Collection[float], outer: float | collections.abc.Collection[float], "
+                  "colours: str | collections.abc.Collection[str] | None = None, "
+                  "labels: str | collections.abc.Collection[str] | None = None, "
+                  "dim: HitDimension = HitDimension.THREE_D, view: HitType = HitType.GENERAL) -> None"));
 }
 
 #endif // HEP_EVD_PYTHON_H
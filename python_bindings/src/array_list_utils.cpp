@@ -8,9 +8,13 @@
 // Local Includes
 #include "include/array_list_utils.hpp"
 
+// Standard includes
+#include <limits>
+
 // Include nanobind
 #include <nanobind/nanobind.h>
 #include <nanobind/ndarray.h>
+#include <nanobind/stl/string.h>
 
 namespace nb = nanobind;
 
@@ -18,6 +22,8 @@ namespace HepEVD_py {
 
 bool isArrayOrList(nb::handle obj) { return nb::isinstance<nb::list>(obj) || nb::isinstance<nb::ndarray<>>(obj); }
 
+bool isArrow(nb::handle obj) { return nb::hasattr(obj, "__arrow_c_array__") || nb::hasattr(obj, "__arrow_c_stream__"); }
+
 std::vector<double> getItems(nb::handle obj, int index, int size) {
 
     if (!isArrayOrList(obj))
@@ -97,4 +103,110 @@ BasicSizeInfo getBasicSizeInfo(nb::handle obj) {
     throw std::runtime_error("HepEVD: Unknown input type!");
 }
 
+// Read a 1D list/array into a vector of the given type.
+template <typename T> std::vector<T> getValues(nb::handle obj, const std::string &name) {
+
+    if (nb::isinstance<nb::ndarray<>>(obj)) {
+        const auto array = nb::cast<nb::ndarray<>>(obj);
+
+        if (array.ndim() != 1)
+            throw std::runtime_error("HepEVD: " + name + " must be a 1D array");
+
+        std::vector<T> values(array.shape(0));
+        visitArray(array, [&](const auto &view) {
+            for (size_t i = 0; i < values.size(); i++)
+                values[i] = static_cast<T>(view(i, 0));
+        });
+
+        return values;
+    } else if (nb::isinstance<nb::list>(obj)) {
+        nb::list list = nb::cast<nb::list>(obj);
+
+        std::vector<T> values;
+        values.reserve(list.size());
+
+        for (auto item : list)
+            values.push_back(nb::cast<T>(item));
+
+        return values;
+    } else if (isArrow(obj)) {
+        const std::vector<double> values = readArrow(obj, HepEVD::valuesFromArrow, HepEVD::valuesFromArrowStream);
+        return std::vector<T>(values.begin(), values.end());
+    }
+
+    throw std::runtime_error("HepEVD: " + name + " must be an array, list or Arrow array");
+}
+
+std::vector<int64_t> getIndices(nb::handle obj, const std::string &name) { return getValues<int64_t>(obj, name); }
+
+std::vector<double> getColumn(nb::handle obj, const std::string &name) { return getValues<double>(obj, name); }
+
+bool isNamedColumns(nb::handle obj) {
+    const bool isStructured = nb::hasattr(obj, "dtype") && nb::hasattr(obj.attr("dtype"), "names") &&
+                              !obj.attr("dtype").attr("names").is_none();
+    return nb::isinstance<nb::dict>(obj) || isStructured || nb::hasattr(obj, "columns");
+}
+
+// Check a column's dtype for a pandas / Polars categorical, or a PyArrow dictionary.
+bool isCategorical(nb::handle column) {
+    const char *typeAttr = nb::hasattr(column, "dtype") ? "dtype" : "type";
+    if (!nb::hasattr(column, typeAttr))
+        return false;
+
+    const std::string type = nb::cast<std::string>(nb::str(column.attr(typeAttr)));
+    return type == "category" || type.rfind("Categorical", 0) == 0 || type.rfind("Enum", 0) == 0 ||
+           type.rfind("dictionary<", 0) == 0;
+}
+
+NamedColumn getNamedColumn(nb::handle column, const std::string &name) {
+
+    const bool categoric = isCategorical(column);
+    nb::object values = nb::borrow(column);
+
+    if (categoric && nb::hasattr(column, "cat") && nb::hasattr(column.attr("cat"), "codes"))
+        values = column.attr("cat").attr("codes"); // pandas
+    else if (categoric && nb::hasattr(column, "to_physical"))
+        values = column.attr("to_physical")(); // Polars
+    else if (categoric && nb::hasattr(column, "indices"))
+        values = column.attr("indices"); // PyArrow
+
+    // Series are read through NumPy, which is a view for numeric columns.
+    if (!isArrayOrList(values) && nb::hasattr(values, "to_numpy"))
+        values = values.attr("to_numpy")();
+
+    // Fields of a structured array are strided by the whole record, which can't
+    // always be read in place, so fall back to a copy.
+    if (!isArrayOrList(values) && !isArrow(values) && nb::hasattr(values, "copy"))
+        values = values.attr("copy")();
+
+    NamedColumn namedColumn{name, getColumn(values, "Column " + name), categoric};
+
+    // Missing categories are coded as -1 by pandas, so mark them as such.
+    if (categoric) {
+        for (double &value : namedColumn.values)
+            value = value < 0 ? std::numeric_limits<double>::quiet_NaN() : value;
+    }
+
+    return namedColumn;
+}
+
+std::vector<NamedColumn> getNamedColumns(nb::handle obj) {
+
+    std::vector<NamedColumn> columns;
+
+    if (nb::isinstance<nb::dict>(obj)) {
+        for (auto item : nb::cast<nb::dict>(obj))
+            columns.push_back(getNamedColumn(item.second, nb::cast<std::string>(nb::str(item.first))));
+        return columns;
+    }
+
+    const bool isStructured = nb::hasattr(obj, "dtype") && !nb::hasattr(obj, "columns");
+    const nb::object names = isStructured ? obj.attr("dtype").attr("names") : obj.attr("columns");
+
+    for (nb::handle name : names)
+        columns.push_back(getNamedColumn(obj[name], nb::cast<std::string>(nb::str(name))));
+
+    return columns;
+}
+
 } // namespace HepEVD_py
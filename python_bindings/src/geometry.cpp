@@ -61,7 +61,11 @@ void set_geometry(nb::object geometry) {
 
     // Register the clear function for the hit map,
     // so we can clear it when we need to.
-    HepEVD::registerClearFunction([&]() { pythonHitMap.clear(); });
+    HepEVD::registerClearFunction([&]() {
+        pythonHitMap.clear();
+        pythonHitMapBlock = nullptr;
+        pythonHitMapSize = 0;
+    });
 }
 
 } // namespace HepEVD_py
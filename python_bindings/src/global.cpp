@@ -10,14 +10,16 @@
 
 namespace HepEVD_py {
 
-// We want to catch SIGINT, SIGTERM and SIGKILL and shut down the server
-// when that happens.
+// We want to catch SIGINT and SIGTERM and shut down the server
+// when that happens. SIGKILL can't be caught, so isn't tried.
 //
 // But we also don't want to interfere with other signals, when the server
 // is not running.
 //
 // So setup and teardown the signals here, around the server starting and finishing.
 typedef void (*sighandler_t)(int);
+const std::vector<int> caughtSignals = {SIGINT, SIGTERM};
+
 std::vector<sighandler_t> catch_signals() {
     auto handler = [](int code) {
         if (HepEVD::hepEVDServer != nullptr) {
@@ -29,23 +31,38 @@ std::vector<sighandler_t> catch_signals() {
 
     std::vector<sighandler_t> oldHandlers;
 
-    oldHandlers.push_back(signal(SIGINT, handler));
-    oldHandlers.push_back(signal(SIGTERM, handler));
-    oldHandlers.push_back(signal(SIGKILL, handler));
+    for (const int code : caughtSignals)
+        oldHandlers.push_back(signal(code, handler));
 
     return oldHandlers;
 }
 
 void revert_signals(std::vector<sighandler_t> oldHandlers) {
-    signal(SIGINT, oldHandlers[0]);
-    signal(SIGINT, oldHandlers[1]);
-    signal(SIGINT, oldHandlers[2]);
+    for (size_t i = 0; i < caughtSignals.size(); i++)
+        signal(caughtSignals[i], oldHandlers[i]);
 }
 
-void start_server(const int startState, const bool clearOnShow) {
+void start_server(const int startState, const bool clearOnShow, const bool background) {
+
+    // In the background, the signals are left to Python, and nothing is
+    // cleared, as the states can still be added to.
+    if (background) {
+        nb::gil_scoped_release release;
+        HepEVD::startServerInBackground(startState);
+        return;
+    }
+
     const auto oldHandlers = catch_signals();
-    HepEVD::startServer(startState, clearOnShow);
+    {
+        nb::gil_scoped_release release;
+        HepEVD::startServer(startState, clearOnShow);
+    }
     revert_signals(oldHandlers);
 }
 
+void stop_server() {
+    nb::gil_scoped_release release;
+    HepEVD::stopServer();
+}
+
 } // namespace HepEVD_py
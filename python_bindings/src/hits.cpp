@@ -3,7 +3,12 @@
 //
 
 // Standard includes
+#include <algorithm>
+#include <cmath>
+#include <iterator>
+#include <limits>
 #include <map>
+#include <numeric>
 #include <vector>
 
 // Include the HepEVD header files.
@@ -24,17 +29,19 @@ namespace nb = nanobind;
 
 namespace HepEVD_py {
 
-template <typename T>
-T processHitRow(const double *rowData, bool includesDimension, bool includesView, const std::string &label) {
+// Build a hit from a row, with the values read by the given function, which
+// takes the column index. This doesn't touch Python, so can be run without the GIL.
+template <typename T, typename GetValue>
+T processHitRow(GetValue getValue, bool includesDimension, bool includesView, const std::string &label) {
     int idx = 0;
-    double x = rowData[idx++];
-    double y = rowData[idx++];
-    double z = rowData[idx++];
-    double energy = rowData[idx++];
+    double x = getValue(idx++);
+    double y = getValue(idx++);
+    double z = getValue(idx++);
+    double energy = getValue(idx++);
 
-    double pdgCode = std::is_same_v<T, HepEVD::MCHit> ? rowData[idx++] : -1.0;
-    double dimension = includesDimension ? rowData[idx++] : -1.0;
-    double view = includesView ? rowData[idx++] : -1.0;
+    double pdgCode = std::is_same_v<T, HepEVD::MCHit> ? getValue(idx++) : -1.0;
+    double dimension = includesDimension ? getValue(idx++) : -1.0;
+    double view = includesView ? getValue(idx++) : -1.0;
 
     T hit = [&]() {
         if constexpr (std::is_same_v<T, HepEVD::MCHit>) {
@@ -44,9 +51,6 @@ T processHitRow(const double *rowData, bool includesDimension, bool includesView
         }
     }();
 
-    if constexpr (!std::is_same_v<T, HepEVD::MCHit>)
-        pythonHitMap[std::make_tuple(x, y, z, energy)] = hit.getId();
-
     if (includesDimension)
         hit.setDim(static_cast<HepEVD::HitDimension>(dimension));
 
@@ -59,13 +63,151 @@ T processHitRow(const double *rowData, bool includesDimension, bool includesView
     return hit;
 }
 
-template <typename T> void add_hits(nb::handle hits, std::string label) {
+// Build the hits from an array of any numeric dtype and strides, reading it in
+// place rather than converting it first, and building the hits in parallel.
+template <typename T>
+std::vector<T> getHitsFromArray(const nb::ndarray<> &array, bool includesDimension, bool includesView,
+                                const std::string &label) {
+    std::vector<T> hits;
 
-    if (!HepEVD::isServerInitialised())
-        return;
+    visitArray(array, [&](const auto &view) {
+        std::vector<size_t> rows(array.shape(0));
+        std::iota(rows.begin(), rows.end(), 0);
+
+        auto chunks = HepEVD::parallel_process(rows, [&](auto begin, auto end) {
+            std::vector<T> chunk;
+            chunk.reserve(std::distance(begin, end));
+
+            for (auto row = begin; row != end; ++row) {
+                const auto getValue = [&](const int col) { return view(*row, col); };
+                chunk.push_back(processHitRow<T>(getValue, includesDimension, includesView, label));
+            }
+
+            return chunk;
+        });
+
+        hits.reserve(rows.size());
+        for (auto &chunk : chunks)
+            std::move(chunk.begin(), chunk.end(), std::back_inserter(hits));
+    });
+
+    return hits;
+}
+
+// Add the hits to the server.
+// Returns the index of the first new hit in the current state.
+template <typename T> size_t addHitsToServer(std::vector<T> hits) {
+    if constexpr (std::is_same_v<T, HepEVD::MCHit>) {
+        HepEVD::hepEVDLog("Adding " + std::to_string(hits.size()) + " MC hits to the HepEVD server.");
+        HepEVD::getServer()->addMCHits(std::move(hits));
+        return 0;
+    } else {
+        const size_t firstHit = HepEVD::getServer()->getNumberOfHits();
+
+        HepEVD::hepEVDLog("Adding " + std::to_string(hits.size()) + " hits to the HepEVD server.");
+        HepEVD::getServer()->addHits(std::move(hits));
+        return firstHit;
+    }
+}
+
+// Build the hits from named columns, with any column beyond the usual
+// (x, y, z, energy, [pdg], [dim], [view]) added to every hit as a property.
+// NaN property values are taken as missing, so those hits don't get that property.
+template <typename T>
+std::vector<T> getHitsFromColumns(const std::vector<NamedColumn> &columns, const std::string &label) {
+
+    std::map<std::string, const NamedColumn *> columnsByName;
+    for (const auto &column : columns)
+        columnsByName[column.name] = &column;
+
+    std::vector<std::string> layout = {"x", "y", "z", "energy"};
+    if (std::is_same_v<T, HepEVD::MCHit>)
+        layout.push_back("pdg");
+
+    for (const auto &name : layout) {
+        if (columnsByName.count(name) == 0)
+            throw std::runtime_error("HepEVD: Hits are missing the " + name + " column");
+    }
+
+    const bool includesDimension = columnsByName.count("dim") != 0;
+    const bool includesView = columnsByName.count("view") != 0;
+    if (includesDimension)
+        layout.push_back("dim");
+    if (includesView)
+        layout.push_back("view");
+
+    std::vector<const NamedColumn *> layoutColumns;
+    for (const auto &name : layout)
+        layoutColumns.push_back(columnsByName.at(name));
+
+    std::vector<const NamedColumn *> properties;
+    for (const auto &column : columns) {
+        if (std::find(layout.begin(), layout.end(), column.name) == layout.end())
+            properties.push_back(&column);
+    }
+
+    const size_t numHits = layoutColumns.front()->values.size();
+    for (const auto &column : columns) {
+        if (column.values.size() != numHits)
+            throw std::runtime_error("HepEVD: Column " + column.name + " has " + std::to_string(column.values.size()) +
+                                     " values, not " + std::to_string(numHits));
+    }
+
+    std::vector<size_t> rows(numHits);
+    std::iota(rows.begin(), rows.end(), 0);
+
+    auto chunks = HepEVD::parallel_process(rows, [&](auto begin, auto end) {
+        std::vector<T> chunk;
+        chunk.reserve(std::distance(begin, end));
+
+        for (auto row = begin; row != end; ++row) {
+            const auto getValue = [&](const int col) { return layoutColumns[col]->values[*row]; };
+            T hit = processHitRow<T>(getValue, includesDimension, includesView, label);
+
+            for (const NamedColumn *property : properties) {
+                const double value = property->values[*row];
+                if (std::isnan(value))
+                    continue;
+
+                const auto type = property->categoric ? HepEVD::PropertyType::CATEGORIC : HepEVD::PropertyType::NUMERIC;
+                hit.addProperty({property->name, type}, value);
+            }
+
+            chunk.push_back(std::move(hit));
+        }
+
+        return chunk;
+    });
+
+    std::vector<T> hits;
+    hits.reserve(numHits);
+    for (auto &chunk : chunks)
+        std::move(chunk.begin(), chunk.end(), std::back_inserter(hits));
+
+    return hits;
+}
+
+template <typename T> std::vector<T> getHits(nb::handle hits, const std::string &label) {
+
+    // Arrow record batches and tables have named columns, so are read by name, in place.
+    if (!isArrayOrList(hits) && isArrow(hits)) {
+        return readArrow(
+            hits, [&](const ArrowSchema &schema, const ArrowArray &array) {
+                return HepEVD::hitsFromArrow<T>(schema, array, label);
+            },
+            [&](ArrowArrayStream &stream) { return HepEVD::hitsFromArrowStream<T>(stream, label); });
+    }
+
+    // As are dicts of columns, structured arrays, and dataframes without Arrow support.
+    if (!isArrayOrList(hits) && isNamedColumns(hits)) {
+        const std::vector<NamedColumn> columns = getNamedColumns(hits);
+
+        nb::gil_scoped_release release;
+        return getHitsFromColumns<T>(columns, label);
+    }
 
     if (!isArrayOrList(hits))
-        throw std::runtime_error("HepEVD: Hit must be an array or list");
+        throw std::runtime_error("HepEVD: Hits must be an array, list, dict of columns or table");
 
     BasicSizeInfo arraySize = getBasicSizeInfo(hits);
 
@@ -95,33 +237,66 @@ template <typename T> void add_hits(nb::handle hits, std::string label) {
     int rows = arraySize[0];
     int cols = arraySize[1];
 
+    // If it's an ndarray, read it in place, whatever its dtype and layout.
+    // Building the hits doesn't touch Python, so the GIL isn't needed.
+    if (nb::isinstance<nb::ndarray<>>(hits)) {
+        const auto array = nb::cast<nb::ndarray<>>(hits);
+
+        nb::gil_scoped_release release;
+        return getHitsFromArray<T>(array, includesDimension, includesView, label);
+    }
+
+    // Fall back to getItems for lists
     std::vector<T> hepEVDHits;
     hepEVDHits.reserve(rows);
 
-    // If it's an ndarray, process all data at once
-    if (nb::isinstance<nb::ndarray<>>(hits)) {
-        auto array = nb::cast<nb::ndarray<nb::numpy, double>>(hits);
-        const double *data = array.data();
+    for (int i = 0; i < rows; i++) {
+        const auto data = getItems(hits, i, cols);
+        const auto getValue = [&](const int col) { return data[col]; };
+        hepEVDHits.push_back(processHitRow<T>(getValue, includesDimension, includesView, label));
+    }
 
-        for (int i = 0; i < rows; i++) {
-            const double *row = data + (i * cols);
-            hepEVDHits.push_back(processHitRow<T>(row, includesDimension, includesView, label));
-        }
-    } else {
-        // Fall back to getItems for lists
-        for (int i = 0; i < rows; i++) {
-            auto data = getItems(hits, i, cols);
-            hepEVDHits.push_back(processHitRow<T>(data.data(), includesDimension, includesView, label));
-        }
+    return hepEVDHits;
+}
+
+template <typename T> nb::object add_hits(nb::handle hits, std::string label, bool returnHandles) {
+
+    if (!HepEVD::isServerInitialised())
+        return nb::none();
+
+    std::vector<T> hepEVDHits = getHits<T>(hits, label);
+    const size_t numHits = hepEVDHits.size();
+    const size_t firstHit = addHitsToServer(std::move(hepEVDHits));
+
+    if (!returnHandles)
+        return nb::none();
+
+    // Each hit's handle is just its index in the current state.
+    std::vector<int64_t> handles(numHits);
+    std::iota(handles.begin(), handles.end(), static_cast<int64_t>(firstHit));
+
+    return toNumpy(std::move(handles), {numHits});
+}
+
+void add_mc(nb::handle mcHits, std::string label) { add_hits<HepEVD::MCHit>(mcHits, label); }
+
+// Add the positions of any hits in the current state that aren't in
+// pythonHitMap yet, starting again if the state or its hit buffer changed.
+void updatePythonHitMap() {
+    const HepEVD::Hits &hits = HepEVD::getServer()->viewState()->m_hits;
+
+    if (hits.data() != pythonHitMapBlock || hits.size() < pythonHitMapSize) {
+        pythonHitMapBlock = hits.data();
+        pythonHitMapSize = 0;
     }
 
-    if constexpr (std::is_same_v<T, HepEVD::MCHit>) {
-        HepEVD::hepEVDLog("Adding " + std::to_string(hepEVDHits.size()) + " MC hits to the HepEVD server.");
-        HepEVD::getServer()->addMCHits(hepEVDHits);
-    } else {
-        HepEVD::hepEVDLog("Adding " + std::to_string(hepEVDHits.size()) + " hits to the HepEVD server.");
-        HepEVD::getServer()->addHits(hepEVDHits);
+    pythonHitMap.reserve(pythonHitMap.size() + hits.size() - pythonHitMapSize);
+    for (size_t i = pythonHitMapSize; i < hits.size(); ++i) {
+        const HepEVD::Position &pos = hits[i].getPosition();
+        pythonHitMap[std::make_tuple(pos.x, pos.y, pos.z, hits[i].getEnergy())] = hits[i].getId();
     }
+
+    pythonHitMapSize = hits.size();
 }
 
 void set_hit_properties(nb::handle hit, nb::dict properties) {
@@ -142,6 +317,7 @@ void set_hit_properties(nb::handle hit, nb::dict properties) {
     auto data = getItems(hit, 0, 4);
     RawHit inputHit = std::make_tuple(data[0], data[1], data[2], data[3]);
 
+    updatePythonHitMap();
     if (!pythonHitMap.count(inputHit))
         throw std::runtime_error("HepEVD: No hit exists with the given position");
 
@@ -158,8 +334,123 @@ void set_hit_properties(nb::handle hit, nb::dict properties) {
     }
 }
 
+// The hits as columns, built without needing Python.
+struct HitColumns {
+    std::vector<double> rows;
+    size_t numColumns;
+    std::map<std::string, std::vector<double>> properties;
+};
+
+// Write out the hits as rows of (x, y, z, energy, [PDG], dimension, view), the
+// same layout add_hits takes, along with a column for each property.
+template <typename T> HitColumns getHitColumns(const std::vector<const T *> &hits) {
+
+    HitColumns columns;
+    columns.numColumns = std::is_same_v<T, HepEVD::MCHit> ? 7 : 6;
+    columns.rows.resize(hits.size() * columns.numColumns);
+
+    // Every property gets a column, with NaN for any hits without it.
+    for (const T *hit : hits) {
+        for (const auto &property : hit->getProperties()) {
+            const std::string &name = std::get<0>(property.first);
+            if (columns.properties.count(name) == 0)
+                columns.properties[name].assign(hits.size(), std::numeric_limits<double>::quiet_NaN());
+        }
+    }
+
+    std::vector<size_t> rows(hits.size());
+    std::iota(rows.begin(), rows.end(), 0);
+
+    HepEVD::parallel_process(rows, [&](auto begin, auto end) {
+        for (auto row = begin; row != end; ++row) {
+            const T *hit = hits[*row];
+            const HepEVD::Position &pos = hit->getPosition();
+            double *out = columns.rows.data() + *row * columns.numColumns;
+
+            *out++ = pos.x;
+            *out++ = pos.y;
+            *out++ = pos.z;
+            *out++ = hit->getEnergy();
+            if constexpr (std::is_same_v<T, HepEVD::MCHit>)
+                *out++ = hit->getPDG();
+            *out++ = static_cast<double>(pos.dim);
+            *out++ = static_cast<double>(pos.hitType);
+
+            for (const auto &property : hit->getProperties())
+                columns.properties.find(std::get<0>(property.first))->second[*row] = property.second;
+        }
+        return true;
+    });
+
+    return columns;
+}
+
+template <typename T> nb::tuple hits_to_numpy(const std::vector<const T *> &hits) {
+
+    HitColumns columns;
+    {
+        nb::gil_scoped_release release;
+        columns = getHitColumns(hits);
+    }
+
+    nb::dict properties;
+    for (auto &column : columns.properties)
+        properties[column.first.c_str()] = toNumpy(std::move(column.second), {hits.size()});
+
+    return nb::make_tuple(toNumpy(std::move(columns.rows), {hits.size(), columns.numColumns}), properties);
+}
+
+template <typename T> nb::object get_hits() {
+
+    if (!HepEVD::isServerInitialised())
+        return nb::none();
+
+    // Share the hits, rather than reading them in place, so they can't be
+    // changed whilst being read without the GIL.
+    const HepEVD::EventState *state = HepEVD::getServer()->viewState();
+    const auto hits = [&]() {
+        if constexpr (std::is_same_v<T, HepEVD::MCHit>)
+            return state->m_mcHits;
+        else
+            return state->m_hits;
+    }();
+
+    std::vector<const T *> hitPointers;
+    hitPointers.reserve(hits.size());
+    for (const T &hit : hits)
+        hitPointers.push_back(&hit);
+
+    return hits_to_numpy(hitPointers);
+}
+
+void set_hit_properties_bulk(nb::handle handles, nb::dict properties) {
+
+    if (!HepEVD::isServerInitialised())
+        return;
+
+    std::vector<size_t> hitIndices;
+    for (const int64_t handle : getIndices(handles, "Handles")) {
+        if (handle < 0)
+            throw std::runtime_error("HepEVD: Hit handles must not be negative");
+        hitIndices.push_back(handle);
+    }
+
+    HepEVD::HitPropertyColumns columns;
+
+    for (auto &column : getNamedColumns(properties)) {
+        const auto type = column.categoric ? HepEVD::PropertyType::CATEGORIC : HepEVD::PropertyType::NUMERIC;
+        columns[{column.name, type}] = std::move(column.values);
+    }
+
+    HepEVD::getServer()->addHitProperties(hitIndices, columns);
+}
+
 // Instantiate the templated functions.
-template void add_hits<HepEVD::Hit>(nb::handle hits, std::string label);
-template void add_hits<HepEVD::MCHit>(nb::handle hits, std::string label);
+template nb::object add_hits<HepEVD::Hit>(nb::handle hits, std::string label, bool returnHandles);
+template nb::object add_hits<HepEVD::MCHit>(nb::handle hits, std::string label, bool returnHandles);
+template std::vector<HepEVD::Hit> getHits<HepEVD::Hit>(nb::handle hits, const std::string &label);
+template nb::tuple hits_to_numpy<HepEVD::Hit>(const std::vector<const HepEVD::Hit *> &hits);
+template nb::object get_hits<HepEVD::Hit>();
+template nb::object get_hits<HepEVD::MCHit>();
 
 } // namespace HepEVD_py
@@ -3,11 +3,21 @@
 #ifndef HEP_EVD_PY_ARRAY_UTILS_HPP
 #define HEP_EVD_PY_ARRAY_UTILS_HPP
 
+// Include the HepEVD header files.
+#define HEP_EVD_BASE_HELPER 1
+#include "hep_evd.h"
+
 // Standard includes
+#include <cstdint>
+#include <initializer_list>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <vector>
 
 // Include nanobind
 #include <nanobind/nanobind.h>
+#include <nanobind/ndarray.h>
 namespace nb = nanobind;
 
 namespace HepEVD_py {
@@ -24,6 +34,55 @@ using BasicSizeInfo = std::vector<int>;
  */
 bool isArrayOrList(nb::handle obj);
 
+/**
+ * Check if the given object can be read through the Arrow PyCapsule interface,
+ * such as a PyArrow array, record batch or table, or a Polars series or dataframe.
+ *
+ * @param obj The object to check
+ *
+ * @return True if the object has an __arrow_c_array__ or __arrow_c_stream__ method
+ */
+bool isArrow(nb::handle obj);
+
+/**
+ * Reads the given Arrow object in place, through the array interface if it
+ * has one, or the stream interface otherwise. The capsules keep ownership of
+ * the data, so the read functions must not keep hold of it. Both are called
+ * without the GIL.
+ *
+ * @param obj The Arrow object to read
+ * @param readArray Called with the ArrowSchema and ArrowArray, for a single array
+ * @param readStream Called with the ArrowArrayStream, for a stream of arrays
+ *
+ * @return The result of whichever read function was called
+ *
+ * @throws nb::python_error if the object returns the wrong capsules
+ */
+template <typename ReadArray, typename ReadStream>
+auto readArrow(nb::handle obj, ReadArray readArray, ReadStream readStream) {
+
+    if (nb::hasattr(obj, "__arrow_c_array__")) {
+        const nb::tuple capsules = nb::cast<nb::tuple>(obj.attr("__arrow_c_array__")());
+        const auto *schema = static_cast<const ArrowSchema *>(PyCapsule_GetPointer(capsules[0].ptr(), "arrow_schema"));
+        const auto *array = static_cast<const ArrowArray *>(PyCapsule_GetPointer(capsules[1].ptr(), "arrow_array"));
+
+        if (schema == nullptr || array == nullptr)
+            throw nb::python_error();
+
+        nb::gil_scoped_release release;
+        return readArray(*schema, *array);
+    }
+
+    const nb::object capsule = obj.attr("__arrow_c_stream__")();
+    auto *stream = static_cast<ArrowArrayStream *>(PyCapsule_GetPointer(capsule.ptr(), "arrow_array_stream"));
+
+    if (stream == nullptr)
+        throw nb::python_error();
+
+    nb::gil_scoped_release release;
+    return readStream(*stream);
+}
+
 /**
  * Retrieves items from the given object based on index and size.
  *
@@ -48,6 +107,163 @@ std::vector<double> getItems(nb::handle obj, int index, int size);
  */
 BasicSizeInfo getBasicSizeInfo(nb::handle obj);
 
+/**
+ * Get a 1D list/array of integers, such as offsets or indices into another array.
+ *
+ * @param obj The list/array to read
+ * @param name The name of the argument, for any error messages
+ *
+ * @return The values, as 64-bit integers
+ *
+ * @throws std::runtime_error if the object isn't a 1D list/array
+ */
+std::vector<int64_t> getIndices(nb::handle obj, const std::string &name);
+
+/**
+ * Get a 1D list/array of numbers, such as a column of values for every hit.
+ *
+ * @param obj The list/array to read
+ * @param name The name of the argument, for any error messages
+ *
+ * @return The values, as doubles
+ *
+ * @throws std::runtime_error if the object isn't a 1D list/array
+ */
+std::vector<double> getColumn(nb::handle obj, const std::string &name);
+
+/**
+ * A named column of values, from a dict of columns, a structured array or a dataframe.
+ * Categorical columns hold the code of each category, with NaN for missing values.
+ */
+struct NamedColumn {
+    std::string name;
+    std::vector<double> values;
+    bool categoric;
+};
+
+/**
+ * Check if the given object is a set of named columns, rather than a single
+ * array: a dict of columns, a NumPy structured array, or a pandas / Polars dataframe.
+ *
+ * @param obj The object to check
+ *
+ * @return True if the object's columns can be read by name
+ */
+bool isNamedColumns(nb::handle obj);
+
+/**
+ * Get every column of a dict of columns, a NumPy structured array, or a
+ * pandas / Polars dataframe. Each column can be anything getColumn can read,
+ * or a pandas / Polars series, with categorical columns read as their codes.
+ *
+ * @param obj The named columns to read
+ *
+ * @return The columns, in their original order
+ *
+ * @throws std::runtime_error if any column isn't numeric or categorical
+ */
+std::vector<NamedColumn> getNamedColumns(nb::handle obj);
+
+// A float16 value, as stored in the array.
+struct Half {
+    uint16_t bits;
+};
+
+inline double toDouble(const Half value) { return HepEVD::halfToDouble(value.bits); }
+template <typename T> inline double toDouble(const T value) { return static_cast<double>(value); }
+
+/**
+ * A read-only view of a 2D array, that reads values in place using the
+ * array's own strides, rather than needing a converted or contiguous copy.
+ * A 1D array is viewed as a single column.
+ */
+template <typename T> struct StridedArray {
+    const T *data;
+    int64_t rowStride;
+    int64_t colStride;
+
+    double operator()(const size_t row, const size_t col) const {
+        return toDouble(data[row * rowStride + col * colStride]);
+    }
+};
+
+/**
+ * Calls the given function with a StridedArray of the right type for the
+ * given 1D or 2D array, such that any numeric dtype can be read without conversion.
+ *
+ * @param array The array to read
+ * @param func The function to call, with the StridedArray
+ *
+ * @throws std::runtime_error if the array isn't a 1D or 2D, numeric array on the CPU
+ */
+template <typename Func> void visitArray(const nb::ndarray<> &array, Func func) {
+
+    if (array.ndim() != 1 && array.ndim() != 2)
+        throw std::runtime_error("HepEVD: Array must be 1D or 2D");
+
+    if (array.device_type() != nb::device::cpu::value)
+        throw std::runtime_error("HepEVD: Array must be on the CPU");
+
+    auto visit = [&](auto *typedData) {
+        using T = std::remove_const_t<std::remove_pointer_t<decltype(typedData)>>;
+        const int64_t colStride = array.ndim() == 2 ? array.stride(1) : 0;
+        func(StridedArray<T>{static_cast<const T *>(array.data()), array.stride(0), colStride});
+    };
+
+    const nb::dlpack::dtype dtype = array.dtype();
+    const auto code = static_cast<nb::dlpack::dtype_code>(dtype.code);
+
+    if (dtype.lanes == 1 && code == nb::dlpack::dtype_code::Float) {
+        switch (dtype.bits) {
+        case 16:
+            return visit(static_cast<const Half *>(nullptr));
+        case 32:
+            return visit(static_cast<const float *>(nullptr));
+        case 64:
+            return visit(static_cast<const double *>(nullptr));
+        }
+    } else if (dtype.lanes == 1 && code == nb::dlpack::dtype_code::Int) {
+        switch (dtype.bits) {
+        case 8:
+            return visit(static_cast<const int8_t *>(nullptr));
+        case 16:
+            return visit(static_cast<const int16_t *>(nullptr));
+        case 32:
+            return visit(static_cast<const int32_t *>(nullptr));
+        case 64:
+            return visit(static_cast<const int64_t *>(nullptr));
+        }
+    } else if (dtype.lanes == 1 && code == nb::dlpack::dtype_code::UInt) {
+        switch (dtype.bits) {
+        case 8:
+            return visit(static_cast<const uint8_t *>(nullptr));
+        case 16:
+            return visit(static_cast<const uint16_t *>(nullptr));
+        case 32:
+            return visit(static_cast<const uint32_t *>(nullptr));
+        case 64:
+            return visit(static_cast<const uint64_t *>(nullptr));
+        }
+    }
+
+    throw std::runtime_error("HepEVD: Unsupported array dtype, must be a float or integer type");
+}
+
+/**
+ * Hand the given values over to a new NumPy array, without copying them.
+ * The array takes ownership of the values, so they live as long as it does.
+ *
+ * @param values The values, in row-major order
+ * @param shape The shape of the array
+ *
+ * @return The NumPy array
+ */
+template <typename T> nb::object toNumpy(std::vector<T> values, std::initializer_list<size_t> shape) {
+    auto *owned = new std::vector<T>(std::move(values));
+    nb::capsule owner(owned, [](void *p) noexcept { delete static_cast<std::vector<T> *>(p); });
+    return nb::cast(nb::ndarray<nb::numpy, T>(owned->data(), shape, owner));
+}
+
 } // namespace HepEVD_py
 
 #endif // HEP_EVD_PY_ARRAY_UTILS_HPP
\ No newline at end of file
@@ -8,27 +8,68 @@
 #include "hep_evd.h"
 
 // STD includes
-#include <map>
+#include <functional>
+#include <optional>
 #include <tuple>
+#include <unordered_map>
 
 // Include nanobind
 #include <nanobind/nanobind.h>
 #include <nanobind/stl/string.h>
+namespace nb = nanobind;
 
 namespace HepEVD_py {
 
 // Map from Python types to HepEVD types.
+// This is hashed, not sorted, as it can be filled with millions of hits at once.
 using RawHit = std::tuple<double, double, double, double>;
-using PythonHitMap = std::map<RawHit, std::string>;
+struct RawHitHash {
+    size_t operator()(const RawHit &hit) const {
+        size_t hash = 0;
+        for (const double value : {std::get<0>(hit), std::get<1>(hit), std::get<2>(hit), std::get<3>(hit)})
+            hash ^= std::hash<double>()(value) + 0x9e3779b9 + (hash << 6) + (hash >> 2);
+        return hash;
+    }
+};
+using PythonHitMap = std::unordered_map<RawHit, std::string, RawHitHash>;
 inline PythonHitMap pythonHitMap;
 
+// How many of the current state's hits are in pythonHitMap. The map is only
+// needed to look hits up by position, so is filled in then, not as hits are added.
+inline const HepEVD::Hit *pythonHitMapBlock = nullptr;
+inline size_t pythonHitMapSize = 0;
+
 /**
  * Starts the server with the given start state and clear on show option.
  *
  * @param startState The start state of the server. (default: -1)
  * @param clearOnShow Whether to clear the server on show. (default: true)
+ * @param background Whether to run the server in the background and return straight away. (default: false)
  */
-void start_server(const int startState = -1, const bool clearOnShow = true);
+void start_server(const int startState = -1, const bool clearOnShow = true, const bool background = false);
+
+/**
+ * Stops the server, if it is running in the background.
+ */
+void stop_server();
+
+/**
+ * Call guard for any binding that changes the server, such that the server
+ * can't read a state whilst it is changed, if running in the background.
+ * The GIL is released whilst waiting, as the server may be mid-request.
+ * This is the same lock the C++ helpers take, so they don't take it again.
+ */
+struct UpdateGuard {
+    UpdateGuard() {
+        if (HepEVD::hepEVDServer == nullptr || !HepEVD::hepEVDServer->isRunning())
+            return;
+
+        nb::gil_scoped_release release;
+        lock.emplace();
+    }
+
+    std::optional<HepEVD::ServerUpdateLock> lock;
+};
 
 } // namespace HepEVD_py
 
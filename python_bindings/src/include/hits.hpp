@@ -5,6 +5,7 @@
 
 // Standard includes
 #include <string>
+#include <vector>
 
 // Include nanobind headers
 #include <nanobind/nanobind.h>
@@ -17,8 +18,52 @@ namespace HepEVD_py {
  *
  * @param hits The handle to the list/array of hits.
  * @param label The optional label for the hits (default: empty string).
+ * @param returnHandles Whether to return the handle of each hit (default: false).
+ *
+ * @return None, or an array of the integer handle of each hit, for use with add_hit_properties_bulk.
+ */
+template <typename T> nb::object add_hits(nb::handle hits, std::string label = "", bool returnHandles = false);
+
+/**
+ * Add the given list/array of MC hits to the server.
+ *
+ * @param mcHits The handle to the list/array of MC hits.
+ * @param label The optional label for the MC hits (default: empty string).
+ */
+void add_mc(nb::handle mcHits, std::string label = "");
+
+/**
+ * Build hits from the given list/array of hits, without adding them to the server.
+ * Arrays and Arrow record batches / tables are read in place, in parallel, and
+ * without holding the GIL. Arrow columns are read by name, with any extra
+ * numeric columns added as properties.
+ *
+ * @param hits The handle to the list/array/Arrow table of hits.
+ * @param label The label for the hits.
+ *
+ * @return The hits, in the same order as the rows of the input.
  */
-template <typename T> void add_hits(nb::handle hits, std::string label = "");
+template <typename T> std::vector<T> getHits(nb::handle hits, const std::string &label);
+
+/**
+ * Get the hits of the current state, as a NumPy array in the same layout
+ * add_hits / add_mc take, with the dimension and view columns always included,
+ * along with a dictionary of a NumPy array for each property (NaN where a hit
+ * doesn't have that property).
+ *
+ * @return A tuple of the hits array and the properties dictionary, or None if the server isn't initialised.
+ */
+template <typename T> nb::object get_hits();
+
+/**
+ * Convert the given hits to a NumPy array and a dictionary of property arrays.
+ * The arrays are built in parallel without the GIL, and then handed to NumPy without a copy.
+ *
+ * @param hits The hits to convert.
+ *
+ * @return A tuple of the hits array and the properties dictionary.
+ */
+template <typename T> nb::tuple hits_to_numpy(const std::vector<const T *> &hits);
 
 /**
  * Apply properties to the given hit.
@@ -28,6 +73,15 @@ template <typename T> void add_hits(nb::handle hits, std::string label = "");
  */
 void set_hit_properties(nb::handle hit, nb::dict properties);
 
+/**
+ * Apply whole columns of properties to many hits at once.
+ *
+ * @param handles The handles of the hits, as returned by add_hits.
+ * @param properties The dictionary of property names to a list/array/series of values, one per hit.
+ *                   Categorical series are added as categoric properties.
+ */
+void set_hit_properties_bulk(nb::handle handles, nb::dict properties);
+
 } // namespace HepEVD_py
 
 #endif // HEP_EVD_PY_HITS_HPP
\ No newline at end of file
@@ -3,6 +3,10 @@
 #ifndef HEP_EVD_PY_MARKERS_HPP
 #define HEP_EVD_PY_MARKERS_HPP
 
+// Include the HepEVD header files.
+#define HEP_EVD_BASE_HELPER 1
+#include "hep_evd.h"
+
 // Include nanobind headers
 #include <nanobind/nanobind.h>
 namespace nb = nanobind;
@@ -23,6 +27,46 @@ void init_marker_classes(nb::module_ &m);
  */
 void add_markers(nb::handle markers);
 
+/**
+ * Adds a point marker for every row of the given array, in one go.
+ *
+ * @param positions The (N, 3) list/array of positions.
+ * @param colours The colour of every point, or of each point (default: none).
+ * @param labels The label of every point, or of each point (default: none).
+ * @param dim The dimension of the points (default: 3D).
+ * @param view The view of the points (default: general).
+ */
+void add_points(nb::handle positions, nb::handle colours = nb::none(), nb::handle labels = nb::none(),
+                HepEVD::HitDimension dim = HepEVD::THREE_D, HepEVD::HitType view = HepEVD::GENERAL);
+
+/**
+ * Adds a line marker between every pair of start and end positions, in one go.
+ *
+ * @param starts The (N, 3) list/array of start positions.
+ * @param ends The (N, 3) list/array of end positions.
+ * @param colours The colour of every line, or of each line (default: none).
+ * @param labels The label of every line, or of each line (default: none).
+ * @param dim The dimension of the lines (default: 3D).
+ * @param view The view of the lines (default: general).
+ */
+void add_lines(nb::handle starts, nb::handle ends, nb::handle colours = nb::none(), nb::handle labels = nb::none(),
+               HepEVD::HitDimension dim = HepEVD::THREE_D, HepEVD::HitType view = HepEVD::GENERAL);
+
+/**
+ * Adds a ring marker around every centre, in one go.
+ *
+ * @param centres The (N, 3) list/array of ring centres.
+ * @param inner The inner radius of every ring, or of each ring.
+ * @param outer The outer radius of every ring, or of each ring.
+ * @param colours The colour of every ring, or of each ring (default: none).
+ * @param labels The label of every ring, or of each ring (default: none).
+ * @param dim The dimension of the rings (default: 3D).
+ * @param view The view of the rings (default: general).
+ */
+void add_rings(nb::handle centres, nb::handle inner, nb::handle outer, nb::handle colours = nb::none(),
+               nb::handle labels = nb::none(), HepEVD::HitDimension dim = HepEVD::THREE_D,
+               HepEVD::HitType view = HepEVD::GENERAL);
+
 } // namespace HepEVD_py
 
 #endif // HEP_EVD_PY_MARKERS_HPP
\ No newline at end of file
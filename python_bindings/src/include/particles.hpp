@@ -15,10 +15,29 @@ namespace HepEVD_py {
 /**
  * Add the given list/array of particles to the server.
  *
- * @param particles The handle to the list/array of particles.
+ * Particles can either be a (P, H, Y) list/array, with the same number of hits
+ * for every particle, or a flat (NHits, Y) list/array of every hit along with
+ * either the offsets or counts of each particle's hits.
+ *
+ * @param particles The handle to the list/array of particles, or of every hit.
  * @param label The optional label for the particles (default: empty string).
+ * @param offsets The optional offsets of the first hit of each particle, plus the end of the last,
+ *                which must be the number of hits.
+ * @param counts The optional number of hits in each particle.
+ * @param parents The optional index of the parent of each particle, or -1 if it has none.
+ */
+void add_particles(nb::handle particles, std::string label = "", nb::handle offsets = nb::none(),
+                   nb::handle counts = nb::none(), nb::handle parents = nb::none());
+
+/**
+ * Get the particles of the current state, as a flat NumPy array of every
+ * particle hit, along with the offsets of each particle's hits and the index
+ * of each particle's parent (or -1), i.e. the layout add_particles takes.
+ *
+ * @return A tuple of the hits, offsets, parents and a dictionary of hit properties,
+ *         or None if the server isn't initialised.
  */
-void add_particles(nb::handle particles, std::string label = "");
+nb::object get_particles();
 
 } // namespace HepEVD_py
 
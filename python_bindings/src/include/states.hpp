@@ -0,0 +1,49 @@
+// states.hpp
+
+#ifndef HEP_EVD_PY_STATES_HPP
+#define HEP_EVD_PY_STATES_HPP
+
+// Standard includes
+#include <string>
+
+// Include nanobind headers
+#include <nanobind/nanobind.h>
+namespace nb = nanobind;
+
+namespace HepEVD_py {
+
+/**
+ * A whole event state, encoded as a compact binary state block (the same
+ * one archives use), such that it can be pickled and sent between processes.
+ */
+struct StatePayload {
+    std::string data;
+};
+
+/**
+ * Initializes the state classes for the given module.
+ *
+ * @param m The module to initialize the state classes for.
+ */
+void init_state_classes(nb::module_ &m);
+
+/**
+ * Gets the current state, encoded such that it can be sent to another process.
+ *
+ * @param name The optional name to give the state first, as with save_state (default: empty string).
+ *
+ * @return The encoded state, or None if the server isn't initialised.
+ */
+nb::object get_state(const std::string &name = "");
+
+/**
+ * Adds every given state to the server, after any existing ones.
+ * The states are decoded in parallel, without holding the GIL.
+ *
+ * @param states The list of encoded states, as returned by get_state.
+ */
+void merge_states(nb::handle states);
+
+} // namespace HepEVD_py
+
+#endif // HEP_EVD_PY_STATES_HPP
@@ -90,7 +90,150 @@ void add_markers(nb::handle markers) {
     }
 
     // Finally, add the markers
-    HepEVD::addMarkers(hepEVDMarkers);
+    HepEVD::addMarkers(std::move(hepEVDMarkers));
+}
+
+// Read an (N, 3) list/array of positions, reading arrays in place.
+std::vector<HepEVD::PosArray> getPositions(nb::handle positions, const std::string &name) {
+
+    if (!isArrayOrList(positions))
+        throw std::runtime_error("HepEVD: " + name + " must be an array or list");
+
+    const BasicSizeInfo size = getBasicSizeInfo(positions);
+
+    if (size.size() != 2 || size[1] != 3)
+        throw std::runtime_error("HepEVD: " + name + " must be an (N, 3) array or list");
+
+    std::vector<HepEVD::PosArray> result(size[0]);
+
+    if (nb::isinstance<nb::ndarray<>>(positions)) {
+        visitArray(nb::cast<nb::ndarray<>>(positions), [&](const auto &view) {
+            for (size_t i = 0; i < result.size(); ++i)
+                result[i] = {view(i, 0), view(i, 1), view(i, 2)};
+        });
+        return result;
+    }
+
+    for (size_t i = 0; i < result.size(); ++i) {
+        const auto items = getItems(positions, i, 3);
+        result[i] = {items[0], items[1], items[2]};
+    }
+
+    return result;
+}
+
+// Read either a single string to use for every marker, or one per marker.
+std::vector<std::string> getStrings(nb::handle strings, const size_t count, const std::string &name) {
+
+    if (strings.is_none())
+        return std::vector<std::string>(count);
+    if (nb::isinstance<nb::str>(strings))
+        return std::vector<std::string>(count, nb::cast<std::string>(strings));
+
+    std::vector<std::string> result;
+    result.reserve(count);
+    for (nb::handle item : strings)
+        result.push_back(nb::cast<std::string>(nb::str(item)));
+
+    if (result.size() != count)
+        throw std::runtime_error("HepEVD: " + name + " must be a string or have one per marker, not " +
+                                 std::to_string(result.size()));
+
+    return result;
+}
+
+// Read either a single number to use for every marker, or one per marker.
+std::vector<double> getNumbers(nb::handle numbers, const size_t count, const std::string &name) {
+
+    if (nb::isinstance<nb::float_>(numbers) || nb::isinstance<nb::int_>(numbers))
+        return std::vector<double>(count, nb::cast<double>(numbers));
+
+    std::vector<double> result = getColumn(numbers, name);
+
+    if (result.size() != count)
+        throw std::runtime_error("HepEVD: " + name + " must be a number or have one per marker, not " +
+                                 std::to_string(result.size()));
+
+    return result;
+}
+
+// Finish off and add markers built from arrays, with the shared settings and
+// each marker's colour and label.
+template <typename T>
+void addMarkersFromArrays(std::vector<T> markers, const std::vector<std::string> &colours,
+                          const std::vector<std::string> &labels, const HepEVD::HitDimension dim,
+                          const HepEVD::HitType view) {
+
+    HepEVD::Markers hepEVDMarkers;
+    hepEVDMarkers.reserve(markers.size());
+
+    for (size_t i = 0; i < markers.size(); ++i) {
+        T &marker = markers[i];
+        marker.setDim(dim);
+        marker.setHitType(view);
+        marker.setColour(colours[i]);
+        marker.setLabel(labels[i]);
+        hepEVDMarkers.emplace_back(std::move(marker));
+    }
+
+    HepEVD::addMarkers(std::move(hepEVDMarkers));
+}
+
+void add_points(nb::handle positions, nb::handle colours, nb::handle labels, HepEVD::HitDimension dim,
+                HepEVD::HitType view) {
+
+    if (!HepEVD::isServerInitialised())
+        return;
+
+    const std::vector<HepEVD::PosArray> points = getPositions(positions, "Positions");
+
+    std::vector<HepEVD::Point> markers;
+    markers.reserve(points.size());
+    for (const auto &point : points)
+        markers.emplace_back(point);
+
+    addMarkersFromArrays(std::move(markers), getStrings(colours, points.size(), "Colours"),
+                         getStrings(labels, points.size(), "Labels"), dim, view);
+}
+
+void add_lines(nb::handle starts, nb::handle ends, nb::handle colours, nb::handle labels, HepEVD::HitDimension dim,
+               HepEVD::HitType view) {
+
+    if (!HepEVD::isServerInitialised())
+        return;
+
+    const std::vector<HepEVD::PosArray> lineStarts = getPositions(starts, "Starts");
+    const std::vector<HepEVD::PosArray> lineEnds = getPositions(ends, "Ends");
+
+    if (lineStarts.size() != lineEnds.size())
+        throw std::runtime_error("HepEVD: Starts and ends must be the same length");
+
+    std::vector<HepEVD::Line> markers;
+    markers.reserve(lineStarts.size());
+    for (size_t i = 0; i < lineStarts.size(); ++i)
+        markers.emplace_back(lineStarts[i], lineEnds[i]);
+
+    addMarkersFromArrays(std::move(markers), getStrings(colours, lineStarts.size(), "Colours"),
+                         getStrings(labels, lineStarts.size(), "Labels"), dim, view);
+}
+
+void add_rings(nb::handle centres, nb::handle inner, nb::handle outer, nb::handle colours, nb::handle labels,
+               HepEVD::HitDimension dim, HepEVD::HitType view) {
+
+    if (!HepEVD::isServerInitialised())
+        return;
+
+    const std::vector<HepEVD::PosArray> ringCentres = getPositions(centres, "Centres");
+    const std::vector<double> innerRadii = getNumbers(inner, ringCentres.size(), "Inner radii");
+    const std::vector<double> outerRadii = getNumbers(outer, ringCentres.size(), "Outer radii");
+
+    std::vector<HepEVD::Ring> markers;
+    markers.reserve(ringCentres.size());
+    for (size_t i = 0; i < ringCentres.size(); ++i)
+        markers.emplace_back(ringCentres[i], innerRadii[i], outerRadii[i]);
+
+    addMarkersFromArrays(std::move(markers), getStrings(colours, ringCentres.size(), "Colours"),
+                         getStrings(labels, ringCentres.size(), "Labels"), dim, view);
 }
 
 } // namespace HepEVD_py
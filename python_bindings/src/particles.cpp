@@ -4,7 +4,9 @@
 
 // Standard includes
 #include <iostream>
+#include <iterator>
 #include <map>
+#include <unordered_map>
 #include <vector>
 
 // Include the HepEVD header files.
@@ -25,10 +27,73 @@ namespace nb = nanobind;
 
 namespace HepEVD_py {
 
-void add_particles(nb::handle particles, std::string label) {
+// Build particles from a flat array of every hit, along with the offsets of
+// where each particle's hits start, and the end of the last particle.
+// This is the CSR layout used by awkward-array, uproot, PyTorch Geometric etc.
+HepEVD::Particles getRaggedParticles(nb::handle hits, const std::vector<int64_t> &offsets, const std::string &label) {
 
-    if (!HepEVD::isServerInitialised())
-        return;
+    HepEVD::Hits flatHits = getHits<HepEVD::Hit>(hits, label);
+    const int64_t numHits = flatHits.size();
+
+    if (offsets.empty())
+        throw std::runtime_error("HepEVD: Offsets must have one more entry than there are particles");
+
+    for (size_t i = 0; i < offsets.size(); i++) {
+        const int64_t start = offsets[i];
+        const int64_t end = i + 1 < offsets.size() ? offsets[i + 1] : numHits;
+
+        if (start < 0 || start > end || end > numHits)
+            throw std::runtime_error("HepEVD: Offsets must be increasing, and within the " + std::to_string(numHits) +
+                                     " hits given");
+    }
+
+    // Any hits past the last offset would otherwise be silently dropped.
+    if (offsets.back() != numHits)
+        throw std::runtime_error("HepEVD: The last offset must be the number of hits, " + std::to_string(numHits) +
+                                 " not " + std::to_string(offsets.back()));
+
+    // Now just move each range of hits into its particle.
+    nb::gil_scoped_release release;
+
+    HepEVD::Particles hepEVDParticles;
+    hepEVDParticles.reserve(offsets.size() - 1);
+
+    for (size_t i = 0; i + 1 < offsets.size(); i++) {
+        HepEVD::Particle hepParticle({}, HepEVD::getUUID(), label);
+        hepParticle.getHits().assign(std::make_move_iterator(flatHits.begin() + offsets[i]),
+                                     std::make_move_iterator(flatHits.begin() + offsets[i + 1]));
+        hepEVDParticles.push_back(std::move(hepParticle));
+    }
+
+    return hepEVDParticles;
+}
+
+// Link each particle to its parent, given as the index of another particle,
+// or a negative number if it has no parent.
+void setParents(HepEVD::Particles &hepEVDParticles, const std::vector<int64_t> &parents) {
+
+    const int64_t numParticles = hepEVDParticles.size();
+
+    if (static_cast<int64_t>(parents.size()) != numParticles)
+        throw std::runtime_error("HepEVD: Parents must have one entry per particle, expected " +
+                                 std::to_string(numParticles) + " not " + std::to_string(parents.size()));
+
+    for (int64_t i = 0; i < numParticles; i++) {
+        const int64_t parent = parents[i];
+
+        if (parent < 0)
+            continue;
+        else if (parent >= numParticles || parent == i)
+            throw std::runtime_error("HepEVD: Particle " + std::to_string(i) + " has an invalid parent index, " +
+                                     std::to_string(parent));
+
+        hepEVDParticles[i].setParentID(hepEVDParticles[parent].getID());
+        hepEVDParticles[parent].addChild(hepEVDParticles[i].getID());
+    }
+}
+
+// Build particles from a (P, H, Y) list or array, with a fixed number of hits per particle.
+HepEVD::Particles getNestedParticles(nb::handle particles, const std::string &label) {
 
     if (!isArrayOrList(particles))
         throw std::runtime_error("HepEVD: Particles must be an array or list");
@@ -108,9 +173,94 @@ void add_particles(nb::handle particles, std::string label) {
         hepEVDParticles.push_back(hepParticle);
     }
 
+    return hepEVDParticles;
+}
+
+void add_particles(nb::handle particles, std::string label, nb::handle offsets, nb::handle counts,
+                   nb::handle parents) {
+
+    if (!HepEVD::isServerInitialised())
+        return;
+
+    if (!offsets.is_none() && !counts.is_none())
+        throw std::runtime_error("HepEVD: Only one of offsets or counts should be given");
+
+    HepEVD::Particles hepEVDParticles;
+
+    if (!offsets.is_none()) {
+        hepEVDParticles = getRaggedParticles(particles, getIndices(offsets, "Offsets"), label);
+    } else if (!counts.is_none()) {
+        // Counts are the same as offsets, just without the running total.
+        const std::vector<int64_t> hitCounts = getIndices(counts, "Counts");
+        std::vector<int64_t> hitOffsets(1, 0);
+        hitOffsets.reserve(hitCounts.size() + 1);
+
+        for (const int64_t count : hitCounts) {
+            if (count < 0)
+                throw std::runtime_error("HepEVD: Counts must not be negative");
+            hitOffsets.push_back(hitOffsets.back() + count);
+        }
+
+        hepEVDParticles = getRaggedParticles(particles, hitOffsets, label);
+    } else {
+        hepEVDParticles = getNestedParticles(particles, label);
+    }
+
+    if (!parents.is_none())
+        setParents(hepEVDParticles, getIndices(parents, "Parents"));
+
     // Finally, we can add the particles to the HepEVD server.
     HepEVD::hepEVDLog("Adding " + std::to_string(hepEVDParticles.size()) + " particles to the HepEVD server.");
-    HepEVD::getServer()->addParticles(hepEVDParticles);
+    HepEVD::getServer()->addParticles(std::move(hepEVDParticles));
+}
+
+nb::object get_particles() {
+
+    if (!HepEVD::isServerInitialised())
+        return nb::none();
+
+    // Share the hits and copy the particles, rather than reading them in
+    // place, so they can't be changed whilst being read without the GIL.
+    const HepEVD::EventState *state = HepEVD::getServer()->viewState();
+    const HepEVD::HitBlock<HepEVD::Hit> stateHits = state->m_hits;
+    const HepEVD::HitBlock<HepEVD::Hit> particleHits = state->m_particleHits;
+    const std::vector<int64_t> hitRefs = state->m_particleHitRefs;
+    const HepEVD::Particles particles = state->m_particles;
+    const size_t numParticles = particles.size();
+
+    std::vector<const HepEVD::Hit *> hits;
+    std::vector<int64_t> offsets(1, 0);
+    std::vector<int64_t> parents(numParticles, -1);
+    {
+        nb::gil_scoped_release release;
+
+        hits.reserve(hitRefs.size());
+        offsets.reserve(numParticles + 1);
+
+        std::unordered_map<std::string, int64_t> particleIndices;
+        particleIndices.reserve(numParticles);
+
+        for (size_t i = 0; i < numParticles; i++) {
+            const HepEVD::Particle &particle = particles[i];
+            const size_t hitOffset = particle.getHitOffset();
+
+            for (size_t hit = 0; hit < particle.getNHits(); hit++)
+                hits.push_back(&HepEVD::resolveParticleHit(stateHits, particleHits, hitRefs[hitOffset + hit]));
+
+            offsets.push_back(hits.size());
+            particleIndices[particle.getID()] = i;
+        }
+
+        for (size_t i = 0; i < numParticles; i++) {
+            const auto parent = particleIndices.find(particles[i].getParentID());
+            if (parent != particleIndices.end())
+                parents[i] = parent->second;
+        }
+    }
+
+    nb::tuple hitArrays = hits_to_numpy(hits);
+    return nb::make_tuple(hitArrays[0], toNumpy(std::move(offsets), {numParticles + 1}),
+                          toNumpy(std::move(parents), {numParticles}), hitArrays[1]);
 }
 
 } // namespace HepEVD_py
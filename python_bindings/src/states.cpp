@@ -0,0 +1,107 @@
+//
+// State functions for the HepEVD Python Bindings
+//
+// Allows states to be built in other processes (i.e. a multiprocessing pool),
+// then sent back and merged into the one process that runs the server.
+
+// Standard includes
+#include <iterator>
+#include <new>
+#include <string>
+#include <vector>
+
+// Include the HepEVD header files.
+#define HEP_EVD_BASE_HELPER 1
+#include "hep_evd.h"
+
+// Local Includes
+#include "include/states.hpp"
+
+// Include nanobind
+#include <nanobind/nanobind.h>
+#include <nanobind/stl/string.h>
+
+namespace nb = nanobind;
+
+namespace HepEVD_py {
+
+// Check a state block before taking it, so a bad one fails straight away,
+// rather than when it is merged.
+StatePayload toPayload(nb::bytes bytes) {
+    std::string data(bytes.c_str(), bytes.size());
+    HepEVD::readArchiveSections(data.data(), data.size());
+    return StatePayload{std::move(data)};
+}
+
+void init_state_classes(nb::module_ &m) {
+
+    nb::class_<StatePayload>(m, "EventState",
+                             "A whole event state, encoded in a compact binary form. This can be pickled, "
+                             "so states can be built in worker processes and then merged into the server's process.")
+        .def_prop_ro("name",
+                     [](const StatePayload &payload) {
+                         return HepEVD::readArchiveString(payload.data.data(), payload.data.size(),
+                                                          HepEVD::ArchiveSectionType::NAME);
+                     })
+        .def("to_bytes",
+             [](const StatePayload &payload) { return nb::bytes(payload.data.data(), payload.data.size()); })
+        .def_static("from_bytes", &toPayload, nb::arg("data"))
+        .def("__getstate__",
+             [](const StatePayload &payload) { return nb::bytes(payload.data.data(), payload.data.size()); })
+        .def("__setstate__",
+             [](StatePayload &payload, nb::bytes bytes) { new (&payload) StatePayload(toPayload(bytes)); });
+}
+
+nb::object get_state(const std::string &name) {
+
+    if (!HepEVD::isServerInitialised())
+        return nb::none();
+
+    if (!name.empty())
+        HepEVD::getServer()->setName(name);
+
+    // Encode a copy, which shares the hits, so the state can't be
+    // changed whilst being encoded without the GIL.
+    const HepEVD::EventState state = *HepEVD::getServer()->viewState();
+    StatePayload payload;
+    {
+        nb::gil_scoped_release release;
+        payload.data = HepEVD::encodeEventState(state);
+    }
+
+    return nb::cast(std::move(payload));
+}
+
+void merge_states(nb::handle states) {
+
+    if (!HepEVD::isServerInitialised())
+        return;
+
+    std::vector<const StatePayload *> payloads;
+    for (nb::handle state : states) {
+        if (!nb::isinstance<StatePayload>(state))
+            throw std::runtime_error("HepEVD: States must be EventState objects, from get_state");
+        payloads.push_back(&nb::cast<const StatePayload &>(state));
+    }
+
+    std::vector<HepEVD::EventState> decodedStates;
+    {
+        nb::gil_scoped_release release;
+
+        auto chunks = HepEVD::parallel_process(payloads, [](auto begin, auto end) {
+            std::vector<HepEVD::EventState> chunk;
+            for (auto payload = begin; payload != end; ++payload)
+                chunk.push_back(HepEVD::decodeEventState((*payload)->data.data(), (*payload)->data.size()));
+            return chunk;
+        });
+
+        for (auto &chunk : chunks)
+            std::move(chunk.begin(), chunk.end(), std::back_inserter(decodedStates));
+    }
+
+    HepEVD::hepEVDLog("Merging " + std::to_string(decodedStates.size()) + " states into the HepEVD server.");
+    for (auto &state : decodedStates)
+        HepEVD::getServer()->appendEventState(std::move(state));
+}
+
+} // namespace HepEVD_py
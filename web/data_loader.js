@@ -101,6 +101,14 @@ async function getDataWithProgress(url) {
     position += chunk.length;
   }
 
+  // Exported state files may be gzip compressed.
+  if (url.endsWith(".gz")) {
+    const decompressed = new Blob([chunksAll])
+      .stream()
+      .pipeThrough(new DecompressionStream("gzip"));
+    chunksAll = new Uint8Array(await new Response(decompressed).arrayBuffer());
+  }
+
   let result = new TextDecoder("utf-8").decode(chunksAll);
 
   if (contentLength && contentLength > 250) loadingBar.style.display = "none";
@@ -108,6 +116,42 @@ async function getDataWithProgress(url) {
   return JSON.parse(result);
 }
 
+/**
+ * Rebuild the per-particle hit arrays from the particle hit indices.
+ *
+ * Particles are sent with only the hits the state doesn't already have,
+ * plus an array of hit indices, of which each particle references a range.
+ * A non-negative index is one of the state's own hits, and a negative one
+ * (-1 - i) is the i-th of the particle hits. Without any indices, each
+ * particle references a range of the particle hits directly. Older files
+ * instead nest the hits inside each particle, so pass those through.
+ *
+ * @param {Object|Array} particleData - The particle data, in any format.
+ * @param {Array} stateHits - The hits of the state the particles are from.
+ * @returns {Array} The particles, each with their own hits array.
+ */
+export function unpackParticles(particleData, stateHits = []) {
+  if (particleData === undefined) return [];
+  if (Array.isArray(particleData)) return particleData;
+
+  const hits = particleData.hits;
+  const hitIndices = particleData.hitIndices;
+
+  return particleData.particles.map((particle) => {
+    const end = particle.hitOffset + particle.hitCount;
+
+    if (hitIndices === undefined) {
+      particle.hits = hits.slice(particle.hitOffset, end);
+    } else {
+      particle.hits = hitIndices
+        .slice(particle.hitOffset, end)
+        .map((index) => (index >= 0 ? stateHits[index] : hits[-1 - index]));
+    }
+
+    return particle;
+  });
+}
+
 // Simple function to pull down all data from the server.
 async function loadServerData() {
   let detectorGeometry = getDataWithProgress("geometry");
@@ -144,7 +188,7 @@ async function loadServerData() {
     hits: hits,
     mcHits: mcHits,
     markers: markers,
-    particles: particles,
+    particles: unpackParticles(particles, hits),
     images: images,
     detectorGeometry: detectorGeometry,
     stateInfo: stateInfo,
@@ -169,7 +213,7 @@ async function updateExternalData() {
     hits: newStateData.hits,
     mcHits: newStateData.mcHits,
     markers: newStateData.markers,
-    particles: newStateData.particles,
+    particles: unpackParticles(newStateData.particles, newStateData.hits),
     images: newStateData.images || [],
     detectorGeometry: hepEVD_GLOBAL_STATE.state.detectorGeometry,
     stateInfo: newStateData.stateInfo || { mcTruth: "" },
@@ -206,6 +250,7 @@ async function loadExternalData(url) {
     !result.hasOwnProperty("states")
   ) {
     // This is the first format, so just return the data.
+    result.particles = unpackParticles(result.particles, result.hits);
     return result;
   }
 
@@ -239,7 +284,7 @@ async function loadExternalData(url) {
     hits: lastStateData.hits,
     mcHits: lastStateData.mcHits,
     markers: lastStateData.markers,
-    particles: lastStateData.particles,
+    particles: unpackParticles(lastStateData.particles, lastStateData.hits),
     images: lastStateData.images || [],
     detectorGeometry: result.detectorGeometry,
     stateInfo: lastStateData.stateInfo || { mcTruth: "" },
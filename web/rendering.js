@@ -198,6 +198,17 @@ export function onWindowResize(state, renderer) {
  * @return {HTMLImageElement} description of return value
  */
 export function renderImage(image) {
+  // Multi-channel images (e.g. per-class scores) are shown as the top score per pixel.
+  if (image.channels > 1) {
+    const planes = image.data;
+    image = {
+      ...image,
+      data: planes[0].map((row, r) =>
+        row.map((_, c) => Math.max(...planes.map((plane) => plane[r][c]))),
+      ),
+    };
+  }
+
   const dataValues = [...new Set(image.data.flat())];
   const maxValue = Math.max(...dataValues);
   const minValue = Math.min(...dataValues);